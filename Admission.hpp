@@ -0,0 +1,153 @@
+#ifndef HGUARD_ADMISSION
+#define HGUARD_ADMISSION
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Upstreams.hpp"
+
+/// Clients whose buckets are looked at before the idle ones are forgotten.
+#ifndef ADMISSION_CLIENTS
+#define ADMISSION_CLIENTS 4096
+#endif
+
+/// Decides, before any upstream work is done, whether a new TCP tunnel or
+/// UDP association may go ahead: each client address gets a token bucket
+/// limiting how quickly it can open them, and there's a cap on how many
+/// tunnels may be open at once (over every worker).
+///
+/// Shared by every thread of the server, so that a client whose
+/// connections the kernel spreads over several workers is still held to
+/// one rate. Only asked once per new tunnel or association, never per
+/// packet. The limits may be changed at any time (by a reload), and the
+/// tunnels already open still count towards the new ones.
+class Admission {
+private:
+    struct Bucket {
+        double tokens;
+        uint64_t updatedUs;
+    };
+
+    std::atomic<double> rate; // Tokens per microsecond, or 0 for no limit
+    std::atomic<double> burst;
+    std::atomic<size_t> maxTunnels; // 0 for no limit
+
+    std::mutex bucketsMutex;
+    std::unordered_map<Endpoint, Bucket, EndpointHash> buckets;
+    size_t forgetAt;
+
+    std::atomic<size_t> tunnels;
+
+public:
+    Admission():
+        rate(0),
+        burst(0),
+        maxTunnels(0),
+        forgetAt(ADMISSION_CLIENTS),
+        tunnels(0)
+    {
+    }
+
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+    /// Let each client open perSecond tunnels or associations a second,
+    /// or up to burst in one go. 0 for no limit.
+    void set_rate(double perSecond, double burst) {
+        std::lock_guard<std::mutex> lock(bucketsMutex);
+        rate.store(perSecond / 1e6, std::memory_order_relaxed);
+        this->burst.store(burst, std::memory_order_relaxed);
+    }
+
+    /// Allow at most count tunnels open at once. 0 for no limit.
+    void set_max_tunnels(size_t count) {
+        maxTunnels.store(count, std::memory_order_relaxed);
+    }
+
+    /// May client open a new tunnel? If so, tunnel_closed() must be
+    /// called once it's gone.
+    bool admit_tunnel(const Endpoint& client) {
+        // Counted even without a limit, in case one is set later.
+        size_t limit = maxTunnels.load(std::memory_order_relaxed);
+        if (tunnels.fetch_add(1, std::memory_order_relaxed) >= limit && limit > 0) {
+            tunnels.fetch_sub(1, std::memory_order_relaxed);
+            refused(client, Metric::REFUSED_CAPACITY, "tunnel limit reached");
+            return false;
+        }
+        if (!take_token(client)) {
+            tunnel_closed();
+            return false;
+        }
+        return true;
+    }
+
+    void tunnel_closed() {
+        tunnels.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /// May client open a new UDP association? (Their number is capped by
+    /// the server itself.)
+    bool admit_association(const Endpoint& client) {
+        return take_token(client);
+    }
+
+private:
+    bool take_token(const Endpoint& client) {
+        if (rate.load(std::memory_order_relaxed) <= 0) {
+            return true;
+        }
+        uint64_t nowUs = monotonic_us();
+        std::lock_guard<std::mutex> lock(bucketsMutex);
+        double rate = this->rate.load(std::memory_order_relaxed);
+        double burst = this->burst.load(std::memory_order_relaxed);
+        if (rate <= 0) {
+            return true;
+        }
+        if (buckets.size() >= forgetAt) {
+            forget_idle(nowUs, rate, burst);
+        }
+        auto inserted = buckets.emplace(client.host(), Bucket{burst, nowUs});
+        Bucket& bucket = inserted.first->second;
+        bucket.tokens = std::min(burst, bucket.tokens + (nowUs - bucket.updatedUs) * rate);
+        bucket.updatedUs = nowUs;
+        if (bucket.tokens < 1) {
+            refused(client, Metric::REFUSED_RATE, "rate limited");
+            return false;
+        }
+        bucket.tokens -= 1;
+        return true;
+    }
+
+    /// Drop the buckets which have filled up again, as they're no
+    /// different to new ones.
+    void forget_idle(uint64_t nowUs, double rate, double burst) {
+        for (auto it = buckets.begin(); it != buckets.end();) {
+            if (it->second.tokens + (nowUs - it->second.updatedUs) * rate >= burst) {
+                it = buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // However many clients stay busy, forgetting stays amortised O(1).
+        forgetAt = std::max<size_t>(ADMISSION_CLIENTS, buckets.size() * 2);
+    }
+
+    static void refused(const Endpoint& client, Metric metric, const char* reason) {
+        Metrics::count(metric);
+        static thread_local LogSampler refusals;
+        if (Log::sampled(LogLevel::WARN, refusals)) {
+            char host[INET6_ADDRSTRLEN] = {};
+            client.format_host(host);
+            Log::message(LogLevel::WARN, "Refused ", host, ": ", reason);
+        }
+    }
+};
+
+#endif
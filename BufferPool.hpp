@@ -0,0 +1,71 @@
+#ifndef HGUARD_BUFFER_POOL
+#define HGUARD_BUFFER_POOL
+
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+/// Bytes mapped at a time for buffers: one (x86) huge page.
+#ifndef BUFFER_POOL_CHUNK
+#define BUFFER_POOL_CHUNK (2 * 1024 * 1024)
+#endif
+
+/// Buffers of one fixed size, handed out and taken back for reuse.
+///
+/// Buffers are carved out of chunks mapped straight from the kernel, with
+/// explicit huge pages if any have been reserved, or else transparent huge
+/// pages if the kernel will give them, to spare the TLB when many tunnels
+/// are busy at once. Chunks are never unmapped: the pool stays at its peak
+/// size. Not thread safe; see RelayChannel for a pool per thread.
+class BufferPool {
+private:
+    size_t bufferSize;
+    size_t chunkSize;
+    std::vector<char*> available;
+
+public:
+    explicit BufferPool(size_t bufferSize):
+        bufferSize(bufferSize),
+        chunkSize((bufferSize + BUFFER_POOL_CHUNK - 1) / BUFFER_POOL_CHUNK * BUFFER_POOL_CHUNK)
+    {
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    size_t buffer_size() const {
+        return bufferSize;
+    }
+
+    char* acquire() {
+        if (available.empty()) {
+            grow();
+        }
+        char* buffer = available.back();
+        available.pop_back();
+        return buffer;
+    }
+
+    void release(char* buffer) {
+        available.push_back(buffer);
+    }
+
+private:
+    void grow() {
+        void* chunk = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk == MAP_FAILED) {
+            chunk = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            madvise(chunk, chunkSize, MADV_HUGEPAGE);
+        }
+        for (size_t offset = 0; offset + bufferSize <= chunkSize; offset += bufferSize) {
+            available.push_back(static_cast<char*>(chunk) + offset);
+        }
+    }
+};
+
+#endif
@@ -7,12 +7,20 @@
 
 class DirectTcpProxy : public TcpProxy {
 public:
-    DirectTcpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress, int clientSocketFd):
+    DirectTcpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, int clientSocketFd):
         Proxy(settings, clientAddress, targetAddress),
         TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
     {
     }
 
+    void choose_upstream() override {
+        // Straight to the target, no proxy.
+    }
+
+    const Endpoint& upstream_address() override {
+        return targetAddress;
+    }
+
     void run() override {
         // We will be finished with the client whenever this method
         // finishes.
@@ -21,12 +29,14 @@ public:
             });
 
         // Establish connection to proxy
-        int targetSocketFd = socket(AF_INET, SOCK_STREAM, 0);
+        SocketAddress address = targetAddress.socket_address();
+        int targetSocketFd = socket(address.generic.sa_family, SOCK_STREAM, 0);
         Cleaner targetSocketFdCleaner([&targetSocketFd] {
                 close(targetSocketFd);
             });
+        settings->upstreamSocket.apply(targetSocketFd);
 
-        if (connect(targetSocketFd, (struct sockaddr*)&targetAddress, sizeof(targetAddress)) < 0) {
+        if (connect(targetSocketFd, address.get(), address.length) < 0) {
             throw std::runtime_error("could not connect to target");
         }
 
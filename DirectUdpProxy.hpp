@@ -2,74 +2,103 @@
 #define HGUARD_DIRECT_UDP_PROXY
 
 #include <cstring>
+#include <functional>
+#include "EventLoop.hpp"
 #include "UdpProxy.hpp"
 
-class DirectUdpProxy : public UdpProxy {
+class DirectUdpProxy final : public UdpProxy, public EventHandler {
 private:
     int targetSocketFd;
     int proxyPort;
     Cleaner targetSocketFdCleaner;
 public:
-    DirectUdpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress):
-        Proxy(settings, clientAddress, targetAddress),
+    /// Direct associations share nothing.
+    struct Context {
+    };
+
+    static Context* make_context(const ProxySettings::Shared& settings, EventLoop& loop, std::function<void(DirectUdpProxy*)> lose) {
+        (void)settings;
+        (void)loop;
+        (void)lose;
+        return new Context();
+    }
+
+    DirectUdpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, Context& context):
         UdpProxy(settings, clientAddress, targetAddress)
     {
+        (void)context;
         // to client
-        targetSocketFd = socket(AF_INET, SOCK_DGRAM, 0);
+        SocketAddress address = targetAddress.socket_address();
+        targetSocketFd = socket(address.generic.sa_family, SOCK_DGRAM, 0);
         if (targetSocketFd < 0) {
-            std::cerr << "cannot open socket for sending to client" << std::endl;
+            Log::message(LogLevel::ERROR, "cannot open socket for sending to client");
             return;
         }
         targetSocketFdCleaner = Cleaner([this] {
                 close(this->targetSocketFd);
             });
-        struct sockaddr_in serverAddress = {};
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_port = htons(0);
-        serverAddress.sin_addr.s_addr = INADDR_ANY;
+        SocketAddress serverAddress = any_address(targetSocketFd, 0);
         // Binding essentially assigns us an address/port for receiving replies.
         // Might not be entirely necessary, however, due to auto-binding.
-        if (bind(targetSocketFd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        if (bind(targetSocketFd, serverAddress.get(), serverAddress.length) < 0) {
             throw std::runtime_error("could not bind to address and port for sending to target");
         }
         // Set the default address/port for sending packets.
-        if (connect(targetSocketFd, (struct sockaddr*)&targetAddress, sizeof(targetAddress)) < 0) {
+        if (connect(targetSocketFd, address.get(), address.length) < 0) {
             throw std::runtime_error("could not connect for sending to target");
         }
     }
 
-    std::vector<int> get_incoming_sockets() override {
-        return std::vector<int>{targetSocketFd};
+    void add_to(EventLoop& loop) {
+        loop.add(targetSocketFd, EPOLLIN, this);
     }
 
-    void check_socket(int fd) override {
+    void remove_from(EventLoop& loop) {
+        loop.remove(targetSocketFd);
+    }
+
+    /// A reply from the target.
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        try {
+            receive_from_target(fd);
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
+        }
+    }
+
+    void receive_from_target(int fd) {
         if (fd != targetSocketFd) {
             throw std::runtime_error("checking incorrect socket");
         }
 
-        struct sockaddr_in fromAddress;
-        socklen_t fromAddressLen = sizeof(struct sockaddr_in);
-        char buffer[65536] = {};
-        ssize_t recvLen = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&fromAddress, &fromAddressLen);
-
-        if (std::memcmp(&fromAddress, &targetAddress, sizeof(struct sockaddr_in)) != 0) {
-            std::cerr << "received non-proxy packet on upstream port" << std::endl;
+        // The socket is connected to the target, so nothing else gets
+        // through.
+        char buffer[65536];
+        ssize_t recvLen = recv(fd, buffer, sizeof(buffer), 0);
+        if (recvLen < 0) {
             return;
         }
 
-        std::cerr << "\t" << "RECEIVE DOWN DGRAM   " << clientHost << ":" << clientPort << " <- " << targetHost << ":" << targetPort << std::endl;
+        static thread_local LogSampler receives;
+        log_datagram(LogLevel::DEBUG, receives, "RECEIVE DOWN DGRAM   ", " <- ");
 
         send_to_client(buffer, recvLen);
     }
 
-    void send_to_target(const char* buffer, size_t len) override {
-        if (sendto(targetSocketFd, buffer, len, 0, (struct sockaddr*)&targetAddress, sizeof(targetAddress)) != (ssize_t)len) {
-            perror("sendto failed sending to target");
-            std::cerr << "\t" << "FAILED SEND DGRAM   " << clientHost << ":" << clientPort << " -> " << targetHost << ":" << targetPort << std::endl;
+    void send_to_target(const char* buffer, size_t len) {
+        if (send(targetSocketFd, buffer, len, 0) != (ssize_t)len) {
+            static thread_local LogSampler failures;
+            log_datagram(LogLevel::WARN, failures, "FAILED SEND DGRAM   ", " -> ");
             return;
         }
 
-        std::cerr << "\t" << "SEND    UP   DGRAM   " << clientHost << ":" << clientPort << " -> " << targetHost << ":" << targetPort << std::endl;
+        static thread_local LogSampler sends;
+        log_datagram(LogLevel::DEBUG, sends, "SEND    UP   DGRAM   ", " -> ");
+    }
+
+    /// Nothing is queued.
+    void flush() {
     }
 };
 
@@ -0,0 +1,222 @@
+#ifndef HGUARD_ENDPOINT
+#define HGUARD_ENDPOINT
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/// An Endpoint laid out the way the socket calls want it, in its own
+/// family.
+struct SocketAddress {
+    union {
+        struct sockaddr generic;
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    };
+    socklen_t length;
+
+    const struct sockaddr* get() const {
+        return &generic;
+    }
+};
+
+/// An IPv4 or IPv6 address and port, in 18 bytes.
+///
+/// IPv4 addresses are kept v4-mapped (::ffff:a.b.c.d), which is how a
+/// dual-stack socket reports them anyway, so endpoints of either family
+/// compare, hash and key tables alike, without looking at the family. It
+/// only matters once an endpoint goes back out to the socket calls or onto
+/// the wire.
+class Endpoint {
+private:
+    unsigned char bytes[16];
+    uint16_t networkPort;
+
+    static const unsigned char* v4_prefix() {
+        static const unsigned char prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        return prefix;
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    void set_v4(const void* address) {
+        std::memcpy(bytes, v4_prefix(), 12);
+        std::memcpy(bytes + 12, address, 4);
+    }
+
+public:
+    Endpoint():
+        bytes{},
+        networkPort(0)
+    {
+    }
+
+    explicit Endpoint(const struct sockaddr_in& address):
+        networkPort(address.sin_port)
+    {
+        set_v4(&address.sin_addr);
+    }
+
+    explicit Endpoint(const struct sockaddr_in6& address):
+        networkPort(address.sin6_port)
+    {
+        std::memcpy(bytes, &address.sin6_addr, 16);
+    }
+
+    /// address as found on the wire: 4 bytes for IPv4, 16 for IPv6, with
+    /// networkPort in network order.
+    Endpoint(const void* address, size_t length, uint16_t networkPort):
+        networkPort(networkPort)
+    {
+        if (length == 4) {
+            set_v4(address);
+        } else if (length == 16) {
+            std::memcpy(bytes, address, 16);
+        } else {
+            throw std::runtime_error("address is neither IPv4 nor IPv6");
+        }
+    }
+
+    /// Whatever a socket call filled in.
+    static Endpoint from(const struct sockaddr* address) {
+        switch (address->sa_family) {
+        case AF_INET:
+            return Endpoint(*(const struct sockaddr_in*)address);
+        case AF_INET6:
+            return Endpoint(*(const struct sockaddr_in6*)address);
+        default:
+            throw std::runtime_error("address is neither IPv4 nor IPv6");
+        }
+    }
+
+    /// 0.0.0.0 or ::, on port 0.
+    static Endpoint unspecified(int family) {
+        const unsigned char zeros[16] = {};
+        return Endpoint(zeros, family == AF_INET ? 4 : 16, 0);
+    }
+
+    /// A dotted quad or an IPv6 address (without brackets). Returns false if
+    /// text is neither.
+    static bool parse(const char* text, uint16_t port, Endpoint& endpoint) {
+        struct in_addr v4;
+        struct in6_addr v6;
+        if (inet_pton(AF_INET, text, &v4) == 1) {
+            endpoint = Endpoint(&v4, sizeof(v4), htons(port));
+        } else if (inet_pton(AF_INET6, text, &v6) == 1) {
+            endpoint = Endpoint(&v6, sizeof(v6), htons(port));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    bool is_v4() const {
+        return std::memcmp(bytes, v4_prefix(), 12) == 0;
+    }
+
+    int family() const {
+        return is_v4() ? AF_INET : AF_INET6;
+    }
+
+    /// The address as on the wire: address_length() bytes, 4 or 16.
+    const unsigned char* address_bytes() const {
+        return is_v4() ? bytes + 12 : bytes;
+    }
+
+    size_t address_length() const {
+        return is_v4() ? 4 : 16;
+    }
+
+    /// In host order.
+    uint16_t port() const {
+        return ntohs(networkPort);
+    }
+
+    uint16_t network_port() const {
+        return networkPort;
+    }
+
+    /// The same address, on port 0, to key anything kept per host.
+    Endpoint host() const {
+        Endpoint address = *this;
+        address.networkPort = 0;
+        return address;
+    }
+
+    Endpoint with_port(uint16_t port) const {
+        Endpoint address = *this;
+        address.networkPort = htons(port);
+        return address;
+    }
+
+    SocketAddress socket_address() const {
+        SocketAddress address;
+        std::memset(&address, 0, sizeof(address));
+        if (is_v4()) {
+            address.v4.sin_family = AF_INET;
+            address.v4.sin_port = networkPort;
+            std::memcpy(&address.v4.sin_addr, bytes + 12, 4);
+            address.length = sizeof(address.v4);
+        } else {
+            address.v6.sin6_family = AF_INET6;
+            address.v6.sin6_port = networkPort;
+            std::memcpy(&address.v6.sin6_addr, bytes, 16);
+            address.length = sizeof(address.v6);
+        }
+        return address;
+    }
+
+    /// The address alone, in text. Returns text.
+    const char* format_host(char (&text)[INET6_ADDRSTRLEN]) const {
+        inet_ntop(family(), address_bytes(), text, sizeof(text));
+        return text;
+    }
+
+    std::string host_text() const {
+        char text[INET6_ADDRSTRLEN] = {};
+        return format_host(text);
+    }
+
+    /// The address as it goes before a ":port": IPv6 in brackets.
+    std::string authority() const {
+        return is_v4() ? host_text() : "[" + host_text() + "]";
+    }
+
+    /// "ADDRESS:PORT", or "[ADDRESS]:PORT" for IPv6.
+    std::string to_string() const {
+        return authority() + ":" + std::to_string(port());
+    }
+
+    size_t hash() const {
+        uint64_t high;
+        uint64_t low;
+        std::memcpy(&high, bytes, 8);
+        std::memcpy(&low, bytes + 8, 8);
+        return mix(low ^ mix(high ^ networkPort));
+    }
+
+    bool operator==(const Endpoint& other) const {
+        return networkPort == other.networkPort && std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+
+    bool operator!=(const Endpoint& other) const {
+        return !(*this == other);
+    }
+};
+
+struct EndpointHash {
+    size_t operator()(const Endpoint& endpoint) const {
+        return endpoint.hash();
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef HGUARD_EVENT_LOOP
+#define HGUARD_EVENT_LOOP
+
+#include <vector>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "TimerWheel.hpp"
+
+#define EVENT_LOOP_BATCH 256
+/// Resolution of EventLoop timers.
+#define EVENT_LOOP_TICK_MS 100
+
+class EventLoop;
+
+/// Something which wants to be told when one of its file descriptors
+/// becomes ready.
+class EventHandler {
+public:
+    virtual ~EventHandler() {
+    }
+
+    virtual void handle_event(int fd, uint32_t events) = 0;
+
+    /// An EventTimer scheduled for this handler has fired.
+    virtual void handle_timeout() {
+    }
+};
+
+/// A timeout for an EventHandler. See EventLoop::schedule().
+struct EventTimer : public TimerNode {
+    EventHandler* handler = nullptr;
+};
+
+/// Minimal level-triggered epoll reactor.
+///
+/// Handlers are looked up by file descriptor, so a handler may watch
+/// several descriptors (e.g. both ends of a tunnel). Handlers which are
+/// done can retire() themselves, and will be deleted once the current
+/// batch of events has been dispatched. Handlers must cancel() any timers
+/// before they go.
+class EventLoop {
+private:
+    /// The handler watching a descriptor. Each add() starts a new
+    /// generation, which events carry alongside the descriptor, so that
+    /// events left over for a descriptor closed and reused within one
+    /// batch don't go to its new handler.
+    struct Slot {
+        EventHandler* handler;
+        uint32_t generation;
+    };
+
+    int epollFd;
+    std::vector<Slot> handlers;
+    std::vector<EventHandler*> retired;
+    TimerWheel timers;
+
+    static uint64_t tag(int fd, uint32_t generation) {
+        return uint64_t(generation) << 32 | uint32_t(fd);
+    }
+
+public:
+    EventLoop():
+        timers(monotonic_ms() / EVENT_LOOP_TICK_MS)
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            throw std::runtime_error("could not create epoll instance");
+        }
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        reap();
+        close(epollFd);
+    }
+
+    /// Readable whenever there are events to dispatch, for waiting on the
+    /// loop from elsewhere (e.g. an io_uring poll).
+    int fd() const {
+        return epollFd;
+    }
+
+    void add(int fd, uint32_t events, EventHandler* handler) {
+        if (size_t(fd) >= handlers.size()) {
+            handlers.resize(fd + 1, Slot{nullptr, 0});
+        }
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.u64 = tag(fd, handlers[fd].generation + 1);
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            throw std::runtime_error("could not add socket to epoll");
+        }
+        handlers[fd].handler = handler;
+        handlers[fd].generation++;
+    }
+
+    void modify(int fd, uint32_t events) {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.u64 = tag(fd, handlers[fd].generation);
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            throw std::runtime_error("could not modify socket in epoll");
+        }
+    }
+
+    /// Stop watching fd. Must be called before fd is closed.
+    void remove(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        if (size_t(fd) < handlers.size()) {
+            handlers[fd].handler = nullptr;
+        }
+    }
+
+    /// Call handler's handle_timeout() in about delayMs, unless cancelled
+    /// first. Rescheduling a pending timer moves it.
+    void schedule(EventTimer& timer, EventHandler* handler, uint64_t delayMs) {
+        timer.handler = handler;
+        // The wheel only catches up after each batch, so go by the clock.
+        timers.schedule(&timer, (monotonic_ms() + delayMs + EVENT_LOOP_TICK_MS - 1) / EVENT_LOOP_TICK_MS);
+    }
+
+    void cancel(EventTimer& timer) {
+        timers.cancel(&timer);
+    }
+
+    /// Hand ownership of a finished handler to the loop for deletion.
+    void retire(EventHandler* handler) {
+        retired.push_back(handler);
+    }
+
+    /// Wait for and dispatch one batch of events.
+    ///
+    /// Returns the number of events dispatched.
+    int run_once(int timeoutMs) {
+        if (timers.size() > 0 && (timeoutMs < 0 || timeoutMs > EVENT_LOOP_TICK_MS)) {
+            timeoutMs = EVENT_LOOP_TICK_MS;
+        }
+        struct epoll_event events[EVENT_LOOP_BATCH];
+        int count = epoll_wait(epollFd, events, EVENT_LOOP_BATCH, timeoutMs);
+        if (count < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+            throw std::runtime_error("epoll error whilst proxying");
+        }
+        for (int i = 0; i < count; i++) {
+            int fd = int(events[i].data.u64 & 0xffffffff);
+            uint32_t generation = uint32_t(events[i].data.u64 >> 32);
+            // Handler may have gone away earlier in this batch, and fd
+            // may even have been reused since.
+            if (size_t(fd) < handlers.size() && handlers[fd].handler != nullptr
+                && handlers[fd].generation == generation) {
+                handlers[fd].handler->handle_event(fd, events[i].events);
+            }
+        }
+        timers.advance(monotonic_ms() / EVENT_LOOP_TICK_MS, [](TimerNode* node) {
+                static_cast<EventTimer*>(node)->handler->handle_timeout();
+            });
+        reap();
+        return count;
+    }
+
+    /// Delete the handlers retired so far. run_once() does this after
+    /// each batch, but handlers can retire from outside the loop too.
+    void reap() {
+        for (EventHandler* handler : retired) {
+            delete handler;
+        }
+        retired.clear();
+    }
+};
+
+#endif
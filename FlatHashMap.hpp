@@ -0,0 +1,132 @@
+#ifndef HGUARD_FLAT_HASH_MAP
+#define HGUARD_FLAT_HASH_MAP
+
+#include <vector>
+#include <utility>
+#include <functional>
+
+/// Open-addressing hash map with linear probing.
+///
+/// All entries live in one flat array, so a lookup is usually a single
+/// cache miss. Deletion shifts later entries of the probe run back rather
+/// than leaving tombstones, so lookups never slow down with churn.
+///
+/// Pointers returned by find() are invalidated by insert() and erase().
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatHashMap {
+private:
+    struct Slot {
+        bool used;
+        Key key;
+        Value value;
+    };
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count;
+    Hash hasher;
+
+    size_t home(const Key& key) const {
+        return hasher(key) & mask;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        mask = slots.size() - 1;
+        count = 0;
+        for (Slot& slot : old) {
+            if (slot.used) {
+                insert(slot.key, std::move(slot.value));
+            }
+        }
+    }
+
+public:
+    FlatHashMap(size_t initialCapacity = 16):
+        count(0)
+    {
+        size_t capacity = 16;
+        while (capacity < initialCapacity * 2) {
+            capacity *= 2;
+        }
+        slots.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    Value* find(const Key& key) {
+        for (size_t i = home(key); slots[i].used; i = (i + 1) & mask) {
+            if (slots[i].key == key) {
+                return &slots[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Insert or replace.
+    Value& insert(const Key& key, Value value) {
+        // Keep the load factor at or below one half.
+        if ((count + 1) * 2 > slots.size()) {
+            grow();
+        }
+        size_t i = home(key);
+        for (; slots[i].used; i = (i + 1) & mask) {
+            if (slots[i].key == key) {
+                slots[i].value = std::move(value);
+                return slots[i].value;
+            }
+        }
+        slots[i].used = true;
+        slots[i].key = key;
+        slots[i].value = std::move(value);
+        count++;
+        return slots[i].value;
+    }
+
+    /// Call f(key, value) for every entry. f mustn't modify the map.
+    template <typename Function>
+    void for_each(Function f) {
+        for (Slot& slot : slots) {
+            if (slot.used) {
+                f(slot.key, slot.value);
+            }
+        }
+    }
+
+    bool erase(const Key& key) {
+        size_t i = home(key);
+        for (; slots[i].used; i = (i + 1) & mask) {
+            if (slots[i].key == key) {
+                break;
+            }
+        }
+        if (!slots[i].used) {
+            return false;
+        }
+        // Backward shift: pull any later entry whose home slot doesn't
+        // lie cyclically within (i, j] into the hole.
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (!slots[j].used) {
+                break;
+            }
+            size_t k = home(slots[j].key);
+            bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays) {
+                slots[i].key = slots[j].key;
+                slots[i].value = std::move(slots[j].value);
+                i = j;
+            }
+        }
+        slots[i].used = false;
+        slots[i].value = Value();
+        count--;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef HGUARD_HANDOFF
+#define HGUARD_HANDOFF
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Cleaner.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "ProxySettings.hpp"
+
+/// Seconds a new instance waits for the old one to hand over.
+#ifndef HANDOFF_TIMEOUT
+#define HANDOFF_TIMEOUT 5
+#endif
+/// Milliseconds between looks, whilst draining, at what's still open.
+#ifndef HANDOFF_DRAIN_CHECK_MS
+#define HANDOFF_DRAIN_CHECK_MS 100
+#endif
+/// Most sockets handed over in one go (the kernel allows 253 in one
+/// message).
+#define HANDOFF_MAX_SOCKETS 250
+
+/// Lets a new instance take over from a running one without either
+/// refusing a connection or cutting one off: the old instance hands over
+/// its listening (or TPROXY) sockets, and those of its metrics endpoint,
+/// then drains.
+///
+/// Given a path, an instance first asks whichever instance listens there
+/// for its sockets, and uses them rather than binding its own. Then it
+/// listens there itself, for the next instance. An instance which has
+/// handed over stops taking on new tunnels and associations, but carries
+/// on relaying those it has, and exits once they've all finished.
+///
+/// Sockets are only handed over for the same proxied protocol and port.
+/// An instance for another port still takes over (the old port simply
+/// stops being served), but not one which would need a different number
+/// of sockets, or another protocol: the old instance refuses, and carries
+/// on as if nothing had happened.
+class Handoff {
+private:
+    static const uint32_t MAGIC = 0x74706878;
+
+    struct Request {
+        uint32_t magic;
+        uint32_t protocol;
+        uint32_t port;
+        uint32_t sockets;
+        char metricsEndpoint[256];
+    };
+
+    struct Reply {
+        uint32_t magic;
+        uint32_t refused; // The old instance carries on
+        uint32_t listeners;
+        uint32_t metrics; // 1 if the last socket is for metrics
+    };
+
+    std::string path;
+    Request identity;
+
+    std::vector<int> takenListeners;
+    int takenMetricsListener;
+
+    std::vector<int> offeredListeners;
+    int offeredMetricsListener;
+    bool exitWhenDrained;
+
+    int stopFd;
+    std::atomic<bool> stopped;
+
+public:
+    /// For an instance needing sockets sockets to listen on port for
+    /// protocol, and serving metrics at metricsEndpoint (if not empty).
+    /// With an empty path, nothing is handed over either way.
+    Handoff(const std::string& path, ProxySettings::ProxiedProtocol protocol, int port, size_t sockets, const std::string& metricsEndpoint):
+        path(path),
+        identity(),
+        takenMetricsListener(-1),
+        offeredMetricsListener(-1),
+        exitWhenDrained(true),
+        stopFd(-1),
+        stopped(false)
+    {
+        identity.magic = MAGIC;
+        identity.protocol = uint32_t(protocol);
+        identity.port = uint32_t(port);
+        identity.sockets = uint32_t(sockets);
+        if (metricsEndpoint.size() >= sizeof(identity.metricsEndpoint)) {
+            throw std::runtime_error("metrics endpoint too long");
+        }
+        std::memcpy(identity.metricsEndpoint, metricsEndpoint.c_str(), metricsEndpoint.size());
+        if (path.empty()) {
+            return;
+        }
+        if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+            throw std::runtime_error("handoff socket path too long");
+        }
+        if (sockets > HANDOFF_MAX_SOCKETS) {
+            throw std::runtime_error("too many sockets to hand over");
+        }
+        stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stopFd < 0) {
+            throw std::runtime_error("could not create eventfd for handoff");
+        }
+    }
+
+    Handoff(const Handoff&) = delete;
+    Handoff& operator=(const Handoff&) = delete;
+
+    /// Ask the instance at the path (if there is one) for its sockets. It
+    /// starts draining as soon as it has answered.
+    void take_over() {
+        if (path.empty()) {
+            return;
+        }
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("could not open handoff socket");
+        }
+        Cleaner fdCleaner([fd] {
+                close(fd);
+            });
+        struct sockaddr_un address = unix_address();
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            if (errno == ENOENT || errno == ECONNREFUSED) {
+                // Nobody to take over from.
+                return;
+            }
+            throw std::runtime_error(std::string("could not reach instance to take over from: ") + strerror(errno));
+        }
+        struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (send(fd, &identity, sizeof(identity), MSG_NOSIGNAL) != ssize_t(sizeof(identity))) {
+            throw std::runtime_error("could not ask instance to take over from for its sockets");
+        }
+
+        Reply reply = {};
+        struct iovec iov = {&reply, sizeof(reply)};
+        char control[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_SOCKETS + 1))];
+        struct msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        // Collected first, so that none leak whatever the reply says.
+        std::vector<int> fds;
+        if (received >= 0) {
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    size_t first = fds.size();
+                    fds.resize(first + count);
+                    std::memcpy(&fds[first], CMSG_DATA(cmsg), count * sizeof(int));
+                }
+            }
+        }
+        Cleaner fdsCleaner([&fds] {
+                for (int fd : fds) {
+                    close(fd);
+                }
+            });
+        if (received != ssize_t(sizeof(reply)) || reply.magic != MAGIC || (message.msg_flags & MSG_CTRUNC)
+            || fds.size() != size_t(reply.listeners) + reply.metrics) {
+            throw std::runtime_error("bad answer from instance to take over from");
+        }
+        if (reply.refused) {
+            throw std::runtime_error("the running instance can't be taken over with these settings (they must"
+                                     " proxy the same protocol, and with the same port, the same number of workers)");
+        }
+        fdsCleaner.disable();
+        takenListeners.assign(fds.begin(), fds.begin() + reply.listeners);
+        if (reply.metrics) {
+            takenMetricsListener = fds.back();
+        }
+        Log::message(LogLevel::INFO, "Took over ", fds.size(), fds.size() == 1 ? " socket" : " sockets", " from the running instance");
+    }
+
+    /// Listening sockets taken over, if any, to use as they are.
+    const std::vector<int>& listeners() const {
+        return takenListeners;
+    }
+
+    /// The metrics endpoint's socket, if taken over, or -1.
+    int metrics_listener() const {
+        return takenMetricsListener;
+    }
+
+    /// The metrics endpoint's socket, to hand over along with the
+    /// listeners.
+    void offer_metrics(int fd) {
+        offeredMetricsListener = fd;
+    }
+
+    /// Start listening at the path, to hand these over to the next
+    /// instance to ask. Unless exitWhenDrained is false (for a caller
+    /// seeing to that itself), the process exits once, having handed over,
+    /// it has no tunnels or associations left.
+    void offer(const std::vector<int>& listeners, bool exitWhenDrained = true) {
+        if (path.empty()) {
+            return;
+        }
+        offeredListeners = listeners;
+        this->exitWhenDrained = exitWhenDrained;
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("could not open handoff socket");
+        }
+        Cleaner fdCleaner([fd] {
+                close(fd);
+            });
+        struct sockaddr_un address = unix_address();
+        // Left by whoever was here before, who is done with it.
+        unlink(path.c_str());
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 4) < 0) {
+            throw std::runtime_error("could not listen on handoff socket");
+        }
+        fdCleaner.disable();
+        std::thread([this, fd] {
+                serve(fd);
+            }).detach();
+    }
+
+    /// Readable once another instance has taken over, and left so, for
+    /// every event loop to notice and stop taking on new work. -1 without
+    /// a path.
+    int stop_fd() const {
+        return stopFd;
+    }
+
+    bool stopping() const {
+        return stopped.load(std::memory_order_acquire);
+    }
+
+    /// There's nothing left to relay, so leave everything to the new
+    /// instance.
+    static void exit_drained() {
+        Log::message(LogLevel::INFO, "Drained, exiting");
+        Log::flush();
+        _exit(0);
+    }
+
+private:
+    struct sockaddr_un unix_address() const {
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+        return address;
+    }
+
+    void serve(int listeningFd) {
+        while (true) {
+            int fd = accept4(listeningFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    Log::message(LogLevel::ERROR, "Error during handoff accept.");
+                    sleep(1);
+                }
+                continue;
+            }
+            Cleaner fdCleaner([fd] {
+                    close(fd);
+                });
+            struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            Request request = {};
+            if (recv(fd, &request, sizeof(request), 0) != ssize_t(sizeof(request)) || request.magic != MAGIC) {
+                Log::message(LogLevel::WARN, "Ignoring bad handoff request");
+                continue;
+            }
+            request.metricsEndpoint[sizeof(request.metricsEndpoint) - 1] = '\0';
+            if (hand_over(fd, request)) {
+                // The new instance listens at the path from now on.
+                close(listeningFd);
+                drain();
+                return;
+            }
+        }
+    }
+
+    bool hand_over(int fd, const Request& request) {
+        bool samePort = request.port == identity.port;
+        bool refused = request.protocol != identity.protocol || (samePort && request.sockets != offeredListeners.size());
+        std::vector<int> fds;
+        if (!refused && samePort) {
+            fds = offeredListeners;
+        }
+        bool metrics = !refused && offeredMetricsListener >= 0
+            && std::strcmp(request.metricsEndpoint, identity.metricsEndpoint) == 0;
+        if (metrics) {
+            fds.push_back(offeredMetricsListener);
+        }
+
+        Reply reply = {MAGIC, refused, uint32_t(fds.size()) - metrics, metrics};
+        struct iovec iov = {&reply, sizeof(reply)};
+        char control[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_SOCKETS + 1))] = {};
+        struct msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        if (!fds.empty()) {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+        if (sendmsg(fd, &message, MSG_NOSIGNAL) != ssize_t(sizeof(reply))) {
+            Log::message(LogLevel::ERROR, "Could not hand over to new instance: ", strerror(errno));
+            return false;
+        }
+        if (refused) {
+            Log::message(LogLevel::WARN, "Refused to hand over to a new instance with incompatible settings");
+            return false;
+        }
+        Log::message(LogLevel::INFO, "Handed over to a new instance", samePort ? "" : " (for another port)", ", draining");
+        return true;
+    }
+
+    /// Stop taking on new work, and wait for what's left to finish.
+    void drain() {
+        stopped.store(true, std::memory_order_release);
+        uint64_t one = 1;
+        if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+            Log::message(LogLevel::ERROR, "Could not tell workers to stop");
+        }
+        while (exitWhenDrained) {
+            MetricsSnapshot m = Metrics::snapshot();
+            int64_t open = int64_t(m[Metric::TUNNELS_OPENED] - m[Metric::TUNNELS_CLOSED])
+                + int64_t(m[Metric::UDP_ASSOCIATIONS_OPENED] - m[Metric::UDP_ASSOCIATIONS_CLOSED]);
+            if (open <= 0) {
+                exit_drained();
+            }
+            usleep(HANDOFF_DRAIN_CHECK_MS * 1000);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef HGUARD_HANDSHAKE
+#define HGUARD_HANDSHAKE
+
+#include <string>
+#include <memory>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "Slab.hpp"
+#include "TimerWheel.hpp"
+
+/// Seconds allowed for negotiating with the upstream proxy.
+#ifndef TCP_NEGOTIATION_TIMEOUT
+#define TCP_NEGOTIATION_TIMEOUT 10
+#endif
+
+/// The upstream proxy is working, but wouldn't (or couldn't) put us
+/// through to the target. No reason to think another proxy would do
+/// better.
+class TargetRefused : public std::runtime_error {
+public:
+    TargetRefused(const char* what):
+        std::runtime_error(what)
+    {
+    }
+};
+
+/// Negotiation with an upstream proxy, which can be run a step at a time
+/// over a non-blocking socket.
+///
+/// A handshake is written as a series of step()s. Each step queues
+/// anything to be sent and says how many bytes of reply the next step
+/// needs. advance() then moves data until the next step can run or the
+/// socket would block, so any number of handshakes can be in flight on
+/// one thread. Replies are either read exactly, so that nothing beyond
+/// the end of the handshake is consumed from the socket, or in whatever
+/// chunks arrive, in which case anything read past the end must be kept
+/// as surplus() for the tunnel.
+class Handshake : public SlabAllocated {
+public:
+    enum class Status {
+        WANT_READ,
+        WANT_WRITE,
+        DONE,
+    };
+
+private:
+    std::string output;
+    size_t written;
+    std::string input;
+    size_t received;
+    bool exact;
+    bool replies;
+    std::string extra;
+    std::string early;
+    bool earlySent;
+    bool started;
+    bool done;
+    const char* phase;
+
+protected:
+    Handshake():
+        written(0),
+        received(0),
+        exact(true),
+        replies(false),
+        earlySent(false),
+        started(false),
+        done(false),
+        phase("negotiation")
+    {
+    }
+
+    /// Work out what to do next, given the reply asked for by the last
+    /// expect(). Must call expect() or finish() (or throw). Also runs once
+    /// at the start, with no reply.
+    virtual void step() = 0;
+
+    /// Name what's going on, for error messages.
+    void set_phase(const char* phase) {
+        this->phase = phase;
+    }
+
+    /// Queue data to go out before the next reply is read.
+    void send(const void* data, size_t len) {
+        output.append((const char*)data, len);
+    }
+
+    /// Have the next step run once len more bytes have been read.
+    void expect(size_t len) {
+        input.assign(len, 0);
+        received = 0;
+        exact = true;
+    }
+
+    /// Have the next step run as soon as anything (up to len bytes) has
+    /// been read.
+    void expect_some(size_t len) {
+        expect(len);
+        exact = false;
+    }
+
+    /// Queue the client's early data (see set_early_data()) to go out now,
+    /// ahead of the final reply. Only for protocols where the proxy won't
+    /// mistake it for part of the request.
+    void send_early_data() {
+        send(early.data(), early.size());
+        earlySent = true;
+    }
+
+    /// Hand data read beyond the end of the handshake on to the tunnel.
+    void keep_surplus(const char* data, size_t len) {
+        extra.append(data, len);
+    }
+
+    const char* reply() const {
+        return input.data();
+    }
+
+    size_t reply_length() const {
+        return input.size();
+    }
+
+    /// Nothing more to do once everything queued has been sent.
+    void finish() {
+        done = true;
+    }
+
+public:
+    virtual ~Handshake() {
+    }
+
+    /// Tunnel data which arrived with the end of the handshake.
+    const std::string& surplus() const {
+        return extra;
+    }
+
+    /// Data the client sent before the tunnel was up. The handshake may
+    /// send it before the proxy has replied; if not, it's left over as
+    /// unsent_early_data() for the tunnel. Must be set before starting.
+    void set_early_data(const std::string& data) {
+        early = data;
+    }
+
+    const std::string& early_data() const {
+        return early;
+    }
+
+    const std::string& unsent_early_data() const {
+        static const std::string none;
+        return earlySent ? none : early;
+    }
+
+    /// The proxy has sent something back.
+    bool replied() const {
+        return replies;
+    }
+
+    /// A more conservative handshake to retry with, on a fresh connection,
+    /// now that this one has failed. nullptr if it's not worth retrying.
+    virtual std::unique_ptr<Handshake> fallback() {
+        return nullptr;
+    }
+
+    /// Make as much progress as the socket allows. Throws on failure.
+    Status advance(int fd) {
+        if (!started) {
+            started = true;
+            step();
+        }
+        while (true) {
+            if (written < output.size()) {
+                ssize_t r = ::send(fd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+                if (r < 0) {
+                    // EINPROGRESS: a Fast Open SYN went without data.
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                        return Status::WANT_WRITE;
+                    }
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("write to upstream proxy failed during ") + phase);
+                }
+                written += r;
+                if (written == output.size()) {
+                    output.clear();
+                    written = 0;
+                }
+            } else if (done) {
+                return Status::DONE;
+            } else if (received < input.size()) {
+                ssize_t r = read(fd, &input[received], input.size() - received);
+                if (r < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return Status::WANT_READ;
+                    }
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("read from upstream proxy failed during ") + phase);
+                }
+                if (r == 0) {
+                    throw std::runtime_error("upstream proxy connection lost before tunnelling");
+                }
+                received += r;
+                replies = true;
+                if (!exact) {
+                    input.resize(received);
+                }
+            } else {
+                step();
+            }
+        }
+    }
+
+    /// Run the whole handshake, waiting for the socket as necessary.
+    void complete(int fd, int timeoutMs) {
+        uint64_t deadline = monotonic_ms() + timeoutMs;
+        while (true) {
+            Status status = advance(fd);
+            if (status == Status::DONE) {
+                return;
+            }
+            uint64_t now = monotonic_ms();
+            struct pollfd pfd = {fd, short(status == Status::WANT_READ ? POLLIN : POLLOUT), 0};
+            int r = now < deadline ? poll(&pfd, 1, int(deadline - now)) : 0;
+            if (r == 0) {
+                throw std::runtime_error("upstream proxy negotiation timed out");
+            }
+            if (r < 0 && errno != EINTR) {
+                throw std::runtime_error("poll error during negotiation");
+            }
+        }
+    }
+};
+
+#endif
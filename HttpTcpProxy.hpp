@@ -4,86 +4,145 @@
 #include "Util.hpp"
 #include "ProxySettings.hpp"
 #include "TcpProxy.hpp"
+#include "Handshake.hpp"
+
+#ifndef HTTP_RESPONSE_LIMIT
+/// Most response header the upstream proxy can send back to a CONNECT.
+#define HTTP_RESPONSE_LIMIT 8192
+#endif
+
+/// CONNECT request to an HTTP proxy.
+///
+/// The response is read in whatever chunks it arrives into one buffer,
+/// which is scanned for the end of the headers. Anything after that
+/// belongs to the tunnel and is kept as surplus.
+class HttpHandshake : public Handshake {
+private:
+    enum class Stage {
+        REQUEST,
+        RESPONSE,
+    };
+
+    std::string tunnelRequest;
+    Stage stage;
+    std::string response;
+    size_t scanned;
 
-class HttpTcpProxy : public TcpProxy {
 public:
-    HttpTcpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress, int clientSocketFd):
-        Proxy(settings, clientAddress, targetAddress),
-        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
+    HttpHandshake(const std::string& tunnelRequest):
+        tunnelRequest(tunnelRequest),
+        stage(Stage::REQUEST),
+        scanned(0)
     {
     }
 
-private:
-    int get_http_proxy_status(int proxySocketFd) {
-        char line[256] = {};
-        size_t i;
-        for (i = 0; i < sizeof(line); i++) {
-            int c = 0;
-            do {
-                if (read(proxySocketFd, &c, 1) <= 0) {
-                    throw std::runtime_error("upstream proxy connection lost before tunnelling");
-                }
-            } while (c == '\r'); // F**k carriage return.
-            line[i] = c;
-            if (c == '\n') {
-                line[i] = 0;
-                break;
-            }
-        }
-        if (i == sizeof(line)) {
-            throw std::runtime_error("upstream proxy response too large");
-        }
-        std::string str(line);
-        std::regex code_regex("^HTTP/1.1 ([0-9]{3}) "); // capitalisation?
-        std::smatch match;
-        if (!std::regex_search(str, match, code_regex)) {
-            throw std::runtime_error("upstream proxy protocol mismatch");
-        }
-        int code = std::stoi(match[1]); // This shouldn't ever fail.
-
-        // Exhaust proxy data then return code
-        bool newline = true;
-        while (true) {
-            int c = 0;
-            do {
-                if (read(proxySocketFd, &c, 1) <= 0) {
-                    throw std::runtime_error("upstream proxy connection lost before tunnelling");
-                }
-            } while (c == '\r'); // F**k carriage return.
-            if (c == '\n') {
-                if (newline) {
-                    // Two newlines in a row means we've reach the endpoint data
-                    return code;
-                } else {
-                    newline = true;
-                }
-            } else {
-                newline = false;
-            }
+protected:
+    void step() override {
+        switch (stage) {
+        case Stage::REQUEST:
+            set_phase("CONNECT");
+            send(tunnelRequest.c_str(), tunnelRequest.length());
+            response.reserve(HTTP_RESPONSE_LIMIT);
+            stage = Stage::RESPONSE;
+            expect_some(HTTP_RESPONSE_LIMIT);
+            break;
+        case Stage::RESPONSE:
+            response.append(reply(), reply_length());
+            received();
+            break;
         }
     }
 
-    void proxy_negotiate(int proxySocketFd) override {
-        std::string tunnelRequest =
-            "CONNECT " + targetHost + ":" + std::to_string(targetPort) + " HTTP/1.1\n"
-            + "Host: " + targetHost + ":" + std::to_string(targetPort) + "\n"
-            + (!settings.username.empty() ? "Proxy-Authorization: Basic " + base64encode(settings.username + ":" + settings.password) + "\n" : "")
-            + "\n";
-
-        if (write_exactly(proxySocketFd, tunnelRequest.c_str(), tunnelRequest.length()) < 0) {
-            throw std::runtime_error("write to upstream proxy failed during CONNECT");
+private:
+    void received() {
+        size_t headersEnd = find_headers_end();
+        if (headersEnd == 0) {
+            if (response.size() >= HTTP_RESPONSE_LIMIT) {
+                throw std::runtime_error("upstream proxy response too large");
+            }
+            expect_some(HTTP_RESPONSE_LIMIT - response.size());
+            return;
         }
 
-        switch (get_http_proxy_status(proxySocketFd)) {
+        switch (status_code()) {
         case 200:
             // All good.
             break;
         case 407:
             throw std::runtime_error("upstream proxy authorization required");
         default:
-            throw std::runtime_error("upstream proxy failed to establish connection to endpoint or rejected connection");
+            throw TargetRefused("upstream proxy failed to establish connection to endpoint or rejected connection");
         }
-    };
+        keep_surplus(response.data() + headersEnd, response.size() - headersEnd);
+        finish();
+    }
+
+    /// Offset just past the blank line ending the headers, or 0 if it
+    /// hasn't arrived yet. Carriage returns are optional.
+    size_t find_headers_end() {
+        for (; scanned < response.size(); scanned++) {
+            if (response[scanned] != '\n') {
+                continue;
+            }
+            size_t next = scanned + 1;
+            if (next < response.size() && response[next] == '\r') {
+                next++;
+            }
+            if (next >= response.size()) {
+                // Look at this newline again once there's more.
+                break;
+            }
+            if (response[next] == '\n') {
+                return next + 1;
+            }
+        }
+        return 0;
+    }
+
+    /// Code from an "HTTP/1.x NNN ..." status line.
+    int status_code() const {
+        static const char prefix[] = "HTTP/1.";
+        const size_t prefixLen = sizeof(prefix) - 1;
+        const char* line = response.data();
+        if (response.compare(0, prefixLen, prefix) != 0
+                || (line[prefixLen] != '0' && line[prefixLen] != '1')
+                || line[prefixLen + 1] != ' ') {
+            throw std::runtime_error("upstream proxy protocol mismatch");
+        }
+        // The headers end with a newline, so none of this runs off the end.
+        const char* digits = line + prefixLen + 2;
+        int code = 0;
+        for (int i = 0; i < 3; i++) {
+            if (digits[i] < '0' || digits[i] > '9') {
+                throw std::runtime_error("upstream proxy protocol mismatch");
+            }
+            code = code * 10 + (digits[i] - '0');
+        }
+        if (digits[3] != ' ' && digits[3] != '\r' && digits[3] != '\n') {
+            throw std::runtime_error("upstream proxy protocol mismatch");
+        }
+        return code;
+    }
+};
+
+class HttpTcpProxy : public TcpProxy {
+public:
+    HttpTcpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, int clientSocketFd):
+        Proxy(settings, clientAddress, targetAddress),
+        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
+    {
+    }
+
+private:
+    std::unique_ptr<Handshake> handshake() override {
+        std::string host = targetName.empty() ? targetAddress.authority() : targetName;
+        std::string tunnelRequest =
+            std::string("CONNECT ") + host + ":" + std::to_string(targetPort) + " HTTP/1.1\n"
+            + "Host: " + host + ":" + std::to_string(targetPort) + "\n"
+            + (!settings->username.empty() ? "Proxy-Authorization: Basic " + base64encode(settings->username + ":" + settings->password) + "\n" : "")
+            + "\n";
+        return std::unique_ptr<Handshake>(new HttpHandshake(tunnelRequest));
+    }
 };
 
 #endif
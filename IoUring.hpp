@@ -0,0 +1,311 @@
+#ifndef HGUARD_IO_URING
+#define HGUARD_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// Submission queue entries per ring. The completion queue gets twice as
+/// many.
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 4096
+#endif
+
+/// Something with io_uring operations in flight, told of each one's
+/// completion along with the tag (under 8) it was submitted with.
+class UringHandler {
+public:
+    virtual ~UringHandler() {
+    }
+
+    virtual void handle_completion(unsigned tag, int32_t result, uint32_t flags) = 0;
+};
+
+/// Minimal io_uring, straight on top of the system calls.
+///
+/// Operations are queued with sqe() and go to the kernel in one go at the
+/// next submit(), so however many there are, they cost a single system
+/// call between them, which also waits for completions. reap() then hands
+/// each completion to the UringHandler it was queued for. A ring must only
+/// be used by the thread which made it.
+class IoUring {
+private:
+    int ringFd;
+    unsigned features;
+
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned sqeTail; // Next entry to hand out
+
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+public:
+    explicit IoUring(unsigned entries = URING_ENTRIES) {
+        struct io_uring_params params = {};
+        // Completions are only wanted when we ask for them, from this
+        // thread, which saves the kernel interrupting us for them.
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        ringFd = setup(entries, params);
+        if (ringFd < 0 && errno == EINVAL) {
+            // Older than 6.1
+            params = {};
+            ringFd = setup(entries, params);
+        }
+        if (ringFd < 0) {
+            throw std::runtime_error(std::string("could not set up io_uring: ") + strerror(errno));
+        }
+        features = params.features;
+        sqRing = MAP_FAILED;
+        cqRing = MAP_FAILED;
+        sqes = (struct io_uring_sqe*)MAP_FAILED;
+        if ((features & IORING_FEAT_EXT_ARG) == 0) {
+            unmap();
+            throw std::runtime_error("io_uring is too old (needs Linux 5.11)");
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (features & IORING_FEAT_SINGLE_MMAP) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = (features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+            mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            unmap();
+            throw std::runtime_error("could not map io_uring");
+        }
+
+        char* sq = (char*)sqRing;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        // Entries are always used in order, so the indirection array can
+        // be set up once and for all.
+        unsigned* array = (unsigned*)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) {
+            array[i] = i;
+        }
+        sqeTail = *sqTail;
+
+        char* cq = (char*)cqRing;
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        unmap();
+    }
+
+    int fd() const {
+        return ringFd;
+    }
+
+    /// A blank entry to fill in, which will complete to handler with tag.
+    /// Queued for the next submit().
+    struct io_uring_sqe* sqe(UringHandler* handler, unsigned tag) {
+        if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            submit(0);
+            if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                throw std::runtime_error("io_uring submission queue full");
+            }
+        }
+        struct io_uring_sqe* entry = &sqes[sqeTail & sqMask];
+        std::memset(entry, 0, sizeof(*entry));
+        entry->user_data = uint64_t(uintptr_t(handler)) | tag;
+        sqeTail++;
+        return entry;
+    }
+
+    /// Hand everything queued to the kernel and, if asked to, wait until
+    /// at least waitFor operations have completed or timeoutMs has gone
+    /// by.
+    void submit(unsigned waitFor, int timeoutMs = -1) {
+        __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned flags = 0;
+        struct __kernel_timespec timeout = {};
+        struct io_uring_getevents_arg arg = {};
+        if (waitFor > 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (timeoutMs >= 0) {
+                timeout.tv_sec = timeoutMs / 1000;
+                timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+                arg.ts = uint64_t(uintptr_t(&timeout));
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+        }
+        if (toSubmit == 0 && waitFor == 0) {
+            return;
+        }
+        if (syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, flags,
+                    (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0) < 0) {
+            // Timing out, being interrupted and the kernel being short of
+            // room for completions can all wait for the next go.
+            if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                throw std::runtime_error(std::string("io_uring error: ") + strerror(errno));
+            }
+        }
+    }
+
+    /// Dispatch every completion there is so far. Returns how many there
+    /// were.
+    unsigned reap() {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = tail - head;
+        for (; head != tail; head++) {
+            const struct io_uring_cqe& cqe = cqes[head & cqMask];
+            UringHandler* handler = (UringHandler*)uintptr_t(cqe.user_data & ~uint64_t(7));
+            unsigned tag = unsigned(cqe.user_data & 7);
+            int32_t result = cqe.res;
+            uint32_t flags = cqe.flags;
+            // Let the kernel have the slot back before the handler queues
+            // more work.
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            if (handler != nullptr) {
+                handler->handle_completion(tag, result, flags);
+            }
+        }
+        return count;
+    }
+
+private:
+    static int setup(unsigned entries, struct io_uring_params& params) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 2;
+        return int(syscall(__NR_io_uring_setup, entries, &params));
+    }
+
+    void unmap() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        close(ringFd);
+    }
+};
+
+/// Buffers handed to the kernel up front (a provided buffer ring), so that
+/// a read can be queued on any number of sockets without setting a buffer
+/// aside for each: the kernel picks one only once there's data, and says
+/// which in the completion. Buffers are given back with provide() once
+/// their data has been dealt with.
+class UringBufferRing {
+private:
+    IoUring& ring;
+    uint16_t group;
+    unsigned count;
+    size_t bufferSize;
+    struct io_uring_buf_ring* entries;
+    size_t entriesSize;
+    char* buffers;
+    uint16_t tail;
+
+public:
+    /// count must be a power of two, and at most 32768.
+    UringBufferRing(IoUring& ring, uint16_t group, unsigned count, size_t bufferSize):
+        ring(ring),
+        group(group),
+        count(count),
+        bufferSize(bufferSize),
+        entriesSize(count * sizeof(struct io_uring_buf)),
+        tail(0)
+    {
+        void* memory = mmap(nullptr, entriesSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("could not map io_uring buffer ring");
+        }
+        entries = (struct io_uring_buf_ring*)memory;
+        // Only touched once the kernel has picked them.
+        memory = mmap(nullptr, count * bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            munmap(entries, entriesSize);
+            throw std::runtime_error("could not map io_uring buffers");
+        }
+        buffers = (char*)memory;
+
+        struct io_uring_buf_reg registration = {};
+        registration.ring_addr = uint64_t(uintptr_t(entries));
+        registration.ring_entries = count;
+        registration.bgid = group;
+        if (syscall(__NR_io_uring_register, ring.fd(), IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            int error = errno;
+            munmap(buffers, count * bufferSize);
+            munmap(entries, entriesSize);
+            throw std::runtime_error(std::string("could not register io_uring buffers (needs Linux 5.19): ") + strerror(error));
+        }
+        for (unsigned id = 0; id < count; id++) {
+            provide(id);
+        }
+    }
+
+    UringBufferRing(const UringBufferRing&) = delete;
+    UringBufferRing& operator=(const UringBufferRing&) = delete;
+
+    ~UringBufferRing() {
+        struct io_uring_buf_reg registration = {};
+        registration.bgid = group;
+        syscall(__NR_io_uring_register, ring.fd(), IORING_UNREGISTER_PBUF_RING, &registration, 1);
+        munmap(buffers, count * bufferSize);
+        munmap(entries, entriesSize);
+    }
+
+    /// For buf_group in reads with IOSQE_BUFFER_SELECT.
+    uint16_t id() const {
+        return group;
+    }
+
+    size_t size() const {
+        return bufferSize;
+    }
+
+    char* buffer(unsigned id) const {
+        return buffers + id * bufferSize;
+    }
+
+    /// The kernel may pick buffer id again.
+    void provide(unsigned id) {
+        // Not entries->bufs: in C++, the header's flexible array member
+        // ends up after an empty struct which takes up a byte.
+        struct io_uring_buf& entry = ((struct io_uring_buf*)entries)[tail & (count - 1)];
+        entry.addr = uint64_t(uintptr_t(buffer(id)));
+        entry.len = uint32_t(bufferSize);
+        entry.bid = uint16_t(id);
+        tail++;
+        __atomic_store_n(&entries->tail, tail, __ATOMIC_RELEASE);
+    }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef HGUARD_LIVE_SETTINGS
+#define HGUARD_LIVE_SETTINGS
+
+#include <atomic>
+#include <mutex>
+
+#include "ProxySettings.hpp"
+
+/// The settings for new tunnels and associations, which a reload may swap
+/// for new ones at any time. Anything already going holds on to the
+/// settings it started with, so is never disturbed by a reload.
+class LiveSettings {
+private:
+    mutable std::mutex mutex;
+    ProxySettings::Shared current;
+    std::atomic<uint64_t> changes;
+
+public:
+    explicit LiveSettings(const ProxySettings::Shared& settings):
+        current(settings),
+        changes(0)
+    {
+    }
+
+    LiveSettings(const LiveSettings&) = delete;
+    LiveSettings& operator=(const LiveSettings&) = delete;
+
+    ProxySettings::Shared get() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+
+    void set(const ProxySettings::Shared& settings) {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = settings;
+        changes.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Goes up with every set(), so that workers can tell whether to get()
+    /// with a single load.
+    uint64_t generation() const {
+        return changes.load(std::memory_order_acquire);
+    }
+};
+
+/// One worker's copy of the LiveSettings, only fetched again once they've
+/// changed.
+class SettingsView {
+private:
+    const LiveSettings& live;
+    uint64_t generation;
+    ProxySettings::Shared settings;
+
+public:
+    explicit SettingsView(const LiveSettings& live):
+        live(live),
+        generation(live.generation()),
+        settings(live.get())
+    {
+    }
+
+    const ProxySettings::Shared& get() const {
+        return settings;
+    }
+
+    /// Catch up with the live settings. Returns whether they'd changed.
+    bool refresh() {
+        uint64_t latest = live.generation();
+        if (latest == generation) {
+            return false;
+        }
+        generation = latest;
+        ProxySettings::Shared fresh = live.get();
+        if (fresh == settings) {
+            return false;
+        }
+        settings = fresh;
+        return true;
+    }
+};
+
+#endif
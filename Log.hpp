@@ -0,0 +1,468 @@
+#ifndef HGUARD_LOG
+#define HGUARD_LOG
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "Endpoint.hpp"
+
+/// Records each thread can have waiting for the writer. Records logged
+/// while a thread's ring is full are dropped (and counted).
+#ifndef LOG_RING_RECORDS
+#define LOG_RING_RECORDS 1024
+#endif
+/// Longest free text kept in a record.
+#ifndef LOG_TEXT_MAX
+#define LOG_TEXT_MAX 192
+#endif
+/// Milliseconds the writer sleeps for when there's nothing to write, if not
+/// woken sooner.
+#ifndef LOG_WRITER_IDLE_MS
+#define LOG_WRITER_IDLE_MS 50
+#endif
+
+enum class LogLevel {
+    ERROR,
+    WARN,
+    INFO,
+    DEBUG,
+};
+
+/// One line's worth of log, kept in binary until the writer gets to it.
+struct LogRecord {
+    enum class Kind : uint8_t {
+        /// PID, label, client -> target:port, then text.
+        TUNNEL,
+        /// Label, client:port, arrow, target:port.
+        DATAGRAM,
+        /// Just text.
+        MESSAGE,
+    };
+
+    Kind kind;
+    pid_t pid;
+    const char* label;
+    const char* arrow;
+    Endpoint client;
+    Endpoint target;
+    size_t textLength;
+    char text[LOG_TEXT_MAX];
+};
+
+/// Records from one thread to the writer. Single producer, single
+/// consumer, no locks.
+///
+/// Once its thread has exited, a ring is drained and then handed to the
+/// next new thread, rather than freed, as the writer may still be looking
+/// at it.
+class LogRing {
+private:
+    LogRecord records[LOG_RING_RECORDS];
+    alignas(64) std::atomic<size_t> head; // Next to write; producer's
+    alignas(64) std::atomic<size_t> tail; // Next to read; consumer's
+    alignas(64) std::atomic<uint64_t> dropped;
+
+public:
+    /// Set by the producer's thread as it exits.
+    std::atomic<bool> abandoned;
+    /// Set by the consumer once an abandoned ring is drained.
+    std::atomic<bool> reusable;
+
+    LogRing():
+        head(0),
+        tail(0),
+        dropped(0),
+        abandoned(false),
+        reusable(false)
+    {
+    }
+
+    /// Producer: somewhere to put the next record, or null if full.
+    LogRecord* claim() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &records[h % LOG_RING_RECORDS];
+    }
+
+    /// Producer: the claimed record is ready.
+    void publish() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /// Consumer: the oldest record, or null if none.
+    const LogRecord* peek() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &records[t % LOG_RING_RECORDS];
+    }
+
+    /// Consumer: done with the oldest record.
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint64_t take_dropped() {
+        return dropped.exchange(0, std::memory_order_relaxed);
+    }
+};
+
+/// Lets through one event in every Log::sample_every(), so that events
+/// which happen for every datagram can stay logged at full speed. Keep one
+/// per call site (and thread).
+class LogSampler {
+private:
+    unsigned count = 0;
+
+public:
+    bool take();
+};
+
+/// Logging to stderr, off the hot path.
+///
+/// Logging a record copies it into the calling thread's LogRing, without
+/// formatting anything; a background writer formats records and writes
+/// them out in batches. Until start(), and in processes forked since, the
+/// writer isn't there, so records are written out on the spot instead.
+///
+/// Only records at or above the level set are kept, and checking costs
+/// a relaxed load, so callers needn't check first unless working out what
+/// to log is itself expensive.
+class Log {
+private:
+    struct State {
+        std::atomic<int> level{int(LogLevel::INFO)};
+        std::atomic<unsigned> sampleEvery{1};
+        /// getpid() is a system call, so it's kept here, and updated in
+        /// forked children.
+        std::atomic<pid_t> pid{getpid()};
+        std::atomic<pid_t> writerPid{0};
+        std::atomic<bool> writerIdle{false};
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<LogRing*> rings; // Guarded by mutex
+        /// Held by whoever is consuming the rings: the writer, or flush().
+        std::mutex drainMutex;
+    };
+
+    /// Gives the calling thread's ring up when the thread exits.
+    struct RingOwner {
+        LogRing* ring = nullptr;
+
+        ~RingOwner() {
+            if (ring != nullptr) {
+                ring->abandoned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+public:
+    static void set_level(LogLevel level) {
+        state().level.store(int(level), std::memory_order_relaxed);
+    }
+
+    static bool enabled(LogLevel level) {
+        return int(level) <= state().level.load(std::memory_order_relaxed);
+    }
+
+    static void set_sample_every(unsigned every) {
+        state().sampleEvery.store(every > 0 ? every : 1, std::memory_order_relaxed);
+    }
+
+    static unsigned sample_every() {
+        return state().sampleEvery.load(std::memory_order_relaxed);
+    }
+
+    /// Whether to log this (frequent) event at level.
+    static bool sampled(LogLevel level, LogSampler& sampler) {
+        return enabled(level) && sampler.take();
+    }
+
+    /// Start the writer. After this, records logged by this process go
+    /// through it.
+    static void start() {
+        pthread_atfork(nullptr, nullptr, [] {
+                state().pid.store(getpid(), std::memory_order_relaxed);
+            });
+        std::thread([] {
+                write_forever();
+            }).detach();
+        state().writerPid.store(pid(), std::memory_order_release);
+    }
+
+    static pid_t pid() {
+        return state().pid.load(std::memory_order_relaxed);
+    }
+
+    /// Write out everything logged so far, by every thread, before
+    /// returning. For exit paths, which would otherwise lose whatever the
+    /// writer hadn't got to yet.
+    static void flush() {
+        if (writing_directly()) {
+            return;
+        }
+        State& s = state();
+        std::vector<LogRing*> rings;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            rings = s.rings;
+        }
+        std::string batch;
+        std::lock_guard<std::mutex> lock(s.drainMutex);
+        drain(rings, batch);
+        write_out(batch);
+    }
+
+    /// "PID<tab>LABEL CLIENT -> TARGET:PORT", then text if given.
+    static void tunnel(LogLevel level, const char* label, const Endpoint& client, const Endpoint& target, const char* text = nullptr) {
+        if (!enabled(level)) {
+            return;
+        }
+        LogRecord* record = begin();
+        if (record == nullptr) {
+            return;
+        }
+        record->kind = LogRecord::Kind::TUNNEL;
+        record->pid = pid();
+        record->label = label;
+        record->client = client;
+        record->target = target;
+        set_text(*record, text != nullptr ? text : "");
+        end(record);
+    }
+
+    /// "<tab>LABEL CLIENT:PORT ARROW TARGET:PORT".
+    static void datagram(LogLevel level, const char* label, const Endpoint& client, const char* arrow, const Endpoint& target) {
+        if (!enabled(level)) {
+            return;
+        }
+        LogRecord* record = begin();
+        if (record == nullptr) {
+            return;
+        }
+        record->kind = LogRecord::Kind::DATAGRAM;
+        record->label = label;
+        record->arrow = arrow;
+        record->client = client;
+        record->target = target;
+        record->textLength = 0;
+        end(record);
+    }
+
+    /// Anything else, written out like to a std::ostream. Formatted
+    /// straight away, so best kept to less frequent events.
+    template <typename... Args>
+    static void message(LogLevel level, const Args&... args) {
+        if (!enabled(level)) {
+            return;
+        }
+        LogRecord* record = begin();
+        if (record == nullptr) {
+            return;
+        }
+        std::ostringstream text;
+        int expand[] = {0, ((text << args), 0)...};
+        (void)expand;
+        record->kind = LogRecord::Kind::MESSAGE;
+        set_text(*record, text.str().c_str());
+        end(record);
+    }
+
+private:
+    static State& state() {
+        static State* state = new State(); // Never destroyed: the writer outlives main()
+        return *state;
+    }
+
+    static bool writing_directly() {
+        return state().writerPid.load(std::memory_order_acquire) != pid();
+    }
+
+    static LogRing& ring() {
+        thread_local RingOwner owner;
+        if (owner.ring == nullptr) {
+            owner.ring = adopt_ring();
+        }
+        return *owner.ring;
+    }
+
+    /// A ring for a new thread: one given up by a thread since gone, if
+    /// any has been drained, or else a new one.
+    static LogRing* adopt_ring() {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        for (LogRing* ring : state().rings) {
+            if (ring->reusable.load(std::memory_order_acquire)) {
+                ring->reusable.store(false, std::memory_order_relaxed);
+                return ring;
+            }
+        }
+        LogRing* ring = new LogRing();
+        state().rings.push_back(ring);
+        return ring;
+    }
+
+    /// Format everything waiting in rings onto batch. Only with drainMutex
+    /// held.
+    static void drain(const std::vector<LogRing*>& rings, std::string& batch) {
+        for (LogRing* ring : rings) {
+            if (ring->reusable.load(std::memory_order_acquire)) {
+                continue;
+            }
+            // Checked first: anything its thread logged is in by then.
+            bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+            while (const LogRecord* record = ring->peek()) {
+                format(*record, batch);
+                ring->pop();
+            }
+            uint64_t dropped = ring->take_dropped();
+            if (dropped > 0) {
+                batch += "(" + std::to_string(dropped) + " log records dropped)\n";
+            }
+            if (abandoned) {
+                ring->abandoned.store(false, std::memory_order_relaxed);
+                ring->reusable.store(true, std::memory_order_release);
+            }
+        }
+    }
+
+    static LogRecord* begin() {
+        if (writing_directly()) {
+            thread_local LogRecord direct;
+            return &direct;
+        }
+        return ring().claim();
+    }
+
+    static void end(LogRecord* record) {
+        if (writing_directly()) {
+            std::string line;
+            format(*record, line);
+            write_out(line);
+            return;
+        }
+        ring().publish();
+        if (state().writerIdle.load(std::memory_order_relaxed)) {
+            state().wake.notify_one();
+        }
+    }
+
+    static void set_text(LogRecord& record, const char* text) {
+        size_t length = std::strlen(text);
+        record.textLength = length < LOG_TEXT_MAX ? length : LOG_TEXT_MAX;
+        std::memcpy(record.text, text, record.textLength);
+    }
+
+    static void append_host(std::string& line, const Endpoint& address) {
+        char host[INET6_ADDRSTRLEN] = {};
+        line += address.format_host(host);
+    }
+
+    /// "ADDRESS:PORT", with IPv6 addresses in brackets.
+    static void append_endpoint(std::string& line, const Endpoint& address) {
+        if (address.is_v4()) {
+            append_host(line, address);
+        } else {
+            line += '[';
+            append_host(line, address);
+            line += ']';
+        }
+        line += ':';
+        line += std::to_string(address.port());
+    }
+
+    static void format(const LogRecord& record, std::string& line) {
+        switch (record.kind) {
+        case LogRecord::Kind::TUNNEL:
+            line += std::to_string(record.pid);
+            line += '\t';
+            line += record.label;
+            append_host(line, record.client);
+            line += " -> ";
+            append_endpoint(line, record.target);
+            break;
+        case LogRecord::Kind::DATAGRAM:
+            line += '\t';
+            line += record.label;
+            append_endpoint(line, record.client);
+            line += record.arrow;
+            append_endpoint(line, record.target);
+            break;
+        case LogRecord::Kind::MESSAGE:
+            break;
+        }
+        line.append(record.text, record.textLength);
+        line += '\n';
+    }
+
+    static void write_out(const std::string& text) {
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t r = write(STDERR_FILENO, text.data() + written, text.size() - written);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            written += r;
+        }
+    }
+
+    /// The writer thread: drain every ring, then nap until there's more.
+    static void write_forever() {
+        State& s = state();
+        std::vector<LogRing*> rings;
+        std::string batch;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                rings = s.rings;
+            }
+            bool wrote;
+            {
+                // Written out under the lock too, so that nothing drained
+                // here is still unwritten when a flush() returns.
+                std::lock_guard<std::mutex> drainLock(s.drainMutex);
+                drain(rings, batch);
+                wrote = !batch.empty();
+                write_out(batch);
+                batch.clear();
+            }
+            if (wrote) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.writerIdle.store(true, std::memory_order_relaxed);
+            s.wake.wait_for(lock, std::chrono::milliseconds(LOG_WRITER_IDLE_MS));
+            s.writerIdle.store(false, std::memory_order_relaxed);
+        }
+    }
+};
+
+inline bool LogSampler::take() {
+    if (++count >= Log::sample_every()) {
+        count = 0;
+        return true;
+    }
+    return false;
+}
+
+#endif
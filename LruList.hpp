@@ -0,0 +1,68 @@
+#ifndef HGUARD_LRU_LIST
+#define HGUARD_LRU_LIST
+
+/// Embed in anything kept on an LruList.
+struct LruNode {
+    LruNode* lruPrev = nullptr;
+    LruNode* lruNext = nullptr;
+};
+
+/// Intrusive doubly linked list, most recently used at the front.
+///
+/// Nodes are not owned by the list, and every operation is O(1).
+class LruList {
+private:
+    LruNode* head;
+    LruNode* tail;
+
+public:
+    LruList():
+        head(nullptr),
+        tail(nullptr)
+    {
+    }
+
+    LruList(const LruList&) = delete;
+    LruList& operator=(const LruList&) = delete;
+
+    void push_front(LruNode* node) {
+        node->lruPrev = nullptr;
+        node->lruNext = head;
+        if (head) {
+            head->lruPrev = node;
+        } else {
+            tail = node;
+        }
+        head = node;
+    }
+
+    void remove(LruNode* node) {
+        if (node->lruPrev) {
+            node->lruPrev->lruNext = node->lruNext;
+        } else {
+            head = node->lruNext;
+        }
+        if (node->lruNext) {
+            node->lruNext->lruPrev = node->lruPrev;
+        } else {
+            tail = node->lruPrev;
+        }
+        node->lruPrev = nullptr;
+        node->lruNext = nullptr;
+    }
+
+    /// Mark node as most recently used.
+    void touch(LruNode* node) {
+        if (node != head) {
+            remove(node);
+            push_front(node);
+        }
+    }
+
+    /// Least recently used node, or nullptr if empty.
+    LruNode* back() const {
+        return tail;
+    }
+};
+
+#endif
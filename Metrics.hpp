@@ -0,0 +1,138 @@
+#ifndef HGUARD_METRICS
+#define HGUARD_METRICS
+
+#include <atomic>
+#include <new>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+/// Most sets of counters handed out. Threads beyond this share.
+#ifndef METRICS_MAX_SHARDS
+#define METRICS_MAX_SHARDS 64
+#endif
+
+/// Things counted.
+enum class Metric {
+    ACCEPTS,
+    TUNNELS_OPENED,
+    TUNNELS_CLOSED,
+    BYTES_UPSTREAM,   // client -> proxy
+    BYTES_DOWNSTREAM, // proxy -> client
+    UPSTREAM_FAILURES,
+    UDP_ASSOCIATIONS_OPENED,
+    UDP_ASSOCIATIONS_CLOSED,
+    UDP_EVICTIONS,
+    UDP_DROPS,
+    DATAGRAMS_UPSTREAM,
+    DATAGRAMS_DOWNSTREAM,
+    REFUSED_RATE,     // Admission: client over its rate
+    REFUSED_CAPACITY, // Admission: too many tunnels open
+    COUNT,
+};
+
+/// Upper bounds of the handshake latency histogram's buckets, in
+/// microseconds. Anything slower goes in a last bucket of its own.
+static const uint64_t METRICS_LATENCY_BOUNDS_US[] = {
+    250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+static const size_t METRICS_LATENCY_BUCKETS = sizeof(METRICS_LATENCY_BOUNDS_US) / sizeof(METRICS_LATENCY_BOUNDS_US[0]) + 1;
+/// One histogram per ProxySettings::ProxyProtocol.
+static const size_t METRICS_PROTOCOLS = 4;
+
+/// One thread's counters. Only ever updated with relaxed atomics, by its
+/// own thread (give or take forked children), so updates are cheap.
+struct alignas(64) MetricsShard {
+    std::atomic<uint64_t> counts[size_t(Metric::COUNT)];
+    std::atomic<uint64_t> latencyBuckets[METRICS_PROTOCOLS][METRICS_LATENCY_BUCKETS];
+    std::atomic<uint64_t> latencySumUs[METRICS_PROTOCOLS];
+};
+
+/// Counters summed over every shard at some moment.
+struct MetricsSnapshot {
+    uint64_t counts[size_t(Metric::COUNT)] = {};
+    uint64_t latencyBuckets[METRICS_PROTOCOLS][METRICS_LATENCY_BUCKETS] = {};
+    uint64_t latencySumUs[METRICS_PROTOCOLS] = {};
+
+    uint64_t operator[](Metric metric) const {
+        return counts[size_t(metric)];
+    }
+};
+
+/// Process-wide counters, for the metrics endpoint.
+///
+/// Each thread counts into a shard of its own, and reading them sums the
+/// lot. The shards live in shared memory, so tunnels handled by forked
+/// children are counted too, as long as init() was called before forking.
+class Metrics {
+private:
+    struct Region {
+        std::atomic<size_t> nextShard;
+        MetricsShard shards[METRICS_MAX_SHARDS];
+    };
+
+public:
+    /// Set the counters up. Must happen before any fork().
+    static void init() {
+        region();
+    }
+
+    static void count(Metric metric, uint64_t n = 1) {
+        local().counts[size_t(metric)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /// A tunnel speaking protocol (a ProxySettings::ProxyProtocol) took
+    /// latencyUs to get going.
+    static void observe_handshake(size_t protocol, uint64_t latencyUs) {
+        size_t bucket = 0;
+        while (bucket < METRICS_LATENCY_BUCKETS - 1 && latencyUs > METRICS_LATENCY_BOUNDS_US[bucket]) {
+            bucket++;
+        }
+        MetricsShard& shard = local();
+        shard.latencyBuckets[protocol][bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.latencySumUs[protocol].fetch_add(latencyUs, std::memory_order_relaxed);
+    }
+
+    static MetricsSnapshot snapshot() {
+        MetricsSnapshot total;
+        for (const MetricsShard& shard : region().shards) {
+            for (size_t i = 0; i < size_t(Metric::COUNT); i++) {
+                total.counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+            }
+            for (size_t p = 0; p < METRICS_PROTOCOLS; p++) {
+                for (size_t b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+                    total.latencyBuckets[p][b] += shard.latencyBuckets[p][b].load(std::memory_order_relaxed);
+                }
+                total.latencySumUs[p] += shard.latencySumUs[p].load(std::memory_order_relaxed);
+            }
+        }
+        return total;
+    }
+
+private:
+    static Region& region() {
+        static Region* region = map_region(); // Never unmapped
+        return *region;
+    }
+
+    static Region* map_region() {
+        void* memory = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("could not map metrics");
+        }
+        // Zeroed by mmap, which is what the atomics start at.
+        return new (memory) Region();
+    }
+
+    static MetricsShard& local() {
+        thread_local MetricsShard* shard = nullptr;
+        if (shard == nullptr) {
+            size_t index = region().nextShard.fetch_add(1, std::memory_order_relaxed);
+            shard = &region().shards[index % METRICS_MAX_SHARDS];
+        }
+        return *shard;
+    }
+};
+
+#endif
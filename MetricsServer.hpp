@@ -0,0 +1,289 @@
+#ifndef HGUARD_METRICS_SERVER
+#define HGUARD_METRICS_SERVER
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "Cleaner.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+
+/// Milliseconds a scraper gets to send its request.
+#ifndef METRICS_REQUEST_TIMEOUT_MS
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+#endif
+
+/// Serves the Metrics over HTTP, in the Prometheus text format, from a
+/// thread of its own.
+///
+/// Listens on a TCP port (on loopback unless told otherwise) or, given a
+/// path, a unix socket. Requests are answered one at a time, which is
+/// plenty for a scraper.
+class MetricsServer {
+private:
+    int listeningSocketFd;
+    int stopFd;
+
+public:
+    /// endpoint is PORT, ADDRESS:PORT or a path to a unix socket (anything
+    /// with a '/' in it).
+    explicit MetricsServer(const std::string& endpoint):
+        stopFd(-1)
+    {
+        if (endpoint.find('/') != std::string::npos) {
+            listeningSocketFd = listen_unix(endpoint);
+        } else {
+            listeningSocketFd = listen_tcp(endpoint);
+        }
+    }
+
+    /// Serve on an endpoint already listened on (taken over from another
+    /// instance).
+    explicit MetricsServer(int listeningSocketFd):
+        listeningSocketFd(listeningSocketFd),
+        stopFd(-1)
+    {
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    /// Throws if endpoint couldn't be listened on whatever happens,
+    /// without listening on it.
+    static void check_endpoint(const std::string& endpoint) {
+        if (endpoint.find('/') != std::string::npos) {
+            struct sockaddr_un address;
+            if (endpoint.size() >= sizeof(address.sun_path)) {
+                throw std::runtime_error("metrics socket path too long");
+            }
+        } else {
+            tcp_address(endpoint);
+        }
+    }
+
+    int fd() const {
+        return listeningSocketFd;
+    }
+
+    /// Serve in the background until stopFd (if not -1) becomes readable.
+    /// The server must live for the rest of the process.
+    void start(int stopFd = -1) {
+        this->stopFd = stopFd;
+        std::thread([this] {
+                serve();
+            }).detach();
+    }
+
+    /// Everything counted so far, in the Prometheus text format.
+    static std::string render(const MetricsSnapshot& m) {
+        std::ostringstream out;
+        counter(out, "transproxify_accepts_total", "TCP connections accepted.", m[Metric::ACCEPTS]);
+        gauge(out, "transproxify_tunnels_active", "TCP tunnels open or opening.",
+              m[Metric::TUNNELS_OPENED] - m[Metric::TUNNELS_CLOSED]);
+        header(out, "transproxify_relayed_bytes_total", "Bytes relayed through TCP tunnels.", "counter");
+        out << "transproxify_relayed_bytes_total{direction=\"upstream\"} " << m[Metric::BYTES_UPSTREAM] << "\n";
+        out << "transproxify_relayed_bytes_total{direction=\"downstream\"} " << m[Metric::BYTES_DOWNSTREAM] << "\n";
+        header(out, "transproxify_handshake_seconds", "Time from accepting a TCP connection to relaying it.", "histogram");
+        // As given to -t, by ProxySettings::ProxyProtocol.
+        static const char* protocols[METRICS_PROTOCOLS] = {"direct", "http", "socks4", "socks5"};
+        for (size_t p = 0; p < METRICS_PROTOCOLS; p++) {
+            const char* protocol = protocols[p];
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+                cumulative += m.latencyBuckets[p][b];
+            }
+            if (cumulative == 0) {
+                continue;
+            }
+            cumulative = 0;
+            for (size_t b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+                cumulative += m.latencyBuckets[p][b];
+                out << "transproxify_handshake_seconds_bucket{protocol=\"" << protocol << "\",le=\"";
+                if (b < METRICS_LATENCY_BUCKETS - 1) {
+                    out << METRICS_LATENCY_BOUNDS_US[b] / 1e6;
+                } else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "transproxify_handshake_seconds_sum{protocol=\"" << protocol << "\"} " << m.latencySumUs[p] / 1e6 << "\n";
+            out << "transproxify_handshake_seconds_count{protocol=\"" << protocol << "\"} " << cumulative << "\n";
+        }
+        counter(out, "transproxify_upstream_failures_total", "Failed attempts to connect to or negotiate with an upstream proxy.",
+                m[Metric::UPSTREAM_FAILURES]);
+        gauge(out, "transproxify_udp_associations", "UDP associations open.",
+              m[Metric::UDP_ASSOCIATIONS_OPENED] - m[Metric::UDP_ASSOCIATIONS_CLOSED]);
+        counter(out, "transproxify_udp_evictions_total", "UDP associations dropped to make room for new ones.",
+                m[Metric::UDP_EVICTIONS]);
+        header(out, "transproxify_udp_datagrams_total", "UDP datagrams from clients (upstream) and back to them (downstream).", "counter");
+        out << "transproxify_udp_datagrams_total{direction=\"upstream\"} " << m[Metric::DATAGRAMS_UPSTREAM] << "\n";
+        out << "transproxify_udp_datagrams_total{direction=\"downstream\"} " << m[Metric::DATAGRAMS_DOWNSTREAM] << "\n";
+        counter(out, "transproxify_udp_dropped_datagrams_total", "Datagrams which couldn't be relayed through the SOCKS5 proxy.",
+                m[Metric::UDP_DROPS]);
+        header(out, "transproxify_refused_total", "New tunnels and UDP associations refused, by reason.", "counter");
+        out << "transproxify_refused_total{reason=\"rate\"} " << m[Metric::REFUSED_RATE] << "\n";
+        out << "transproxify_refused_total{reason=\"capacity\"} " << m[Metric::REFUSED_CAPACITY] << "\n";
+        return out.str();
+    }
+
+private:
+    static void header(std::ostringstream& out, const char* name, const char* help, const char* type) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+    }
+
+    static void counter(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+        header(out, name, help, "counter");
+        out << name << " " << value << "\n";
+    }
+
+    static void gauge(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+        header(out, name, help, "gauge");
+        // Opened and closed are read separately, so may be briefly off.
+        out << name << " " << int64_t(value) << "\n";
+    }
+
+    /// [HOST:]PORT, HOST being an IPv4 address (127.0.0.1 if not given).
+    static struct sockaddr_in tcp_address(const std::string& endpoint) {
+        size_t colon = endpoint.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : endpoint.substr(0, colon);
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        int port = 0;
+        try {
+            port = std::stoi(endpoint.substr(colon == std::string::npos ? 0 : colon + 1));
+        } catch (const std::exception&) {
+            port = 0;
+        }
+        if (port < 1 || port > 65535 || inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+            throw std::runtime_error("bad metrics endpoint");
+        }
+        address.sin_port = htons(port);
+        return address;
+    }
+
+    static int listen_tcp(const std::string& endpoint) {
+        struct sockaddr_in address = tcp_address(endpoint);
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("could not open metrics socket");
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+            close(fd);
+            throw std::runtime_error("could not bind metrics endpoint");
+        }
+        return fd;
+    }
+
+    static int listen_unix(const std::string& path) {
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("metrics socket path too long");
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("could not open metrics socket");
+        }
+        // Left over from last time, most likely.
+        unlink(path.c_str());
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+            close(fd);
+            throw std::runtime_error("could not bind metrics endpoint");
+        }
+        return fd;
+    }
+
+    void serve() {
+        struct pollfd fds[2] = {{listeningSocketFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                continue;
+            }
+            if (fds[1].revents) {
+                // Another instance serves from here on.
+                return;
+            }
+            int fd = accept4(listeningSocketFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    Log::message(LogLevel::ERROR, "Error during metrics accept.");
+                    sleep(1);
+                }
+                continue;
+            }
+            Cleaner fdCleaner([fd] {
+                    close(fd);
+                });
+            struct timeval timeout = {METRICS_REQUEST_TIMEOUT_MS / 1000, (METRICS_REQUEST_TIMEOUT_MS % 1000) * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::string request;
+            if (!read_request(fd, request)) {
+                continue;
+            }
+            respond(fd, request);
+        }
+    }
+
+    /// Read up to the end of the request's headers.
+    static bool read_request(int fd, std::string& request) {
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+            if (request.size() > 8192) {
+                return false;
+            }
+            ssize_t r = recv(fd, buffer, sizeof(buffer), 0);
+            if (r <= 0) {
+                return false;
+            }
+            request.append(buffer, r);
+        }
+        return true;
+    }
+
+    static void respond(int fd, const std::string& request) {
+        std::string line = request.substr(0, request.find_first_of("\r\n"));
+        std::string status;
+        std::string body;
+        if (line.compare(0, 4, "GET ") != 0) {
+            status = "405 Method Not Allowed";
+        } else {
+            std::string path = line.substr(4, line.find(' ', 4) - 4);
+            if (path == "/" || path == "/metrics") {
+                status = "200 OK";
+                body = render(Metrics::snapshot());
+            } else {
+                status = "404 Not Found";
+            }
+        }
+        std::string response = "HTTP/1.0 " + status + "\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n"
+            "\r\n" + body;
+        size_t written = 0;
+        while (written < response.size()) {
+            ssize_t w = send(fd, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+            if (w <= 0) {
+                return;
+            }
+            written += w;
+        }
+    }
+};
+
+#endif
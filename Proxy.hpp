@@ -3,40 +3,61 @@
 
 #include <cassert>
 
+#include "Endpoint.hpp"
 #include "Util.hpp"
 #include "Cleaner.hpp"
 #include "ProxySettings.hpp"
+#include "Slab.hpp"
+
+/// A tunnel or association. Allocated from slabs, as they come and go so
+/// often.
+///
+/// Setting one up shouldn't allocate anything else: the settings are
+/// shared, and addresses are only formatted if something asks for them.
+class Proxy : public SlabAllocated {
+private:
+    mutable char clientHostText[INET6_ADDRSTRLEN];
+    mutable char targetHostText[INET6_ADDRSTRLEN];
 
-class Proxy {
 protected:
-    ProxySettings settings;
-    struct sockaddr_in clientAddress;
-    std::string clientHost;
+    ProxySettings::Shared settings;
+    Endpoint clientAddress;
     int clientPort;
-    struct sockaddr_in targetAddress;
-    std::string targetHost;
+    Endpoint targetAddress;
     int targetPort;
 
 public:
     // clientSocketFd becomes owned by Proxy
-    Proxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress):
+    Proxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress):
+        clientHostText{},
+        targetHostText{},
         settings(settings),
         clientAddress(clientAddress),
-        targetAddress(targetAddress)
+        clientPort(clientAddress.port()),
+        targetAddress(targetAddress),
+        targetPort(targetAddress.port())
     {
-        char clientHostCStr[256] = {};
-        inet_ntop(AF_INET, &clientAddress.sin_addr, clientHostCStr, sizeof(clientHostCStr));
-        clientHost = std::string(clientHostCStr);
-        clientPort = ntohs(clientAddress.sin_port);
-
-        char targetHostCStr[256] = {};
-        inet_ntop(AF_INET, &targetAddress.sin_addr, targetHostCStr, sizeof(targetHostCStr));
-        targetHost = std::string(targetHostCStr);
-        targetPort = ntohs(targetAddress.sin_port);
     }
 
     virtual ~Proxy() {
     }
+
+protected:
+    const char* client_host() const {
+        return format_host(clientAddress, clientHostText);
+    }
+
+    const char* target_host() const {
+        return format_host(targetAddress, targetHostText);
+    }
+
+private:
+    static const char* format_host(const Endpoint& address, char (&text)[INET6_ADDRSTRLEN]) {
+        if (text[0] == '\0') {
+            address.format_host(text);
+        }
+        return text;
+    }
 };
 
 #endif
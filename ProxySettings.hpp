@@ -1,10 +1,35 @@
 #ifndef HGUARD_PROXY_SETTINGS
 #define HGUARD_PROXY_SETTINGS
 
+#include <memory>
+
 #include <sys/socket.h>
+#include <netdb.h>
+
+#include "Admission.hpp"
+#include "Cleaner.hpp"
+#include "SocketTuning.hpp"
+#include "Upstreams.hpp"
 
 class Proxy;
 
+/// Seconds of inactivity before a UDP association is dropped.
+#ifndef UDP_PROXY_TIMEOUT
+#define UDP_PROXY_TIMEOUT 300
+#endif
+/// Most UDP associations kept at once.
+#ifndef UDP_PROXY_LIMIT
+#define UDP_PROXY_LIMIT 256
+#endif
+/// Idle SOCKS5 UDP ASSOCIATE sessions kept ready for new associations.
+#ifndef SOCKS5_UDP_POOL_SIZE
+#define SOCKS5_UDP_POOL_SIZE 4
+#endif
+/// Seconds a pooled upstream connection may sit idle before it's dropped.
+#ifndef UPSTREAM_POOL_IDLE
+#define UPSTREAM_POOL_IDLE 30
+#endif
+
 struct ProxySettings {
 public:
     enum class ProxyProtocol {
@@ -17,6 +42,15 @@ public:
         TCP,
         UDP,
     };
+    enum class TcpEngine {
+        FORK,
+        EPOLL,
+        URING,
+    };
+    enum class RelayEngine {
+        COPY,
+        SPLICE,
+    };
     static inline const char* protocol_name(ProxyProtocol protocol) {
         switch (protocol) {
         case ProxyProtocol::DIRECT:
@@ -41,13 +75,48 @@ public:
             return "Invalid Proxied Protocol";
         }
     }
+    static inline const char* engine_name(TcpEngine engine) {
+        switch (engine) {
+        case TcpEngine::FORK:
+            return "fork";
+        case TcpEngine::EPOLL:
+            return "epoll";
+        case TcpEngine::URING:
+            return "uring";
+        default:
+            return "Invalid TCP Engine";
+        }
+    }
+
+    /// Each generation of settings is immutable once made, and shared by
+    /// everything using it. A reload makes a new generation for new
+    /// tunnels and associations, and those already going keep the one
+    /// they started with.
+    typedef std::shared_ptr<const ProxySettings> Shared;
 
 public:
     ProxyProtocol proxyProtocol;
     ProxiedProtocol proxiedProtocol;
     std::string username;
     std::string password;
-    struct sockaddr_in proxyAddress;
+    /// Shared by every copy of the settings.
+    std::shared_ptr<UpstreamSet> upstreams;
+    /// Likewise.
+    std::shared_ptr<Admission> admission;
+    TcpEngine tcpEngine = TcpEngine::EPOLL;
+    RelayEngine relayEngine = RelayEngine::COPY;
+    int workers = 1;
+    bool pinWorkers = false;
+    int udpTimeout = UDP_PROXY_TIMEOUT;
+    int udpProxyLimit = UDP_PROXY_LIMIT;
+    int udpSessionPool = SOCKS5_UDP_POOL_SIZE;
+    bool socks5Pipelining = false;
+    bool earlyData = false;
+    bool peekTargetName = false;
+    int upstreamPool = 0;
+    int upstreamPoolIdle = UPSTREAM_POOL_IDLE;
+    SocketTuning clientSocket;
+    SocketTuning upstreamSocket;
 
 private:
     static inline void check_support(ProxyProtocol proxy, ProxiedProtocol proxied, std::initializer_list<ProxiedProtocol> supportList) {
@@ -59,6 +128,22 @@ private:
         throw std::runtime_error(std::string() + protocol_name(proxy) + " does not support proxying " + protocol_name(proxied));
     }
 
+    /// Whichever address of either family getaddrinfo() ranks first.
+    static Endpoint resolve(const std::string& proxyHost, int proxyPort) {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct addrinfo* result = nullptr;
+        if (getaddrinfo(proxyHost.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) {
+            throw std::runtime_error("could not resolve proxy hostname");
+        }
+        Cleaner resultCleaner([result] {
+                freeaddrinfo(result);
+            });
+        return Endpoint::from(result->ai_addr).with_port(proxyPort);
+    }
+
 public:
     ProxySettings(ProxyProtocol proxyProtocol,
                   ProxiedProtocol proxiedProtocol,
@@ -70,19 +155,11 @@ public:
         proxyProtocol(proxyProtocol),
         proxiedProtocol(proxiedProtocol),
         username(username),
-        password(password)
+        password(password),
+        upstreams(new UpstreamSet()),
+        admission(new Admission())
     {
-        struct hostent *server = gethostbyname(proxyHost.c_str()); // replace with getaddrinfo() later
-        if (server == nullptr) {
-            throw std::runtime_error("could not resolve proxy hostname");
-        }
-        if (server->h_addrtype != AF_INET) {
-            throw std::runtime_error("FIXME: Resolved to IPv6 address. Use getaddrinfo() instead.");
-        }
-        proxyAddress = {};
-        proxyAddress.sin_family = AF_INET;
-        bcopy((char*)server->h_addr, &proxyAddress.sin_addr.s_addr, server->h_length);
-        proxyAddress.sin_port = htons(proxyPort);
+        add_upstream(proxyHost, proxyPort, 1);
 
         switch (proxyProtocol) {
         case ProxyProtocol::DIRECT:
@@ -119,6 +196,14 @@ public:
             throw std::runtime_error("bad protocol setting");
         }
     }
+
+    /// Another proxy to spread tunnels over, speaking the same protocol
+    /// with the same credentials.
+    void add_upstream(const std::string& proxyHost, int proxyPort, int weight) {
+        Endpoint address = resolve(proxyHost, proxyPort);
+        std::string host = proxyHost.find(':') == std::string::npos ? proxyHost : "[" + proxyHost + "]";
+        upstreams->add(address, host + ":" + std::to_string(proxyPort), weight);
+    }
 };
 
 #endif
@@ -0,0 +1,240 @@
+#ifndef HGUARD_RELAY_CHANNEL
+#define HGUARD_RELAY_CHANNEL
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BufferPool.hpp"
+
+#ifndef RELAY_BUFFER_SIZE
+#define RELAY_BUFFER_SIZE 65536
+#endif
+
+/// This thread's pool of copy mode buffers.
+static inline BufferPool& relay_buffers() {
+    thread_local BufferPool pool(RELAY_BUFFER_SIZE);
+    return pool;
+}
+
+/// One direction of a tunnel: reads from srcFd and writes to dstFd,
+/// holding on to anything dstFd isn't ready to accept yet.
+///
+/// Data is either copied through a userspace ring buffer, or (zero copy)
+/// spliced through a pipe so that it never leaves the kernel. If splicing
+/// turns out not to be supported, the channel quietly falls back to
+/// copying. Either way, up to RELAY_BUFFER_SIZE bytes can be held, and
+/// the source can be read from whilst the destination is catching up, so
+/// long as there's room. Once full, can_fill() is false, and the source
+/// should be left alone until drain() makes room.
+///
+/// A copy mode buffer is only borrowed from relay_buffers() while there's
+/// something in it, so quiet tunnels cost next to nothing.
+///
+/// fill() and drain() behave like read() and write(): they return -1 and
+/// set errno (EAGAIN included) when nothing could be moved.
+class RelayChannel {
+private:
+    int srcFd;
+    int dstFd;
+    bool srcOpen;
+
+    // Copy mode: used bytes from start, wrapping round, in a buffer of
+    // RELAY_BUFFER_SIZE (or null while empty)
+    char* buffer;
+    size_t start;
+    size_t used;
+
+    // Zero copy mode
+    int pipeFds[2];
+    size_t piped;
+
+public:
+    RelayChannel():
+        srcFd(-1),
+        dstFd(-1),
+        srcOpen(true),
+        buffer(nullptr),
+        start(0),
+        used(0),
+        pipeFds{-1, -1},
+        piped(0)
+    {
+    }
+
+    RelayChannel(const RelayChannel&) = delete;
+    RelayChannel& operator=(const RelayChannel&) = delete;
+
+    ~RelayChannel() {
+        close_pipe();
+        return_buffer();
+    }
+
+    void open(int srcFd, int dstFd, bool zeroCopy) {
+        this->srcFd = srcFd;
+        this->dstFd = dstFd;
+        if (zeroCopy) {
+            if (pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                pipeFds[0] = -1;
+                pipeFds[1] = -1;
+            } else {
+                // So that the pipe fills up no sooner than can_fill()
+                // expects. Harmless if refused: fill() just gets EAGAIN.
+                fcntl(pipeFds[1], F_SETPIPE_SZ, RELAY_BUFFER_SIZE);
+            }
+        }
+    }
+
+    int source() const {
+        return srcFd;
+    }
+
+    int destination() const {
+        return dstFd;
+    }
+
+    bool zero_copy() const {
+        return pipeFds[0] >= 0;
+    }
+
+    /// Data has been read but not yet written.
+    bool pending() const {
+        return zero_copy() ? piped != 0 : used != 0;
+    }
+
+    /// Worth trying to read more from the source: it's open and there's
+    /// room to read into.
+    bool can_fill() const {
+        return srcOpen && (zero_copy() ? piped : used) < RELAY_BUFFER_SIZE;
+    }
+
+    /// Source has hung up and everything has been passed on.
+    bool finished() const {
+        return !srcOpen && !pending();
+    }
+
+    /// Queue data which has already been read from the source (e.g. with
+    /// the end of a proxy handshake) to go out first. The channel must not
+    /// have anything pending.
+    void preload(const char* data, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        if (len > RELAY_BUFFER_SIZE) {
+            throw std::runtime_error("too much early tunnel data to queue");
+        }
+        if (zero_copy()) {
+            // Far smaller than the pipe, so this can't block.
+            ssize_t r = write(pipeFds[1], data, len);
+            if (r < 0 || size_t(r) != len) {
+                throw std::runtime_error("could not queue early tunnel data");
+            }
+            piped = len;
+        } else {
+            borrow_buffer();
+            std::memcpy(buffer, data, len);
+            start = 0;
+            used = len;
+        }
+    }
+
+    /// Read from the source into whatever room there is. Returns 0 (and
+    /// closes the channel) on EOF.
+    ssize_t fill() {
+        ssize_t r;
+        if (zero_copy()) {
+            r = splice(srcFd, nullptr, pipeFds[1], nullptr, RELAY_BUFFER_SIZE - piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (r < 0 && errno == EINVAL && piped == 0) {
+                // Not spliceable after all. Nothing is in the pipe yet,
+                // so just start copying instead.
+                close_pipe();
+                return fill();
+            }
+            if (r > 0) {
+                piped += r;
+            }
+        } else {
+            borrow_buffer();
+            // The free space runs from the end of the data to the end of
+            // the buffer, then on from the beginning up to start.
+            size_t tail = (start + used) % RELAY_BUFFER_SIZE;
+            size_t free = RELAY_BUFFER_SIZE - used;
+            struct iovec iov[2];
+            iov[0].iov_base = buffer + tail;
+            iov[0].iov_len = std::min(free, RELAY_BUFFER_SIZE - tail);
+            iov[1].iov_base = buffer;
+            iov[1].iov_len = free - iov[0].iov_len;
+            r = readv(srcFd, iov, iov[1].iov_len > 0 ? 2 : 1);
+            if (r > 0) {
+                used += r;
+            } else if (used == 0) {
+                return_buffer();
+            }
+        }
+        if (r == 0) {
+            srcOpen = false;
+        }
+        return r;
+    }
+
+    /// Write as much pending data to the destination as it will take.
+    ssize_t drain() {
+        ssize_t r;
+        if (zero_copy()) {
+            r = splice(pipeFds[0], nullptr, dstFd, nullptr, piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (r > 0) {
+                piped -= r;
+            }
+        } else {
+            struct iovec iov[2];
+            iov[0].iov_base = buffer + start;
+            iov[0].iov_len = std::min(used, RELAY_BUFFER_SIZE - start);
+            iov[1].iov_base = buffer;
+            iov[1].iov_len = used - iov[0].iov_len;
+            struct msghdr message = {};
+            message.msg_iov = iov;
+            message.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+            r = sendmsg(dstFd, &message, MSG_NOSIGNAL);
+            if (r > 0) {
+                used -= r;
+                start = (start + r) % RELAY_BUFFER_SIZE;
+                if (used == 0) {
+                    start = 0;
+                    return_buffer();
+                }
+            }
+        }
+        return r;
+    }
+
+private:
+    void borrow_buffer() {
+        if (buffer == nullptr) {
+            buffer = relay_buffers().acquire();
+        }
+    }
+
+    void return_buffer() {
+        if (buffer != nullptr) {
+            relay_buffers().release(buffer);
+            buffer = nullptr;
+        }
+    }
+
+    void close_pipe() {
+        if (pipeFds[0] >= 0) {
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+            pipeFds[0] = -1;
+            pipeFds[1] = -1;
+        }
+    }
+};
+
+#endif
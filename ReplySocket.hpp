@@ -0,0 +1,107 @@
+#ifndef HGUARD_REPLY_SOCKET
+#define HGUARD_REPLY_SOCKET
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "Cleaner.hpp"
+#include "Endpoint.hpp"
+
+class ReplySocketCache;
+
+/// Transparent UDP socket bound to a (usually non-local) target address,
+/// used to send datagrams which appear to come from that target.
+///
+/// Replies from the same target to any number of clients can share one
+/// socket, as it is never connected.
+class ReplySocket {
+    friend class ReplySocketCache;
+
+private:
+    ReplySocketCache& cache;
+    Endpoint key;
+    int fd;
+
+public:
+    ReplySocket(ReplySocketCache& cache, const Endpoint& address):
+        cache(cache),
+        key(address)
+    {
+        fd = socket(address.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open socket for sending to client");
+        }
+        Cleaner fdCleaner([this] {
+                close(this->fd);
+            });
+
+        const int on = 1;
+        if (address.is_v4() ? setsockopt(fd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)) < 0
+                            : setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set IP_TRANSPARENT for sending to client");
+        }
+        // The target may be an address:port we're also receiving on
+        // (e.g. a local server).
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set SO_REUSEADDR for sending to client");
+        }
+        SocketAddress bound = address.socket_address();
+        if (bind(fd, bound.get(), bound.length) < 0) {
+            throw std::runtime_error(std::string("could not bind to address and port for sending to client: ") + strerror(errno));
+        }
+        fdCleaner.disable();
+    }
+
+    ReplySocket(const ReplySocket&) = delete;
+    ReplySocket& operator=(const ReplySocket&) = delete;
+
+    inline ~ReplySocket();
+
+    int get_fd() const {
+        return fd;
+    }
+};
+
+/// Hands out shared ReplySockets, one per target address. A socket lives
+/// for as long as some association holds on to it.
+class ReplySocketCache {
+    friend class ReplySocket;
+
+private:
+    std::unordered_map<Endpoint, std::weak_ptr<ReplySocket>, EndpointHash> sockets;
+
+public:
+    ReplySocketCache() {
+    }
+
+    ReplySocketCache(const ReplySocketCache&) = delete;
+    ReplySocketCache& operator=(const ReplySocketCache&) = delete;
+
+    std::shared_ptr<ReplySocket> get(const Endpoint& address) {
+        auto it = sockets.find(address);
+        if (it != sockets.end()) {
+            std::shared_ptr<ReplySocket> socket = it->second.lock();
+            if (socket) {
+                return socket;
+            }
+        }
+        std::shared_ptr<ReplySocket> socket = std::make_shared<ReplySocket>(*this, address);
+        sockets[address] = socket;
+        return socket;
+    }
+};
+
+ReplySocket::~ReplySocket() {
+    close(fd);
+    cache.sockets.erase(key);
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef HGUARD_RESOLVER
+#define HGUARD_RESOLVER
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "Endpoint.hpp"
+#include "EventLoop.hpp"
+#include "Log.hpp"
+#include "TimerWheel.hpp"
+
+/// Seconds a resolved name is remembered.
+#ifndef DNS_CACHE_TTL
+#define DNS_CACHE_TTL 60
+#endif
+/// Seconds a name which couldn't be resolved is remembered.
+#ifndef DNS_NEGATIVE_TTL
+#define DNS_NEGATIVE_TTL 5
+#endif
+/// Most names remembered at once.
+#ifndef DNS_CACHE_LIMIT
+#define DNS_CACHE_LIMIT 4096
+#endif
+/// Names each Resolver looks up at once.
+#ifndef RESOLVER_THREADS
+#define RESOLVER_THREADS 4
+#endif
+
+/// Names resolved lately, shared by every thread.
+///
+/// getaddrinfo() doesn't tell us the records' TTLs, so answers are kept
+/// for DNS_CACHE_TTL seconds, and failures for DNS_NEGATIVE_TTL. Names are
+/// looked up for either family, and whichever getaddrinfo() ranks first is
+/// kept; addresses come back on port 0.
+class DnsCache {
+public:
+    enum class Result {
+        FOUND,
+        FAILED,
+        UNKNOWN,
+    };
+
+private:
+    struct Entry {
+        Endpoint address;
+        bool found;
+        uint64_t expiresMs;
+    };
+
+public:
+    /// What's known about name, setting address if it was found. Address
+    /// literals are always known.
+    static Result lookup(const std::string& name, Endpoint& address) {
+        if (Endpoint::parse(name.c_str(), 0, address)) {
+            return Result::FOUND;
+        }
+        std::lock_guard<std::mutex> lock(mutex());
+        auto it = entries().find(name);
+        if (it == entries().end()) {
+            return Result::UNKNOWN;
+        }
+        if (it->second.expiresMs <= monotonic_ms()) {
+            entries().erase(it);
+            return Result::UNKNOWN;
+        }
+        address = it->second.address;
+        return it->second.found ? Result::FOUND : Result::FAILED;
+    }
+
+    /// Resolve name, from the cache if possible, blocking otherwise.
+    /// Returns false if it can't be.
+    static bool resolve(const std::string& name, Endpoint& address) {
+        Result known = lookup(name, address);
+        if (known != Result::UNKNOWN) {
+            return known == Result::FOUND;
+        }
+        // gethostbyname() isn't safe with several threads.
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM; // Just to have each address once
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct addrinfo* result = nullptr;
+        bool found = getaddrinfo(name.c_str(), nullptr, &hints, &result) == 0 && result != nullptr;
+        if (found) {
+            address = Endpoint::from(result->ai_addr).host();
+        }
+        if (result != nullptr) {
+            freeaddrinfo(result);
+        }
+        store(name, found, address);
+        return found;
+    }
+
+private:
+    static void store(const std::string& name, bool found, const Endpoint& address) {
+        uint64_t now = monotonic_ms();
+        std::lock_guard<std::mutex> lock(mutex());
+        if (entries().size() >= DNS_CACHE_LIMIT) {
+            for (auto it = entries().begin(); it != entries().end(); ) {
+                it = it->second.expiresMs <= now ? entries().erase(it) : std::next(it);
+            }
+            if (entries().size() >= DNS_CACHE_LIMIT) {
+                entries().clear();
+            }
+        }
+        entries()[name] = Entry{address, found, now + (found ? DNS_CACHE_TTL : DNS_NEGATIVE_TTL) * 1000};
+    }
+
+    static std::mutex& mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::unordered_map<std::string, Entry>& entries() {
+        static std::unordered_map<std::string, Entry> entries;
+        return entries;
+    }
+};
+
+/// Resolves names for one event loop without ever blocking it.
+///
+/// Names missing from the DnsCache are looked up by a few background
+/// threads, so that one slow name doesn't hold up the others, and the
+/// answers handed back to the loop through an eventfd, where whoever asked
+/// is called back. Any number of callers can wait for the same name; it's
+/// only looked up once.
+class Resolver : public EventHandler {
+public:
+    typedef std::function<void(bool found, const Endpoint& address)> Callback;
+
+private:
+    struct Waiter {
+        const void* owner;
+        Callback done;
+    };
+
+    struct Answer {
+        std::string name;
+        bool found;
+        Endpoint address;
+    };
+
+    EventLoop& loop;
+    // Loop thread only.
+    /// Names asked of the threads, and not yet answered.
+    std::unordered_set<std::string> inFlight;
+    std::unordered_map<std::string, std::vector<Waiter>> waiting;
+
+    int readyFd;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Guarded by mutex.
+    std::deque<std::string> queries;
+    std::deque<Answer> answered;
+    bool stopping;
+
+public:
+    explicit Resolver(EventLoop& loop):
+        loop(loop),
+        stopping(false)
+    {
+        readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (readyFd < 0) {
+            throw std::runtime_error("could not create eventfd for resolver");
+        }
+        loop.add(readyFd, EPOLLIN, this);
+        for (size_t i = 0; i < RESOLVER_THREADS; i++) {
+            workers.emplace_back([this] {
+                    work();
+                });
+        }
+    }
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    ~Resolver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        loop.remove(readyFd);
+        close(readyFd);
+    }
+
+    /// If name is already known, returns FOUND (setting address) or
+    /// FAILED. Otherwise returns UNKNOWN, and calls done on the loop's
+    /// thread once it is, unless cancel(owner) is called first.
+    DnsCache::Result lookup(const std::string& name, Endpoint& address, const void* owner, Callback done) {
+        DnsCache::Result known = DnsCache::lookup(name, address);
+        if (known != DnsCache::Result::UNKNOWN) {
+            return known;
+        }
+        if (inFlight.insert(name).second) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queries.push_back(name);
+            }
+            wake.notify_one();
+        }
+        waiting[name].push_back(Waiter{owner, done});
+        return DnsCache::Result::UNKNOWN;
+    }
+
+    /// Forget every callback owner is waiting for.
+    void cancel(const void* owner) {
+        for (auto it = waiting.begin(); it != waiting.end(); ) {
+            std::vector<Waiter>& waiters = it->second;
+            for (size_t i = 0; i < waiters.size(); ) {
+                if (waiters[i].owner == owner) {
+                    waiters[i] = std::move(waiters.back());
+                    waiters.pop_back();
+                } else {
+                    i++;
+                }
+            }
+            it = waiters.empty() ? waiting.erase(it) : std::next(it);
+        }
+    }
+
+    /// EventFd says the thread has answers.
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0) {
+            return;
+        }
+        std::deque<Answer> received;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            received.swap(answered);
+        }
+        for (const Answer& answer : received) {
+            inFlight.erase(answer.name);
+            auto it = waiting.find(answer.name);
+            if (it == waiting.end()) {
+                continue;
+            }
+            std::vector<Waiter> waiters;
+            waiters.swap(it->second);
+            waiting.erase(it);
+            for (Waiter& waiter : waiters) {
+                waiter.done(answer.found, answer.address);
+            }
+        }
+    }
+
+private:
+    /// Background threads: look up whatever's asked for.
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] {
+                    return stopping || !queries.empty();
+                });
+            if (stopping) {
+                return;
+            }
+            std::string name = queries.front();
+            queries.pop_front();
+            lock.unlock();
+            Endpoint address;
+            bool found = DnsCache::resolve(name, address);
+            lock.lock();
+            answered.push_back(Answer{name, found, address});
+            uint64_t one = 1;
+            if (write(readyFd, &one, sizeof(one)) < 0) {
+                Log::message(LogLevel::ERROR, "Error: could not signal resolver: ", strerror(errno));
+            }
+        }
+    }
+};
+
+#endif
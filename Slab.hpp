@@ -0,0 +1,94 @@
+#ifndef HGUARD_SLAB
+#define HGUARD_SLAB
+
+#include <cstddef>
+#include <new>
+
+/// Bytes carved up into objects at a time.
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 65536
+#endif
+/// Object sizes are rounded up to a multiple of this.
+#ifndef SLAB_GRANULE
+#define SLAB_GRANULE 64
+#endif
+/// Largest object taken from slabs. Anything bigger goes to the heap.
+#ifndef SLAB_MAX_OBJECT
+#define SLAB_MAX_OBJECT 2048
+#endif
+
+/// Allocator for per-connection objects, which come and go constantly and
+/// in only a handful of sizes.
+///
+/// Each size (rounded up to SLAB_GRANULE) has a free list, refilled a
+/// slab at a time. Freed objects go back on their list rather than to the
+/// heap, and slabs are never given back, so memory stays at its peak but
+/// is dense and quick to reuse. Each thread has its own lists, so there's
+/// no locking; an object freed on another thread just joins that thread's
+/// list.
+class SlabAllocator {
+private:
+    struct FreeObject {
+        FreeObject* next;
+    };
+
+    FreeObject* freeLists[SLAB_MAX_OBJECT / SLAB_GRANULE] = {};
+
+public:
+    static SlabAllocator& local() {
+        thread_local SlabAllocator allocator;
+        return allocator;
+    }
+
+    void* allocate(size_t size) {
+        if (size > SLAB_MAX_OBJECT) {
+            return ::operator new(size);
+        }
+        size_t index = size_class(size);
+        if (freeLists[index] == nullptr) {
+            refill(index);
+        }
+        FreeObject* object = freeLists[index];
+        freeLists[index] = object->next;
+        return object;
+    }
+
+    void deallocate(void* pointer, size_t size) {
+        if (size > SLAB_MAX_OBJECT) {
+            ::operator delete(pointer);
+            return;
+        }
+        size_t index = size_class(size);
+        FreeObject* object = static_cast<FreeObject*>(pointer);
+        object->next = freeLists[index];
+        freeLists[index] = object;
+    }
+
+private:
+    static size_t size_class(size_t size) {
+        return size == 0 ? 0 : (size - 1) / SLAB_GRANULE;
+    }
+
+    void refill(size_t index) {
+        size_t objectSize = (index + 1) * SLAB_GRANULE;
+        char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+        for (size_t offset = 0; offset + objectSize <= SLAB_SIZE; offset += objectSize) {
+            deallocate(slab + offset, objectSize);
+        }
+    }
+};
+
+/// Inherit from this to have objects (of any subclass) allocated from
+/// slabs. Needs a virtual destructor wherever objects are deleted through
+/// a base pointer, so that the right size is given back.
+struct SlabAllocated {
+    static void* operator new(size_t size) {
+        return SlabAllocator::local().allocate(size);
+    }
+
+    static void operator delete(void* pointer, size_t size) {
+        SlabAllocator::local().deallocate(pointer, size);
+    }
+};
+
+#endif
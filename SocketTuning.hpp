@@ -0,0 +1,112 @@
+#ifndef HGUARD_SOCKET_TUNING
+#define HGUARD_SOCKET_TUNING
+
+#include <string>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/// Default TCP Fast Open queue length, for a listener.
+#ifndef TCP_FASTOPEN_QUEUE
+#define TCP_FASTOPEN_QUEUE 256
+#endif
+
+/// Socket options for one side of our tunnels (clients or upstream).
+///
+/// Unset options are left alone. Options are given as NAME or NAME=VALUE:
+///   nodelay:             TCP_NODELAY
+///   quickack:            TCP_QUICKACK (only until the kernel turns delayed
+///                        ACKs back on)
+///   rcvbuf=BYTES:        SO_RCVBUF
+///   sndbuf=BYTES:        SO_SNDBUF
+///   notsent_lowat=BYTES: TCP_NOTSENT_LOWAT
+///   fastopen[=QUEUE]:    TCP Fast Open. On the client side, accept it on
+///                        the listener (with the given queue length). On the
+///                        upstream side, connect with TCP_FASTOPEN_CONNECT
+///                        so that the first thing written goes in the SYN.
+struct SocketTuning {
+    bool nodelay = false;
+    bool quickack = false;
+    int rcvbuf = 0;
+    int sndbuf = 0;
+    int notsentLowat = 0;
+    int fastOpen = 0;
+
+    /// Turn on NAME or NAME=VALUE. Throws if it isn't understood.
+    void set(const std::string& option) {
+        size_t equals = option.find('=');
+        std::string name = option.substr(0, equals);
+        bool hasValue = equals != std::string::npos;
+        int value = 0;
+        if (hasValue) {
+            try {
+                value = std::stoi(option.substr(equals + 1));
+            } catch (const std::exception&) {
+                value = -1;
+            }
+            if (value < 1) {
+                throw std::runtime_error("bad value for socket option " + name);
+            }
+        }
+
+        if (name == "nodelay" && !hasValue) {
+            nodelay = true;
+        } else if (name == "quickack" && !hasValue) {
+            quickack = true;
+        } else if (name == "rcvbuf" && hasValue) {
+            rcvbuf = value;
+        } else if (name == "sndbuf" && hasValue) {
+            sndbuf = value;
+        } else if (name == "notsent_lowat" && hasValue) {
+            notsentLowat = value;
+        } else if (name == "fastopen") {
+            fastOpen = hasValue ? value : TCP_FASTOPEN_QUEUE;
+        } else {
+            throw std::runtime_error("unknown socket option " + option);
+        }
+    }
+
+    /// Apply everything but Fast Open. For buffer sizes to affect window
+    /// scaling, this must happen before connect() or listen().
+    void apply(int fd) const {
+        const int on = 1;
+        if (nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set TCP_NODELAY");
+        }
+        if (quickack && setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set TCP_QUICKACK");
+        }
+        if (rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+            throw std::runtime_error("could not set SO_RCVBUF");
+        }
+        if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+            throw std::runtime_error("could not set SO_SNDBUF");
+        }
+        if (notsentLowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsentLowat, sizeof(notsentLowat)) < 0) {
+            throw std::runtime_error("could not set TCP_NOTSENT_LOWAT");
+        }
+    }
+
+    /// Accept Fast Open on a listener, if wanted. Must be before listen().
+    void apply_listener(int fd) const {
+        apply(fd);
+        if (fastOpen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) < 0) {
+            throw std::runtime_error("could not set TCP_FASTOPEN");
+        }
+    }
+
+    /// Apply to a socket about to connect() to something which expects us
+    /// to speak first. With Fast Open, connect() then returns at once, and
+    /// the SYN waits to carry whatever is written first.
+    void apply_connect(int fd) const {
+        apply(fd);
+        const int on = 1;
+        if (fastOpen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set TCP_FASTOPEN_CONNECT");
+        }
+    }
+};
+
+#endif
@@ -4,30 +4,56 @@
 #include "Util.hpp"
 #include "ProxySettings.hpp"
 #include "TcpProxy.hpp"
+#include "Handshake.hpp"
 
-class Socks4TcpProxy : public TcpProxy {
-public:
-    Socks4TcpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress, int clientSocketFd):
-        Proxy(settings, clientAddress, targetAddress),
-        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
-    {
-    }
-
+/// CONNECT request to a SOCKS4 proxy, or by name to a SOCKS4a one.
+class Socks4Handshake : public Handshake {
 private:
-    void proxy_negotiate(int proxySocketFd) override {
 #pragma pack(push, 1)
-        struct Socks4Packet {
-            uint8_t version;
-            uint8_t command; // or response
-            uint16_t dest_port;
-            uint32_t dest_address;
-        };
+    struct Socks4Packet {
+        uint8_t version;
+        uint8_t command; // or response
+        uint16_t dest_port;
+        uint32_t dest_address;
+    };
 #pragma pack(pop)
 
-        char packet[65536] = {};
-        size_t packetLen = 0;
+    const ProxySettings& settings;
+    Endpoint targetAddress;
+    std::string targetName;
+    bool requested;
+
+public:
+    /// Given a targetName, the proxy is asked for that (on the port of
+    /// targetAddress) instead. SOCKS4 has no room for an IPv6 address, so
+    /// one is asked for by name too, in text. settings must outlive the
+    /// handshake.
+    Socks4Handshake(const ProxySettings& settings, const Endpoint& targetAddress, const std::string& targetName = std::string()):
+        settings(settings),
+        targetAddress(targetAddress),
+        targetName(targetName.empty() && !targetAddress.is_v4() ? targetAddress.host_text() : targetName),
+        requested(false)
+    {
+    }
 
-        Socks4Packet request = {4, 1, targetAddress.sin_port, targetAddress.sin_addr.s_addr};
+protected:
+    void step() override {
+        if (!requested) {
+            request();
+        } else {
+            response();
+        }
+    }
+
+private:
+    void request() {
+        // SOCKS4a: an address of 0.0.0.x (x non-zero) means the name
+        // follows the user ID.
+        uint32_t address = htonl(1);
+        if (targetName.empty()) {
+            std::memcpy(&address, targetAddress.address_bytes(), sizeof(address));
+        }
+        Socks4Packet request = {4, 1, targetAddress.network_port(), address};
 
         const char* userId;
         size_t userIdLen;
@@ -40,20 +66,19 @@ private:
         }
         userIdLen = strlen(userId)+1;
 
-        packetLen = 0;
-        if (build_packet(packet, sizeof(packet), &packetLen, &request, sizeof(request)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, userId, userIdLen) < 0
-            || write_exactly(proxySocketFd, packet, packetLen) < 0
-            )
-        {
-            throw std::runtime_error("write to upstream proxy failed during CONNECT");
+        set_phase("CONNECT");
+        send(&request, sizeof(request));
+        send(userId, userIdLen);
+        if (!targetName.empty()) {
+            send(targetName.c_str(), targetName.length() + 1);
         }
+        requested = true;
+        expect(sizeof(Socks4Packet));
+    }
 
+    void response() {
         Socks4Packet response = {};
-
-        if (read_exactly(proxySocketFd, &response, sizeof(response)) != sizeof(response)) {
-            throw std::runtime_error("read from upstream proxy failed during CONNECT");
-        }
+        std::memcpy(&response, reply(), sizeof(response));
 
         if (response.version != 0) {
             throw std::runtime_error("upstream proxy protocol mismatch");
@@ -64,13 +89,28 @@ private:
             // Success!
             break;
         case 91:
-            throw std::runtime_error("upstream proxy failed to establish connection to endpoint or rejected connection");
+            throw TargetRefused("upstream proxy failed to establish connection to endpoint or rejected connection");
         case 92:
         case 93:
             throw std::runtime_error("upstream proxy identd authentication failure");
         default:
             throw std::runtime_error("upstream proxy protocol mismatch");
         }
+        finish();
+    }
+};
+
+class Socks4TcpProxy : public TcpProxy {
+public:
+    Socks4TcpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, int clientSocketFd):
+        Proxy(settings, clientAddress, targetAddress),
+        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
+    {
+    }
+
+private:
+    std::unique_ptr<Handshake> handshake() override {
+        return std::unique_ptr<Handshake>(new Socks4Handshake(*settings, targetAddress, targetName));
     }
 };
 
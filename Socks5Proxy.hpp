@@ -1,100 +1,226 @@
 #ifndef HGUARD_SOCKS5_PROXY
 #define HGUARD_SOCKS5_PROXY
 
-#include "Proxy.hpp"
+#include <vector>
+#include <atomic>
 
-class Socks5Proxy : public virtual Proxy {
-protected:
-    Socks5Proxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress):
-        Proxy(settings, clientAddress, targetAddress)
+#include "Util.hpp"
+#include "ProxySettings.hpp"
+#include "Handshake.hpp"
+
+/// Greeting, authentication and main request with a SOCKS5 proxy.
+///
+/// Normally each message waits for the reply to the last. Pipelined,
+/// only the one method we want is offered, and the greeting,
+/// authentication and request all go out in a single write, with the
+/// replies parsed in order as they come back. That saves two round trips,
+/// but not every proxy copes, so a pipelined handshake which fails before
+/// the request is answered falls back to the strict sequence.
+///
+/// The greeting and the request can also be done separately, so that
+/// connections can be greeted and authenticated ahead of time and kept
+/// until there's something to request.
+///
+/// SOCKS5 cmd values:
+///   1: CONNECT
+///   2: BIND (not really useful for us)
+///   3: UDP ASSOCIATE
+class Socks5Handshake : public Handshake {
+private:
+#pragma pack(push, 1)
+    struct Socks5AvailableMethodsPacket {
+        uint8_t version;
+        uint8_t method_count;
+    };
+    struct Socks5ChosenMethodPacket {
+        uint8_t version;
+        uint8_t method;
+    };
+    struct Socks5RequestResponsePacket {
+        uint8_t version;
+        uint8_t command;
+        uint8_t reserved;
+        uint8_t address_type; // 1 (IPv4) or 3 (domain) for our purposes.
+    };
+#pragma pack(pop)
+
+    enum class Scope {
+        FULL,
+        GREETING,
+        REQUEST,
+    };
+
+    enum class Stage {
+        GREET,
+        CHOSEN_METHOD,
+        AUTHENTICATED,
+        RESPONSE,
+        BOUND_DOMAIN_LENGTH,
+        BOUND_ADDRESS,
+    };
+
+    const ProxySettings& settings;
+    uint8_t cmd;
+    Endpoint targetAddress;
+    std::string targetName;
+    bool pipelined;
+    bool answered;
+    Scope scope;
+    Stage stage;
+    uint8_t boundAddressType;
+    Endpoint bndAddress;
+    std::string bndDomain;
+
+public:
+    /// targetAddress is the DST.ADDR and DST.PORT of the request, unless
+    /// there's a targetName to give as DST.ADDR instead. settings must
+    /// outlive the handshake.
+    Socks5Handshake(const ProxySettings& settings, uint8_t cmd, const Endpoint& targetAddress, bool pipelined = false,
+                    const std::string& targetName = std::string()):
+        settings(settings),
+        cmd(cmd),
+        targetAddress(targetAddress),
+        targetName(targetName),
+        pipelined(pipelined),
+        answered(false),
+        scope(Scope::FULL),
+        stage(Stage::GREET),
+        boundAddressType(0)
     {
     }
 
-    virtual ~Socks5Proxy() {
+    /// Just the greeting and authentication, leaving the connection ready
+    /// for a request_only().
+    static std::unique_ptr<Handshake> greeting(const ProxySettings& settings) {
+        Socks5Handshake* handshake = new Socks5Handshake(settings, 0, Endpoint());
+        handshake->scope = Scope::GREETING;
+        return std::unique_ptr<Handshake>(handshake);
     }
 
-    void socks5_greet_and_authenticate(int proxySocketFd) {
-        char packet[65536] = {};
-        size_t packetLen = 0;
+    /// Just the request, over a connection which has already had its
+    /// greeting().
+    static std::unique_ptr<Handshake> request_only(const ProxySettings& settings, uint8_t cmd, const Endpoint& targetAddress,
+                                                   const std::string& targetName = std::string()) {
+        Socks5Handshake* handshake = new Socks5Handshake(settings, cmd, targetAddress, false, targetName);
+        handshake->scope = Scope::REQUEST;
+        return std::unique_ptr<Handshake>(handshake);
+    }
 
-#pragma pack(push, 1)
-        struct Socks5AvailableMethodsPacket {
-            uint8_t version;
-            uint8_t method_count;
-        };
-        struct Socks5ChosenMethodPacket {
-            uint8_t version;
-            uint8_t method;
-        };
-#pragma pack(pop)
+    /// BND.ADDR and BND.PORT, once done. If the proxy gave BND.ADDR as a
+    /// domain, it's left for the caller to resolve: only the port is set
+    /// (on 0.0.0.0).
+    const Endpoint& bound_address() const {
+        return bndAddress;
+    }
+
+    /// BND.ADDR, if the proxy gave it as a domain.
+    const std::string& bound_domain() const {
+        return bndDomain;
+    }
+
+    /// Set once a proxy has choked on a pipelined handshake, so that later
+    /// connections don't bother.
+    static std::atomic<bool>& pipelining_rejected() {
+        static std::atomic<bool> rejected(false);
+        return rejected;
+    }
 
+    std::unique_ptr<Handshake> fallback() override {
+        if (!pipelined || answered) {
+            // A real answer to the request.
+            return nullptr;
+        }
+        pipelining_rejected() = true;
+        std::unique_ptr<Handshake> strict(new Socks5Handshake(settings, cmd, targetAddress, false, targetName));
+        strict->set_early_data(early_data());
+        return strict;
+    }
+
+protected:
+    void step() override {
+        switch (stage) {
+        case Stage::GREET:
+            greet();
+            break;
+        case Stage::CHOSEN_METHOD:
+            chosen_method();
+            break;
+        case Stage::AUTHENTICATED:
+            authenticated();
+            break;
+        case Stage::RESPONSE:
+            response();
+            break;
+        case Stage::BOUND_DOMAIN_LENGTH:
+            {
+                uint8_t len = reply()[0];
+                if (len == 0) {
+                    throw std::runtime_error("upstream proxy sent zero-length domain");
+                }
+                stage = Stage::BOUND_ADDRESS;
+                expect(len + 2);
+            }
+            break;
+        case Stage::BOUND_ADDRESS:
+            bound_address_received();
+            break;
+        }
+    }
+
+private:
+    void greet() {
+        if (scope == Scope::REQUEST) {
+            request();
+            return;
+        }
         std::vector<uint8_t> methods;
-        methods.emplace_back(0x00);
+        if (!pipelined || settings.username.empty()) {
+            methods.emplace_back(0x00);
+        }
         if (!settings.username.empty()) {
             methods.emplace_back(0x02);
         }
 
         Socks5AvailableMethodsPacket request = {5, uint8_t(methods.size())};
-
-        packetLen = 0;
-        if (build_packet(packet, sizeof(packet), &packetLen, &request, sizeof(request)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, methods.data(), sizeof(uint8_t) * methods.size()) < 0
-            || write_exactly(proxySocketFd, packet, packetLen) < 0
-            )
-        {
-            throw std::runtime_error("write to upstream proxy failed during auth negotiation");
+        set_phase("auth negotiation");
+        send(&request, sizeof(request));
+        send(methods.data(), sizeof(uint8_t) * methods.size());
+        if (pipelined) {
+            if (!settings.username.empty()) {
+                send_credentials();
+            }
+            send_request();
         }
+        stage = Stage::CHOSEN_METHOD;
+        expect(sizeof(Socks5ChosenMethodPacket));
+    }
 
+    void chosen_method() {
         Socks5ChosenMethodPacket response = {};
-
-        if (read_exactly(proxySocketFd, &response, sizeof(response)) != sizeof(response)) {
-            throw std::runtime_error("read from upstream proxy failed during auth negotiation");
-        }
+        std::memcpy(&response, reply(), sizeof(response));
 
         if (response.version != 5) {
             throw std::runtime_error("upstream proxy protocol mismatch");
         }
         switch (response.method) {
         case 0x00:
+            if (pipelined && !settings.username.empty()) {
+                // Too late: the credentials have gone out as the request.
+                throw std::runtime_error("upstream proxy selected no authentication where username and password authentication was offered");
+            }
+            greeted();
             break;
         case 0x02:
             if (settings.username.empty()) {
                 // Protocol mismatch?
                 throw std::runtime_error("upstream proxy selected username and password authentication where no authentication was expected");
             }
-            {
-                uint8_t version = 1;
-                // Lengths already checked in ProxySettings
-                uint8_t usernameLen = settings.username.length();
-                const char* username = settings.username.c_str();
-                uint8_t passwordLen = settings.password.length();
-                const char* password = settings.password.c_str();
-
-                packetLen = 0;
-                if (build_packet(packet, sizeof(packet), &packetLen, &version, sizeof(version)) < 0
-                    || build_packet(packet, sizeof(packet), &packetLen, &usernameLen, sizeof(usernameLen)) < 0
-                    || build_packet(packet, sizeof(packet), &packetLen, username, usernameLen) < 0
-                    || build_packet(packet, sizeof(packet), &packetLen, &passwordLen, sizeof(passwordLen)) < 0
-                    || build_packet(packet, sizeof(packet), &packetLen, password, passwordLen) < 0
-                    || write_exactly(proxySocketFd, packet, packetLen) < 0
-                    )
-                {
-                    throw std::runtime_error("write to upstream proxy failed during authentication");
-                }
-                if (read_exactly(proxySocketFd, &version, sizeof(version)) != sizeof(version)) {
-                    throw std::runtime_error("read from upstream proxy failed during authentication");
-                }
-                if (version != 1) {
-                    throw std::runtime_error("upstream proxy protocol mismatch");
-                }
-                uint8_t status = 0;
-                if (read_exactly(proxySocketFd, &status, sizeof(status)) != sizeof(status)) {
-                    throw std::runtime_error("read from upstream proxy failed during authentication");
-                }
-                if (status != 0) {
-                    throw std::runtime_error("upstream proxy authentication failure");
-                }
+            set_phase("authentication");
+            if (!pipelined) {
+                send_credentials();
             }
+            stage = Stage::AUTHENTICATED;
+            expect(2);
             break;
         case 0xff:
             throw std::runtime_error("upstream proxy no authentication method");
@@ -103,43 +229,72 @@ protected:
         }
     }
 
-    /// Perform the main request, asking to put us through to the target machine.
-    ///
-    /// SOCKS5 cmd values:
-    ///   1: CONNECT
-    ///   2: BIND (not really useful for us)
-    ///   3: UDP ASSOCIATE
-    ///
-    /// returns the BND.ADDR and BND.PORT as a struct sockaddr_in.
-    struct sockaddr_in socks5_request_tunnel(int proxySocketFd, uint8_t cmd) {
-        char packet[65536] = {};
-        size_t packetLen = 0;
-
-#pragma pack(push, 1)
-        struct Socks5RequestResponsePacket {
-            uint8_t version;
-            uint8_t command;
-            uint8_t reserved;
-            uint8_t address_type; // Must be 1 for our purposes.
-        };
-#pragma pack(pop)
-        Socks5RequestResponsePacket request = {5, cmd, 0, 1};
+    void authenticated() {
+        uint8_t version = reply()[0];
+        uint8_t status = reply()[1];
+        if (version != 1) {
+            throw std::runtime_error("upstream proxy protocol mismatch");
+        }
+        if (status != 0) {
+            throw std::runtime_error("upstream proxy authentication failure");
+        }
+        greeted();
+    }
 
-        packetLen = 0;
-        if (build_packet(packet, sizeof(packet), &packetLen, &request, sizeof(request)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, &targetAddress.sin_addr.s_addr, sizeof(targetAddress.sin_addr.s_addr)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, &targetAddress.sin_port, sizeof(targetAddress.sin_port)) < 0
-            || write_exactly(proxySocketFd, packet, packetLen) < 0
-            )
-        {
-            throw std::runtime_error("write to upstream proxy failed during main request");
+    void greeted() {
+        if (scope == Scope::GREETING) {
+            finish();
+        } else {
+            request();
         }
+    }
 
-        Socks5RequestResponsePacket response = {};
+    void send_credentials() {
+        uint8_t version = 1;
+        // Lengths already checked in ProxySettings
+        uint8_t usernameLen = settings.username.length();
+        uint8_t passwordLen = settings.password.length();
+
+        send(&version, sizeof(version));
+        send(&usernameLen, sizeof(usernameLen));
+        send(settings.username.c_str(), usernameLen);
+        send(&passwordLen, sizeof(passwordLen));
+        send(settings.password.c_str(), passwordLen);
+    }
+
+    /// The main request, asking to put us through to the target machine.
+    /// The proxy won't read anything after it until it has connected, so
+    /// the client's early data can follow straight away.
+    void send_request() {
+        uint8_t addressType = !targetName.empty() ? 3 : targetAddress.is_v4() ? 1 : 4;
+        Socks5RequestResponsePacket request = {5, cmd, 0, addressType};
+        send(&request, sizeof(request));
+        if (targetName.empty()) {
+            send(targetAddress.address_bytes(), targetAddress.address_length());
+        } else {
+            // At most 255, as checked by TargetName.
+            uint8_t nameLength = targetName.length();
+            send(&nameLength, sizeof(nameLength));
+            send(targetName.c_str(), nameLength);
+        }
+        uint16_t port = targetAddress.network_port();
+        send(&port, sizeof(port));
+        send_early_data();
+    }
 
-        if (read_exactly(proxySocketFd, &response, sizeof(response)) != sizeof(response)) {
-            throw std::runtime_error("read from upstream proxy failed during main request");
+    void request() {
+        set_phase("main request");
+        if (!pipelined) {
+            send_request();
         }
+        stage = Stage::RESPONSE;
+        expect(sizeof(Socks5RequestResponsePacket));
+    }
+
+    void response() {
+        answered = true;
+        Socks5RequestResponsePacket response = {};
+        std::memcpy(&response, reply(), sizeof(response));
 
         if (response.version != 5) {
             throw std::runtime_error("upstream proxy protocol mismatch");
@@ -152,59 +307,43 @@ protected:
         case 1:
             throw std::runtime_error("upstream proxy experienced a general SOCKS server failure");
         case 2:
-            throw std::runtime_error("upstream proxy rejected connection not allowed by ruleset");
+            throw TargetRefused("upstream proxy rejected connection not allowed by ruleset");
         default:
-            throw std::runtime_error("upstream proxy failed to establish connection to endpoint or rejected connection");
+            throw TargetRefused("upstream proxy failed to establish connection to endpoint or rejected connection");
         }
 
-        struct sockaddr_in bndAddress = {};
-        bndAddress.sin_family = AF_INET;
-        char addressData[256] = {};
-
-        switch (response.address_type) {
+        boundAddressType = response.address_type;
+        switch (boundAddressType) {
         case 1:
-            if (read_exactly(proxySocketFd, &addressData, 4) != sizeof(response)) {
-                throw std::runtime_error("read from upstream proxy failed during CONNECT");
-            }
-            bndAddress.sin_addr.s_addr = *((uint32_t*)addressData); // Preserve network byte order.
+            stage = Stage::BOUND_ADDRESS;
+            expect(4 + 2);
             break;
         case 3:
-            {
-                uint8_t len;
-                if (read_exactly(proxySocketFd, &len, sizeof(len)) != sizeof(len)) {
-                    throw std::runtime_error("read from upstream proxy failed during main request");
-                }
-                if (len == 0) {
-                    throw std::runtime_error("upstream proxy sent zero-length domain");
-                }
-                if (read_exactly(proxySocketFd, &addressData, len) != len) {
-                    throw std::runtime_error("read from upstream proxy failed during request");
-                }
-                addressData[len] = 0; // null terminate
-                struct hostent *server = gethostbyname(addressData); // replace with getaddrinfo() later
-                if (server == nullptr) {
-                    throw std::runtime_error("cannot resolve address returned by upstream proxy");
-                }
-                if (server->h_addrtype != AF_INET) {
-                    throw std::runtime_error("FIXME: Resolved to IPv6 address. Use getaddrinfo() instead.");
-                }
-                std::memcpy(&bndAddress.sin_addr.s_addr, (char*)server->h_addr, server->h_length);
-            }
+            stage = Stage::BOUND_DOMAIN_LENGTH;
+            expect(1);
             break;
         case 4:
-            if (read_exactly(proxySocketFd, &addressData, 16) != 16) {
-                throw std::runtime_error("read from upstream proxy failed during main request");
-            }
-            throw std::runtime_error("upstream proxy returned IPv6 address (unsupported)");
-            // break;
+            stage = Stage::BOUND_ADDRESS;
+            expect(16 + 2);
+            break;
         default:
             throw std::runtime_error("upstream proxy protocol mismatch");
         }
+    }
 
-        if (read_exactly(proxySocketFd, &bndAddress.sin_port, 2) != 2) {
-            throw std::runtime_error("read from upstream proxy failed during main request");
+    void bound_address_received() {
+        const char* address = reply();
+        size_t addressLen = reply_length() - 2;
+        uint16_t port;
+        std::memcpy(&port, address + addressLen, 2); // Preserve network byte order.
+        if (boundAddressType == 3) {
+            // Resolving it here would block. Only UDP ASSOCIATE needs it.
+            bndDomain.assign(address, addressLen);
+            bndAddress = Endpoint::unspecified(AF_INET).with_port(ntohs(port));
+        } else {
+            bndAddress = Endpoint(address, addressLen, port);
         }
-        return bndAddress;
+        finish();
     }
 };
 
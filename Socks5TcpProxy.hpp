@@ -6,19 +6,22 @@
 #include "TcpProxy.hpp"
 #include "Socks5Proxy.hpp"
 
-class Socks5TcpProxy : public TcpProxy, public Socks5Proxy {
+class Socks5TcpProxy : public TcpProxy {
 public:
-    Socks5TcpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress, int clientSocketFd):
+    Socks5TcpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, int clientSocketFd):
         Proxy(settings, clientAddress, targetAddress),
-        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd),
-        Socks5Proxy(settings, clientAddress, targetAddress)
+        TcpProxy(settings, clientAddress, targetAddress, clientSocketFd)
     {
     }
 
 private:
-    void proxy_negotiate(int proxySocketFd) override {
-        socks5_greet_and_authenticate(proxySocketFd);
-        socks5_request_tunnel(proxySocketFd, 1 /*CONNECT*/);
+    std::unique_ptr<Handshake> handshake() override {
+        bool pipelined = settings->socks5Pipelining && !Socks5Handshake::pipelining_rejected();
+        return std::unique_ptr<Handshake>(new Socks5Handshake(*settings, 1 /*CONNECT*/, targetAddress, pipelined, targetName));
+    }
+
+    std::unique_ptr<Handshake> pooled_handshake() override {
+        return Socks5Handshake::request_only(*settings, 1 /*CONNECT*/, targetAddress, targetName);
     }
 };
 
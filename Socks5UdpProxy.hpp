@@ -1,178 +1,385 @@
 #ifndef HGUARD_SOCKS5_UDP_PROXY
 #define HGUARD_SOCKS5_UDP_PROXY
 
+#include "Metrics.hpp"
 #include "Util.hpp"
 #include "ProxySettings.hpp"
 #include "UdpProxy.hpp"
-#include "Socks5Proxy.hpp"
+#include "Socks5UdpSession.hpp"
 
-#define MAXIMUM_IPV4_UDP_PAYLOAD 65507
+#include <algorithm>
+#include <string>
+#include <vector>
 
-class Socks5UdpProxy : public UdpProxy, public Socks5Proxy {
+#include <netinet/udp.h>
+
+
+/// Datagrams queued per association before the queue is flushed anyway.
+#ifndef UDP_SEND_QUEUE
+#define UDP_SEND_QUEUE 64
+#endif
+/// Most segments the kernel will take in one UDP_SEGMENT send.
+#define UDP_GSO_MAX_SEGMENTS 64
+/// Most datagrams an association holds on to while it waits for a
+/// session.
+#ifndef SOCKS5_UDP_PARKED_DATAGRAMS
+#define SOCKS5_UDP_PARKED_DATAGRAMS 16
+#endif
+
+class Socks5UdpProxy final : public UdpProxy {
 private:
-    int proxySocketFd;
-    Cleaner proxySocketFdCleaner;
-    struct sockaddr_in relayAddress;
-    int relaySocketFd;
-    Cleaner relaySocketFdCleaner;
+    Socks5UdpSessionPool& sessions;
+    /// Shared with any other associations (for other targets) it carries.
+    /// Null while waiting for one.
+    Socks5UdpSession* session;
+    /// Copies of what came while waiting for a session.
+    std::vector<std::string> parkedDatagrams;
+
+    /// RSV, FRAG (none), ATYP (IPv4 or IPv6), DST.ADDR, DST.PORT: the
+    /// same for every datagram to or from the target, so built once.
+    char header[SOCKS5_UDP_IPV6_HEADER_LENGTH];
+    size_t headerLength;
+
+    /// Datagram waiting for flush(). The payload is not copied, so it
+    /// must stay valid until then.
+    struct QueuedDatagram {
+        const char* payload;
+        size_t len;
+    };
+    std::vector<QueuedDatagram> egressQueue;
+    // Scratch space for flush(), kept around to avoid reallocating.
+    std::vector<struct iovec> egressIovs;
+    std::vector<struct mmsghdr> egressMessages;
+    std::vector<char> egressControl;
 
 public:
-    Socks5UdpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress):
-        Proxy(settings, clientAddress, targetAddress),
+    typedef Socks5UdpSessionPool Context;
+
+    static Context* make_context(const ProxySettings::Shared& settings, EventLoop& loop, std::function<void(Socks5UdpProxy*)> lose) {
+        return new Socks5UdpSessionPool(settings, loop, settings->udpSessionPool, lose);
+    }
+
+    Socks5UdpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, Context& sessions):
         UdpProxy(settings, clientAddress, targetAddress),
-        Socks5Proxy(settings, clientAddress, targetAddress)
+        sessions(sessions)
     {
-        // Establish connection to proxy. This is just left alone
-        // after negotiation, which may be a bad way to do things. We
-        // don't bother with TCP keepalives.
-        proxySocketFd = socket(AF_INET, SOCK_STREAM, 0);
-        proxySocketFdCleaner = Cleaner([this] {
-                close(this->proxySocketFd);
-            });
-
-        if (connect(proxySocketFd, (struct sockaddr*)&settings.proxyAddress, sizeof(settings.proxyAddress)) < 0) {
-            throw std::runtime_error("could not connect to upstream proxy");
-        }
+        header[0] = 0;
+        header[1] = 0;
+        header[2] = 0;
+        header[3] = targetAddress.is_v4() ? 1 : 4;
+        size_t addressLength = targetAddress.address_length();
+        uint16_t port = targetAddress.network_port();
+        std::memcpy(header + 4, targetAddress.address_bytes(), addressLength);
+        std::memcpy(header + 4 + addressLength, &port, sizeof(port));
+        headerLength = 4 + addressLength + sizeof(port);
 
-        socks5_greet_and_authenticate(proxySocketFd);
-        relayAddress = socks5_request_tunnel(proxySocketFd, 3 /*UDP ASSOCIATE*/);
+        egressQueue.reserve(UDP_SEND_QUEUE);
+        egressIovs.reserve(2 * UDP_SEND_QUEUE);
+        egressMessages.reserve(UDP_SEND_QUEUE);
+        egressControl.resize(UDP_SEND_QUEUE * CMSG_SPACE(sizeof(uint16_t)));
 
-        // Establish connection to relay server
-        relaySocketFd = socket(AF_INET, SOCK_DGRAM, 0);
-        relaySocketFdCleaner = Cleaner([this] {
-                close(this->relaySocketFd);
-            });
+        session = sessions.acquire(targetAddress, this);
+    }
 
-        if (connect(relaySocketFd, (struct sockaddr*)&relayAddress, sizeof(relayAddress)) < 0) {
-            throw std::runtime_error("could not connect to udp relay server");
+    ~Socks5UdpProxy() {
+        if (session != nullptr) {
+            session->detach(targetAddress);
+        } else {
+            sessions.unpark(this);
         }
     }
 
-    std::vector<int> get_incoming_sockets() override {
-        return std::vector<int>{relaySocketFd};
+    /// The pool has a session for us at last. Sends what came meanwhile.
+    void carry_on(Socks5UdpSession* session) {
+        this->session = session;
+        std::vector<std::string> datagrams;
+        datagrams.swap(parkedDatagrams);
+        for (const std::string& datagram : datagrams) {
+            send_to_target(datagram.data(), datagram.size());
+        }
+        flush();
     }
 
-    void check_socket(int fd) override {
-        if (fd != relaySocketFd) {
-            throw std::runtime_error("checking incorrect socket");
-        }
+    /// Replies arrive through the session, which watches its own socket.
+    void add_to(EventLoop& loop) {
+        (void)loop;
+    }
+
+    void remove_from(EventLoop& loop) {
+        (void)loop;
+    }
 
-        struct sockaddr_in fromAddress;
-        socklen_t fromAddressLen = sizeof(struct sockaddr_in);
-        char buffer[65536] = {};
-        char* readPtr = buffer;
-        ssize_t recvLen = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&fromAddress, &fromAddressLen);
-        char* endPtr = buffer + recvLen;
+    /// The session got a datagram for us.
+    void receive_from_relay(char* buffer, size_t len) {
+        static thread_local LogSampler receives;
+        log_datagram(LogLevel::DEBUG, receives, "RECEIVE DOWN DGRAM   ", " <- ");
+        send_to_client(buffer, len);
+    }
 
-        if (std::memcmp(&fromAddress, &relayAddress, sizeof(struct sockaddr_in)) != 0) {
-            std::cerr << "received non-proxy packet on upstream port" << std::endl;
+    void send_to_target(const char* buffer, size_t len) {
+        if (session == nullptr) {
+            if (parkedDatagrams.size() >= SOCKS5_UDP_PARKED_DATAGRAMS) {
+                Metrics::count(Metric::UDP_DROPS);
+                static thread_local LogSampler waits;
+                log_datagram(LogLevel::WARN, waits, "(DROP)  UP   DGRAM   ", " x> ");
+                return;
+            }
+            parkedDatagrams.emplace_back(buffer, len);
             return;
         }
-
-        std::cerr << "\t" << "RECEIVE DOWN DGRAM   " << clientHost << ":" << clientPort << " <- " << targetHost << ":" << targetPort << std::endl;
-
-        if (recvLen < 4) {
-            throw std::runtime_error("SOCKS UDP packet too small");
+        if (len > session->max_datagram() - headerLength) {
+            // I would have probably supported fragmentation, but I
+            // couldn't find any suitable SOCKS5 servers to use as a
+            // test platform.
+            //
+            // This also raises the question of whether fragmentation
+            // is even useful if no one seems to implement it anyway!
+            Metrics::count(Metric::UDP_DROPS);
+            static thread_local LogSampler drops;
+            log_datagram(LogLevel::WARN, drops, "(DROP)  UP   DGRAM   ", " x> ");
+            return;
+        }
+        if (egressQueue.size() == UDP_SEND_QUEUE) {
+            flush();
         }
 
-        readPtr += 2; // Reserved bytes
+        egressQueue.push_back(QueuedDatagram{buffer, len});
+    }
 
-        if (*((uint8_t*)readPtr) != 0) {
-            std::cerr << "\t" << "(DROP)  DOWN DGRAM   " << clientHost << ":" << clientPort << " <x " << targetHost << ":" << targetPort << std::endl;
+    /// Send everything queued by send_to_target() to the relay in one
+    /// sendmmsg(), or more if some fail. Runs of equally sized datagrams
+    /// are handed to the kernel as a single UDP_SEGMENT (GSO) send where
+    /// supported.
+    void flush() {
+        if (egressQueue.empty()) {
             return;
         }
-        readPtr += 1;
-
-        uint8_t addressType = *((uint8_t*)readPtr);
-        readPtr += 1;
+        egressIovs.clear();
+        egressMessages.clear();
+        size_t n = egressQueue.size();
+        size_t i = 0;
+        size_t maxDatagram = session->max_datagram();
+        while (i < n) {
+            size_t segmentLen = headerLength + egressQueue[i].len;
+            size_t totalLen = segmentLen;
+            size_t j = i + 1;
+            // Every segment but the last must be exactly segmentLen.
+            while (session->use_gso() && j < n && j - i < UDP_GSO_MAX_SEGMENTS
+                   && egressQueue[j].len <= egressQueue[i].len
+                   && totalLen + headerLength + egressQueue[j].len <= maxDatagram) {
+                totalLen += headerLength + egressQueue[j].len;
+                j++;
+                if (egressQueue[j - 1].len < egressQueue[i].len) {
+                    break;
+                }
+            }
 
-        struct sockaddr_in dstAddress = {};
-        dstAddress.sin_family = AF_INET;
+            struct mmsghdr message = {};
+            message.msg_hdr.msg_iov = egressIovs.data() + egressIovs.size();
+            message.msg_hdr.msg_iovlen = 2 * (j - i);
+            for (size_t k = i; k < j; k++) {
+                egressIovs.push_back({header, headerLength});
+                egressIovs.push_back({(void*)egressQueue[k].payload, egressQueue[k].len});
+            }
+            if (j - i > 1) {
+                char* control = &egressControl[egressMessages.size() * CMSG_SPACE(sizeof(uint16_t))];
+                message.msg_hdr.msg_control = control;
+                message.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gsoSize = segmentLen;
+                std::memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+            }
+            egressMessages.push_back(message);
+            i = j;
+        }
 
-        switch (addressType) {
-        case 1:
-            {
-                if (readPtr + 4 > endPtr) {
-                    throw std::runtime_error("SOCKS UDP packet too small for address");
-                }
-                dstAddress.sin_addr.s_addr = *((uint32_t*)readPtr); // Preserve network byte order.
-                readPtr += 4;
-                break;
+        static thread_local LogSampler sends;
+        static thread_local LogSampler failures;
+        // sendmmsg() stops at the first message which fails, and only
+        // reports why when called again from there.
+        size_t m = 0;
+        size_t handled = 0;
+        while (m < egressMessages.size()) {
+            int sent = sendmmsg(session->relay_fd(), egressMessages.data() + m, egressMessages.size() - m, 0);
+            if (sent < 0 && errno == EINTR) {
+                continue;
             }
-        case 3:
-            {
-                if (readPtr + 1 > endPtr) {
-                    throw std::runtime_error("SOCKS UDP packet too small for address");
-                }
-                uint8_t len = *((uint8_t*)readPtr);
-                readPtr += 1;
-                if (len == 0) {
-                    throw std::runtime_error("upstream proxy sent zero-length domain");
-                }
-                if (readPtr + len > endPtr) {
-                    throw std::runtime_error("SOCKS UDP packet too small for address");
-                }
-                char addressData[256] = {};
-                std::memcpy(addressData, readPtr, len);
-                readPtr += len;
-                addressData[len] = 0; // null terminate
-                struct hostent *server = gethostbyname(addressData); // replace with getaddrinfo() later
-                if (server == nullptr) {
-                    throw std::runtime_error("cannot resolve address returned by upstream proxy");
-                }
-                if (server->h_addrtype != AF_INET) {
-                    throw std::runtime_error("FIXME: Resolved to IPv6 address. Use getaddrinfo() instead.");
+            if (sent < 0 && session->use_gso() && (errno == EIO || errno == EINVAL)) {
+                // No GSO on this path after all. Try the rest again
+                // without it.
+                egressQueue.erase(egressQueue.begin(), egressQueue.begin() + handled);
+                session->disable_gso();
+                flush();
+                return;
+            }
+            size_t count = sent < 0 ? 1 : sent;
+            for (size_t end = m + count; m < end; m++) {
+                size_t datagrams = egressMessages[m].msg_hdr.msg_iovlen / 2;
+                for (size_t k = 0; k < datagrams; k++) {
+                    if (sent < 0) {
+                        Metrics::count(Metric::UDP_DROPS);
+                        log_datagram(LogLevel::WARN, failures, "FAILED SEND DGRAM   ", " -> ");
+                    } else {
+                        log_datagram(LogLevel::DEBUG, sends, "SEND    UP   DGRAM   ", " -> ");
+                    }
                 }
-                std::memcpy(&dstAddress.sin_addr.s_addr, (char*)server->h_addr, server->h_length);
+                handled += datagrams;
             }
-            break;
-        case 4:
-            throw std::runtime_error("upstream proxy returned IPv6 address (unsupported)");
-        default:
-            throw std::runtime_error("upstream proxy protocol mismatch");
         }
-        dstAddress.sin_port = *((uint16_t*)readPtr);
-        readPtr += 2;
-
-        if (std::memcmp(&dstAddress, &targetAddress, sizeof(struct sockaddr_in)) != 0) {
-            char dstHostCStr[256] = {};
-            inet_ntop(AF_INET, &dstAddress.sin_addr, dstHostCStr, sizeof(dstHostCStr));
-            std::string dstHost = std::string(dstHostCStr);
-            int dstPort = ntohs(dstAddress.sin_port);
-            std::cerr << "SOCKS returned UDP packet from unexpected address and port: " << dstHost << ":" << dstPort << std::endl;
-            return;
+        egressQueue.clear();
+    }
+};
+
+
+void Socks5UdpSessionPool::carry_parked() {
+    std::vector<Parked> waiting;
+    waiting.swap(parked);
+    for (const Parked& entry : waiting) {
+        Socks5UdpSession* session = carrier(entry.targetAddress);
+        if (session == nullptr) {
+            parked.push_back(entry);
+            continue;
         }
+        forget_parked(entry.targetAddress);
+        session->attach(entry.targetAddress, entry.proxy);
+        entry.proxy->carry_on(session);
+    }
 
-        send_to_client(readPtr, endPtr - readPtr);
+    size_t most = 0;
+    parkedTargets.for_each([&most](const Endpoint&, size_t count) {
+            most = std::max(most, count);
+        });
+    size_t needed = std::max(most, (parked.size() + SOCKS5_UDP_SESSION_TARGETS - 1) / SOCKS5_UDP_SESSION_TARGETS);
+    if (needed > pending) {
+        request(needed - pending);
     }
+}
 
-    void send_to_target(const char* buffer, size_t len) override {
-        char packet[65536];
-        size_t packetLen;
-        if (len > MAXIMUM_IPV4_UDP_PAYLOAD) {
-            // I would have probably supported fragmentation, but I
-            // couldn't find any suitable SOCKS5 servers to use as a
-            // test platform.
-            //
-            // This also raises the question of whether fragmentation
-            // is even useful if no one seems to implement it anyway!
-            std::cerr << "\t" << "(DROP)  UP   DGRAM   " << clientHost << ":" << clientPort << " x> " << targetHost << ":" << targetPort << std::endl;
+void Socks5UdpSession::receive() {
+    // The socket is connected to the relay, so nothing else gets through.
+    char buffer[65536];
+    ssize_t recvLen = recv(relaySocketFd, buffer, sizeof(buffer), 0);
+    if (recvLen < 0) {
+        return;
+    }
+
+    dispatch(buffer, recvLen);
+}
+
+void Socks5UdpSession::dispatch(char* buffer, size_t recvLen) {
+    // Nearly every datagram comes from an IP address, unfragmented, so
+    // its header is exactly the one its association sends with. Those
+    // need only a compare or two, and a lookup of the address and port as
+    // they are.
+    static const char ipv4Prefix[4] = {0, 0, 0, 1};
+    static const char ipv6Prefix[4] = {0, 0, 0, 4};
+    size_t headerLength = 0;
+    if (recvLen >= SOCKS5_UDP_IPV4_HEADER_LENGTH && std::memcmp(buffer, ipv4Prefix, sizeof(ipv4Prefix)) == 0) {
+        headerLength = SOCKS5_UDP_IPV4_HEADER_LENGTH;
+    } else if (recvLen >= SOCKS5_UDP_IPV6_HEADER_LENGTH && std::memcmp(buffer, ipv6Prefix, sizeof(ipv6Prefix)) == 0) {
+        headerLength = SOCKS5_UDP_IPV6_HEADER_LENGTH;
+    }
+    if (headerLength != 0) {
+        uint16_t port;
+        std::memcpy(&port, buffer + headerLength - sizeof(port), sizeof(port));
+        User* user = users.find(Endpoint(buffer + 4, headerLength - 4 - sizeof(port), port));
+        if (user != nullptr && user->proxy != nullptr) {
+            user->proxy->receive_from_relay(buffer + headerLength, recvLen - headerLength);
             return;
         }
-        packetLen = 0;
-        if (build_packet(packet, sizeof(packet), &packetLen, "\x00\x00", sizeof(uint16_t)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, "\x00", sizeof(uint8_t)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, "\x01", sizeof(uint8_t)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, &targetAddress.sin_addr.s_addr, sizeof(uint32_t)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, &targetAddress.sin_port, sizeof(uint16_t)) < 0
-            || build_packet(packet, sizeof(packet), &packetLen, buffer, len) < 0
-            || sendto(relaySocketFd, packet, packetLen, 0, (struct sockaddr*)&relayAddress, sizeof(relayAddress)) != ssize_t(packetLen)
-            ) {
-            throw std::runtime_error("Could not build and send packet to relay server");
+        // Dropped, with the reason, below.
+    }
+
+    char* readPtr = buffer;
+    char* endPtr = buffer + recvLen;
+
+    if (recvLen < 4) {
+        throw std::runtime_error("SOCKS UDP packet too small");
+    }
+
+    readPtr += 2; // Reserved bytes
+
+    if (*((uint8_t*)readPtr) != 0) {
+        Metrics::count(Metric::UDP_DROPS);
+        static thread_local LogSampler fragments;
+        if (Log::sampled(LogLevel::WARN, fragments)) {
+            Log::message(LogLevel::WARN, "\t", "(DROP)  DOWN DGRAM   fragment");
+        }
+        return;
+    }
+    readPtr += 1;
+
+    uint8_t addressType = *((uint8_t*)readPtr);
+    readPtr += 1;
+
+    const char* addressBytes = readPtr;
+    size_t addressLength = 0;
+    Endpoint resolved;
+
+    switch (addressType) {
+    case 1:
+    case 4:
+        {
+            addressLength = addressType == 1 ? 4 : 16;
+            if (readPtr + addressLength > endPtr) {
+                throw std::runtime_error("SOCKS UDP packet too small for address");
+            }
+            readPtr += addressLength;
+            break;
         }
+    case 3:
+        {
+            if (readPtr + 1 > endPtr) {
+                throw std::runtime_error("SOCKS UDP packet too small for address");
+            }
+            uint8_t len = *((uint8_t*)readPtr);
+            readPtr += 1;
+            if (len == 0) {
+                throw std::runtime_error("upstream proxy sent zero-length domain");
+            }
+            if (readPtr + len > endPtr) {
+                throw std::runtime_error("SOCKS UDP packet too small for address");
+            }
+            std::string domain(readPtr, len);
+            readPtr += len;
+            if (!resolve_source(domain, buffer, recvLen, resolved)) {
+                return;
+            }
+        }
+        break;
+    default:
+        throw std::runtime_error("upstream proxy protocol mismatch");
+    }
+    if (readPtr + 2 > endPtr) {
+        throw std::runtime_error("SOCKS UDP packet too small for address");
+    }
+    uint16_t port;
+    std::memcpy(&port, readPtr, sizeof(port)); // Preserve network byte order.
+    readPtr += 2;
+    Endpoint dstAddress = addressType == 3 ? resolved.with_port(ntohs(port)) : Endpoint(addressBytes, addressLength, port);
 
-        std::cerr << "\t" << "SEND    UP   DGRAM   " << clientHost << ":" << clientPort << " -> " << targetHost << ":" << targetPort << std::endl;
+    User* user = users.find(dstAddress);
+    if (user != nullptr && user->proxy == nullptr) {
+        Metrics::count(Metric::UDP_DROPS);
+        static thread_local LogSampler released;
+        if (Log::sampled(LogLevel::DEBUG, released)) {
+            Log::message(LogLevel::DEBUG, "\t", "(DROP)  DOWN DGRAM   for released association");
+        }
+        return;
     }
-};
+    if (user == nullptr) {
+        Metrics::count(Metric::UDP_DROPS);
+        static thread_local LogSampler strangers;
+        if (Log::sampled(LogLevel::WARN, strangers)) {
+            Log::message(LogLevel::WARN, "SOCKS returned UDP packet from unexpected address and port: ", dstAddress.to_string());
+        }
+        return;
+    }
+
+    user->proxy->receive_from_relay(readPtr, endPtr - readPtr);
+}
 
 #endif
@@ -0,0 +1,627 @@
+#ifndef HGUARD_SOCKS5_UDP_SESSION
+#define HGUARD_SOCKS5_UDP_SESSION
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <netinet/udp.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Util.hpp"
+#include "ProxySettings.hpp"
+#include "EventLoop.hpp"
+#include "FlatHashMap.hpp"
+#include "Resolver.hpp"
+#include "TimerWheel.hpp"
+#include "UdpProxy.hpp"
+#include "Socks5Proxy.hpp"
+
+#define MAXIMUM_IPV4_UDP_PAYLOAD 65507
+#define MAXIMUM_IPV6_UDP_PAYLOAD 65527
+#define SOCKS5_UDP_IPV4_HEADER_LENGTH 10
+#define SOCKS5_UDP_IPV6_HEADER_LENGTH 22
+
+/// Most associations (each with a distinct target) carried by one session.
+#ifndef SOCKS5_UDP_SESSION_TARGETS
+#define SOCKS5_UDP_SESSION_TARGETS 64
+#endif
+/// Seconds before a session will take on a new association for a target
+/// which it has just stopped carrying, so that late replies meant for the
+/// old client are dropped rather than going to the new one.
+#ifndef SOCKS5_UDP_TARGET_QUARANTINE
+#define SOCKS5_UDP_TARGET_QUARANTINE 10
+#endif
+/// Seconds allowed for setting up a session.
+#define SOCKS5_UDP_NEGOTIATION_TIMEOUT 10
+/// Seconds to wait before trying again after failing to set up a session.
+#define SOCKS5_UDP_RETRY_DELAY 1
+/// Most datagrams a session holds on to while their sources' domains are
+/// looked up.
+#ifndef SOCKS5_UDP_HELD_DATAGRAMS
+#define SOCKS5_UDP_HELD_DATAGRAMS 64
+#endif
+
+class Socks5UdpSessionPool;
+class Socks5UdpProxy;
+
+/// One UDP ASSOCIATE with the upstream proxy: the TCP control connection
+/// which keeps it alive, and a UDP socket connected to the relay it gave
+/// us.
+///
+/// Every SOCKS5 UDP datagram names its own destination, so a session can
+/// carry associations for any number of targets. Replies only name the
+/// target they came from though, so each target can be used by at most
+/// one association per session.
+///
+/// Each session sticks with whichever upstream proxy it was set up with,
+/// trying the others in turn if that fails.
+class Socks5UdpSession : public EventHandler {
+    friend class Socks5UdpSessionPool;
+
+private:
+    ProxySettings::Shared settings;
+    Upstream* upstream;
+    int proxySocketFd;
+    Cleaner proxySocketFdCleaner;
+    Endpoint relayAddress;
+    /// BND.ADDR, if the proxy gave a domain.
+    std::string relayDomain;
+    int relaySocketFd;
+    Cleaner relaySocketFdCleaner;
+    bool gso;
+
+    /// An association using the session, or a target which recently
+    /// stopped using it (proxy is null).
+    struct User {
+        Socks5UdpProxy* proxy;
+        uint64_t releasedMs;
+    };
+
+    Socks5UdpSessionPool* pool;
+    FlatHashMap<Endpoint, User, EndpointHash> users;
+    size_t userCount;
+    bool lost;
+    /// Datagrams from the relay waiting on the resolver, by the domain
+    /// they came from, in the order they arrived.
+    std::unordered_map<std::string, std::vector<std::string>> held;
+    size_t heldCount;
+
+    /// Open the control connection to candidate and ask for an
+    /// association, setting relayAddress.
+    void associate(const Upstream& candidate) {
+        close(proxySocketFd);
+        proxySocketFd = socket(candidate.address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (proxySocketFd < 0) {
+            throw std::runtime_error("could not open socket for upstream proxy");
+        }
+        if (!connect_within(proxySocketFd, candidate.address, SOCKS5_UDP_NEGOTIATION_TIMEOUT * 1000)) {
+            throw std::runtime_error("could not connect to upstream proxy");
+        }
+
+        // No particular target. ASSOCIATE with DST.ADDR 0.0.0.0:0 accepts
+        // datagrams from any of our ports.
+        Socks5Handshake handshake(*settings, 3 /*UDP ASSOCIATE*/, Endpoint::unspecified(AF_INET));
+        handshake.complete(proxySocketFd, SOCKS5_UDP_NEGOTIATION_TIMEOUT * 1000);
+        relayAddress = handshake.bound_address();
+        relayDomain = handshake.bound_domain();
+        // Sessions are only set up off the event loop, so blocking here
+        // is no worse than the handshake.
+        if (!relayDomain.empty()) {
+            Endpoint relayHost;
+            if (!DnsCache::resolve(relayDomain, relayHost)) {
+                throw std::runtime_error("cannot resolve address returned by upstream proxy");
+            }
+            relayAddress = relayHost.with_port(relayAddress.port());
+        }
+    }
+
+public:
+    /// Connect and negotiate (blocking). Safe to use off the event loop's
+    /// thread, as nothing is registered with the loop until the session
+    /// is handed to a pool.
+    Socks5UdpSession(const ProxySettings::Shared& settings):
+        settings(settings),
+        upstream(nullptr),
+        proxySocketFd(-1),
+        pool(nullptr),
+        users(SOCKS5_UDP_SESSION_TARGETS),
+        userCount(0),
+        lost(false),
+        heldCount(0)
+    {
+        proxySocketFdCleaner = Cleaner([this] {
+                close(this->proxySocketFd);
+            });
+
+        Upstream* candidate = nullptr;
+        for (size_t attempt = 1; ; attempt++) {
+            candidate = this->settings->upstreams->select(candidate);
+            uint64_t start = monotonic_us();
+            try {
+                associate(*candidate);
+                this->settings->upstreams->succeeded(candidate, monotonic_us() - start);
+                break;
+            } catch (const std::exception& e) {
+                this->settings->upstreams->failed(candidate);
+                if (attempt >= this->settings->upstreams->size()) {
+                    throw;
+                }
+                Log::message(LogLevel::WARN, "SOCKS5 UDP session via ", candidate->name, " failed (", e.what(), "), trying another upstream");
+            }
+        }
+        upstream = candidate;
+        this->settings->upstreams->acquire(upstream);
+
+        // Establish connection to relay server
+        SocketAddress relay = relayAddress.socket_address();
+        relaySocketFd = socket(relay.generic.sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (relaySocketFd < 0) {
+            throw std::runtime_error("could not open socket for udp relay server");
+        }
+        relaySocketFdCleaner = Cleaner([this] {
+                close(this->relaySocketFd);
+            });
+
+        if (connect(relaySocketFd, relay.get(), relay.length) < 0) {
+            throw std::runtime_error("could not connect to udp relay server");
+        }
+
+        // Kernels with UDP GSO know about UDP_SEGMENT.
+        int segmentSize = 0;
+        socklen_t segmentSizeLength = sizeof(segmentSize);
+        gso = getsockopt(relaySocketFd, SOL_UDP, UDP_SEGMENT, &segmentSize, &segmentSizeLength) == 0;
+    }
+
+    Socks5UdpSession(const Socks5UdpSession&) = delete;
+    Socks5UdpSession& operator=(const Socks5UdpSession&) = delete;
+
+    ~Socks5UdpSession() {
+        if (upstream != nullptr) {
+            settings->upstreams->release(upstream);
+        }
+    }
+
+    int relay_fd() const {
+        return relaySocketFd;
+    }
+
+    /// The largest datagram (header included) the relay can be sent.
+    size_t max_datagram() const {
+        return relayAddress.is_v4() ? MAXIMUM_IPV4_UDP_PAYLOAD : MAXIMUM_IPV6_UDP_PAYLOAD;
+    }
+
+    /// Whether UDP_SEGMENT sends are worth trying on relay_fd().
+    bool use_gso() const {
+        return gso;
+    }
+
+    void disable_gso() {
+        gso = false;
+    }
+
+    size_t user_count() const {
+        return userCount;
+    }
+
+    /// Whether an association for targetAddress could be added.
+    bool can_carry(const Endpoint& targetAddress) {
+        if (lost || userCount >= SOCKS5_UDP_SESSION_TARGETS) {
+            return false;
+        }
+        User* user = users.find(targetAddress);
+        return user == nullptr
+            || (user->proxy == nullptr && monotonic_ms() - user->releasedMs >= SOCKS5_UDP_TARGET_QUARANTINE * 1000);
+    }
+
+    void attach(const Endpoint& targetAddress, Socks5UdpProxy* proxy) {
+        if (users.size() >= 2 * SOCKS5_UDP_SESSION_TARGETS) {
+            forget_released();
+        }
+        users.insert(targetAddress, User{proxy, 0});
+        userCount++;
+    }
+
+    inline void detach(const Endpoint& targetAddress);
+
+    void handle_event(int fd, uint32_t events) override;
+
+private:
+    /// Pass a datagram from the relay on to its association.
+    inline void receive();
+    inline void dispatch(char* datagram, size_t len);
+
+    /// The address of domain, named as the source of a datagram from the
+    /// relay. If it has to be looked up, holds on to the datagram to
+    /// dispatch again once the answer is in, and returns false.
+    bool resolve_source(const std::string& domain, const char* datagram, size_t len, Endpoint& address);
+
+    void dispatch_held(const std::string& domain) {
+        auto it = held.find(domain);
+        if (it == held.end()) {
+            return;
+        }
+        std::vector<std::string> datagrams;
+        datagrams.swap(it->second);
+        held.erase(it);
+        heldCount -= datagrams.size();
+        for (std::string& datagram : datagrams) {
+            try {
+                dispatch(&datagram[0], datagram.size());
+            } catch (const std::exception& e) {
+                Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
+            }
+        }
+    }
+
+    /// Drop released targets which are out of quarantine.
+    void forget_released() {
+        uint64_t now = monotonic_ms();
+        std::vector<Endpoint> expired;
+        users.for_each([&expired, now](const Endpoint& key, const User& user) {
+                if (user.proxy == nullptr && now - user.releasedMs >= SOCKS5_UDP_TARGET_QUARANTINE * 1000) {
+                    expired.push_back(key);
+                }
+            });
+        for (const Endpoint& key : expired) {
+            users.erase(key);
+        }
+    }
+};
+
+/// Ready-made Socks5UdpSessions, so that new associations needn't wait for
+/// a connection and handshake with the upstream proxy.
+///
+/// The pool tries to always have a few sessions with no associations at
+/// all. These are set up by a background thread, and handed over to the
+/// event loop through an eventfd. Associations go to a session which is
+/// already in use where possible, and only take an idle one (prompting
+/// the thread for a replacement) when they must. If no session can take
+/// one, it is parked until the thread has set up another.
+///
+/// Everything except the background thread runs on the event loop's
+/// thread.
+class Socks5UdpSessionPool : public EventHandler {
+    friend class Socks5UdpSession;
+
+private:
+    ProxySettings::Shared settings;
+    EventLoop& loop;
+    size_t spares;
+    std::function<void(Socks5UdpProxy*)> lose;
+    Resolver resolver;
+
+    std::vector<Socks5UdpSession*> sessions;
+    size_t idle;
+    /// Requested from the thread but not yet received.
+    size_t pending;
+
+    /// Associations waiting for a session, in the order they came, and
+    /// how many of them there are for each target.
+    struct Parked {
+        Socks5UdpProxy* proxy;
+        Endpoint targetAddress;
+    };
+    std::vector<Parked> parked;
+    FlatHashMap<Endpoint, size_t, EndpointHash> parkedTargets;
+
+    int readyFd;
+    std::thread filler;
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Guarded by mutex.
+    size_t wanted;
+    std::deque<Socks5UdpSession*> ready;
+    bool stopping;
+
+public:
+    /// lose is called for every association of a session which the
+    /// upstream proxy has dropped, and must get rid of them.
+    Socks5UdpSessionPool(const ProxySettings::Shared& settings, EventLoop& loop, size_t spares, std::function<void(Socks5UdpProxy*)> lose):
+        settings(settings),
+        loop(loop),
+        spares(spares),
+        lose(lose),
+        resolver(loop),
+        idle(0),
+        pending(0),
+        parkedTargets(SOCKS5_UDP_SESSION_TARGETS),
+        wanted(0),
+        stopping(false)
+    {
+        readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (readyFd < 0) {
+            throw std::runtime_error("could not create eventfd for session pool");
+        }
+        loop.add(readyFd, EPOLLIN, this);
+        filler = std::thread([this] {
+                fill();
+            });
+        top_up();
+    }
+
+    Socks5UdpSessionPool(const Socks5UdpSessionPool&) = delete;
+    Socks5UdpSessionPool& operator=(const Socks5UdpSessionPool&) = delete;
+
+    ~Socks5UdpSessionPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        filler.join();
+        for (Socks5UdpSession* session : ready) {
+            delete session;
+        }
+        for (Socks5UdpSession* session : sessions) {
+            delete session;
+        }
+        loop.remove(readyFd);
+        close(readyFd);
+    }
+
+    /// A session carrying proxy's association with targetAddress. If none
+    /// is ready to, parks proxy and returns null instead, and the proxy
+    /// is handed one by carry_on() once the thread has set it up.
+    Socks5UdpSession* acquire(const Endpoint& targetAddress, Socks5UdpProxy* proxy) {
+        Socks5UdpSession* session = carrier(targetAddress);
+        if (session != nullptr) {
+            session->attach(targetAddress, proxy);
+            return session;
+        }
+        static thread_local LogSampler waits;
+        if (Log::sampled(LogLevel::INFO, waits)) {
+            Log::message(LogLevel::INFO, "No SOCKS5 UDP session ready, waiting for one");
+        }
+        parked.push_back(Parked{proxy, targetAddress});
+        size_t* count = parkedTargets.find(targetAddress);
+        size_t waiting = count != nullptr ? ++*count : parkedTargets.insert(targetAddress, 1);
+        // Each new session can take one association per target, for up to
+        // SOCKS5_UDP_SESSION_TARGETS targets.
+        if (waiting > pending || parked.size() > pending * SOCKS5_UDP_SESSION_TARGETS) {
+            request(1);
+        }
+        return nullptr;
+    }
+
+    /// proxy, parked by acquire(), is going away.
+    void unpark(Socks5UdpProxy* proxy) {
+        for (size_t i = 0; i < parked.size(); i++) {
+            if (parked[i].proxy == proxy) {
+                forget_parked(parked[i].targetAddress);
+                parked.erase(parked.begin() + i);
+                return;
+            }
+        }
+    }
+
+    /// EventFd says the thread has sessions ready.
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0) {
+            return;
+        }
+        std::deque<Socks5UdpSession*> received;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            received.swap(ready);
+        }
+        for (Socks5UdpSession* session : received) {
+            pending--;
+            adopt(session);
+        }
+        if (!parked.empty()) {
+            carry_parked();
+        }
+        top_up();
+    }
+
+private:
+    /// The session to take an association for targetAddress: one in
+    /// use where possible, otherwise an idle one. Null if none can.
+    Socks5UdpSession* carrier(const Endpoint& targetAddress) {
+        Socks5UdpSession* spare = nullptr;
+        for (Socks5UdpSession* session : sessions) {
+            if (session->can_carry(targetAddress)) {
+                if (session->user_count() > 0) {
+                    return session;
+                }
+                spare = session;
+            }
+        }
+        if (spare != nullptr) {
+            idle--;
+            top_up();
+        }
+        return spare;
+    }
+
+    /// Hand parked associations to whichever sessions can now take them,
+    /// and ask for more sessions for any still left.
+    inline void carry_parked();
+
+    void forget_parked(const Endpoint& targetAddress) {
+        size_t* count = parkedTargets.find(targetAddress);
+        if (--*count == 0) {
+            parkedTargets.erase(targetAddress);
+        }
+    }
+
+    void adopt(Socks5UdpSession* session) {
+        session->pool = this;
+        loop.add(session->proxySocketFd, EPOLLIN, session);
+        loop.add(session->relaySocketFd, EPOLLIN, session);
+        sessions.push_back(session);
+        idle++;
+    }
+
+    void discard(Socks5UdpSession* session) {
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i] == session) {
+                sessions[i] = sessions.back();
+                sessions.pop_back();
+                break;
+            }
+        }
+        loop.remove(session->proxySocketFd);
+        loop.remove(session->relaySocketFd);
+        resolver.cancel(session);
+        // May be running its own handle_event().
+        loop.retire(session);
+    }
+
+    /// Ask the thread for enough sessions to get back to spares idle.
+    void top_up() {
+        if (idle + pending >= spares) {
+            return;
+        }
+        request(spares - idle - pending);
+    }
+
+    void request(size_t count) {
+        pending += count;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wanted += count;
+        }
+        wake.notify_one();
+    }
+
+    /// session's last association has gone.
+    void released(Socks5UdpSession* session) {
+        if (session->lost) {
+            return;
+        }
+        idle++;
+        if (idle > spares) {
+            idle--;
+            discard(session);
+        }
+    }
+
+    /// The upstream proxy has dropped session.
+    void lost(Socks5UdpSession* session) {
+        Log::message(LogLevel::WARN, "\t", "SOCKS5 UDP session closed by upstream proxy ", session->upstream->name);
+        settings->upstreams->failed(session->upstream);
+        bool wasIdle = session->user_count() == 0;
+        session->lost = true;
+        std::vector<Socks5UdpProxy*> orphans;
+        session->users.for_each([&orphans](const Endpoint&, const Socks5UdpSession::User& user) {
+                if (user.proxy) {
+                    orphans.push_back(user.proxy);
+                }
+            });
+        for (Socks5UdpProxy* proxy : orphans) {
+            lose(proxy);
+        }
+        if (wasIdle) {
+            idle--;
+        }
+        discard(session);
+        top_up();
+    }
+
+    /// Background thread: set up sessions whenever some are wanted.
+    void fill() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] {
+                    return stopping || wanted > 0;
+                });
+            if (stopping) {
+                return;
+            }
+            lock.unlock();
+            Socks5UdpSession* session = nullptr;
+            try {
+                session = new Socks5UdpSession(settings);
+            } catch (const std::exception& e) {
+                Log::message(LogLevel::ERROR, "Error: could not set up SOCKS5 UDP session: ", e.what());
+            }
+            lock.lock();
+            if (session == nullptr) {
+                // Don't hammer a proxy which is down.
+                wake.wait_for(lock, std::chrono::seconds(SOCKS5_UDP_RETRY_DELAY), [this] {
+                        return stopping;
+                    });
+                continue;
+            }
+            wanted--;
+            ready.push_back(session);
+            uint64_t one = 1;
+            if (write(readyFd, &one, sizeof(one)) < 0) {
+                Log::message(LogLevel::ERROR, "Error: could not signal session pool: ", strerror(errno));
+            }
+        }
+    }
+};
+
+void Socks5UdpSession::detach(const Endpoint& targetAddress) {
+    User* user = users.find(targetAddress);
+    user->proxy = nullptr;
+    user->releasedMs = monotonic_ms();
+    userCount--;
+    if (userCount == 0 && pool) {
+        pool->released(this);
+    }
+}
+
+bool Socks5UdpSession::resolve_source(const std::string& domain, const char* datagram, size_t len, Endpoint& address) {
+    if (domain == relayDomain) {
+        address = relayAddress.host();
+        return true;
+    }
+    // Already waiting on domain; this one goes after the others.
+    auto waiting = held.find(domain);
+    if (waiting == held.end()) {
+        DnsCache::Result known = pool->resolver.lookup(domain, address, this, [this, domain](bool, const Endpoint&) {
+                dispatch_held(domain);
+            });
+        switch (known) {
+        case DnsCache::Result::FOUND:
+            return true;
+        case DnsCache::Result::FAILED:
+            throw std::runtime_error("cannot resolve address returned by upstream proxy");
+        default:
+            break;
+        }
+        waiting = held.emplace(domain, std::vector<std::string>()).first;
+    }
+    if (heldCount >= SOCKS5_UDP_HELD_DATAGRAMS) {
+        Metrics::count(Metric::UDP_DROPS);
+        static thread_local LogSampler drops;
+        if (Log::sampled(LogLevel::WARN, drops)) {
+            Log::message(LogLevel::WARN, "\t", "(DROP)  DOWN DGRAM   whilst resolving ", domain);
+        }
+    } else {
+        waiting->second.emplace_back(datagram, len);
+        heldCount++;
+    }
+    return false;
+}
+
+void Socks5UdpSession::handle_event(int fd, uint32_t events) {
+    if (fd == proxySocketFd) {
+        // Nothing more is expected on the control connection, so anything
+        // at all means it has had enough.
+        (void)events;
+        pool->lost(this);
+        return;
+    }
+    try {
+        receive();
+    } catch (const std::exception& e) {
+        Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
+    }
+}
+
+#endif
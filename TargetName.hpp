@@ -0,0 +1,200 @@
+#ifndef HGUARD_TARGET_NAME
+#define HGUARD_TARGET_NAME
+
+#include <cstddef>
+#include <cstdint>
+
+/// Finds the name of the server a client means to reach in the first
+/// bytes it sends: the server name (SNI) of a TLS ClientHello, or the Host
+/// header of a plain HTTP request. Works in place on peeked data, without
+/// allocating.
+class TargetName {
+public:
+    enum class Result {
+        FOUND, // name and nameLength point into the data
+        NONE,  // Not there, and won't be
+        MORE,  // Can't tell until there are wanted bytes
+    };
+
+    /// Looks at whatever the client has sent so far. On MORE, wanted is how
+    /// many bytes to wait for before looking again.
+    static Result find(const char* data, size_t length, const char*& name, size_t& nameLength, size_t& wanted) {
+        if (length == 0) {
+            wanted = 1;
+            return Result::MORE;
+        }
+        if (data[0] == 0x16 /*TLS handshake record*/) {
+            return find_sni((const unsigned char*)data, length, name, nameLength, wanted);
+        }
+        // An HTTP method (in capitals), then a space.
+        for (size_t i = 0; i < length; i++) {
+            if (data[i] == ' ' && i > 0) {
+                return find_host(data, length, name, nameLength, wanted);
+            }
+            if (data[i] < 'A' || data[i] > 'Z' || i >= 16) {
+                return Result::NONE;
+            }
+        }
+        wanted = length + 1;
+        return Result::MORE;
+    }
+
+private:
+    /// Whether name is fit to go in a CONNECT request or SOCKS address as it
+    /// is: a hostname (or address), with no port.
+    static bool valid(const char* name, size_t length) {
+        if (length == 0 || length > 255) {
+            return false;
+        }
+        for (size_t i = 0; i < length; i++) {
+            char c = name[i];
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                  || c == '.' || c == '-' || c == '_')) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint32_t be16(const unsigned char* p) {
+        return (uint32_t(p[0]) << 8) | p[1];
+    }
+
+    /// SNI from a ClientHello in the first TLS record of data.
+    static Result find_sni(const unsigned char* data, size_t length, const char*& name, size_t& nameLength, size_t& wanted) {
+        // Record header: type, version, length
+        if (length < 5) {
+            wanted = 5;
+            return Result::MORE;
+        }
+        if (data[1] != 3) {
+            return Result::NONE;
+        }
+        size_t recordEnd = 5 + be16(data + 3);
+        if (length < recordEnd) {
+            wanted = recordEnd;
+            return Result::MORE;
+        }
+        // A ClientHello split over records is cut short here, which is fine
+        // unless the name is in a later one.
+        const unsigned char* p = data + 5;
+        const unsigned char* end = data + recordEnd;
+        // Handshake header: type (ClientHello), length; then version, random
+        if (end - p < 4 + 2 + 32 || p[0] != 1) {
+            return Result::NONE;
+        }
+        p += 4 + 2 + 32;
+        // Session ID, cipher suites, compression methods
+        if (end - p < 1 || end - p < 1 + p[0]) {
+            return Result::NONE;
+        }
+        p += 1 + p[0];
+        if (end - p < 2 || end - p < 2 + ptrdiff_t(be16(p))) {
+            return Result::NONE;
+        }
+        p += 2 + be16(p);
+        if (end - p < 1 || end - p < 1 + p[0]) {
+            return Result::NONE;
+        }
+        p += 1 + p[0];
+        if (end - p < 2) {
+            return Result::NONE;
+        }
+        const unsigned char* extensionsEnd = p + 2 + be16(p);
+        if (extensionsEnd > end) {
+            extensionsEnd = end;
+        }
+        p += 2;
+        while (extensionsEnd - p >= 4) {
+            uint32_t type = be16(p);
+            size_t extensionLength = be16(p + 2);
+            p += 4;
+            if (size_t(extensionsEnd - p) < extensionLength) {
+                return Result::NONE;
+            }
+            if (type == 0 /*server_name*/) {
+                // List length, then entries of type (0 for a hostname),
+                // length, name. There's only ever a hostname.
+                if (extensionLength < 2 + 3 || p[2] != 0) {
+                    return Result::NONE;
+                }
+                size_t hostLength = be16(p + 3);
+                if (2 + 3 + hostLength > extensionLength || !valid((const char*)p + 5, hostLength)) {
+                    return Result::NONE;
+                }
+                name = (const char*)p + 5;
+                nameLength = hostLength;
+                return Result::FOUND;
+            }
+            p += extensionLength;
+        }
+        return Result::NONE;
+    }
+
+    static char lower(char c) {
+        return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+    }
+
+    /// Host header from an HTTP/1 request at the start of data.
+    static Result find_host(const char* data, size_t length, const char*& name, size_t& nameLength, size_t& wanted) {
+        // Lines are ended by "\n", optionally after "\r". The request line
+        // is skipped.
+        size_t line = 0;
+        while (line < length && data[line] != '\n') {
+            line++;
+        }
+        while (true) {
+            if (line >= length) {
+                wanted = length + 1;
+                return Result::MORE;
+            }
+            size_t start = line + 1;
+            size_t end = start;
+            while (end < length && data[end] != '\n') {
+                end++;
+            }
+            if (end >= length) {
+                wanted = length + 1;
+                return Result::MORE;
+            }
+            line = end;
+            size_t valueEnd = end > start && data[end - 1] == '\r' ? end - 1 : end;
+            if (valueEnd == start) {
+                // End of the headers
+                return Result::NONE;
+            }
+            static const char header[] = "host:";
+            size_t headerLength = sizeof(header) - 1;
+            if (valueEnd - start < headerLength) {
+                continue;
+            }
+            bool matches = true;
+            for (size_t i = 0; i < headerLength && matches; i++) {
+                matches = lower(data[start + i]) == header[i];
+            }
+            if (!matches) {
+                continue;
+            }
+            size_t value = start + headerLength;
+            while (value < valueEnd && (data[value] == ' ' || data[value] == '\t')) {
+                value++;
+            }
+            while (valueEnd > value && (data[valueEnd - 1] == ' ' || data[valueEnd - 1] == '\t')) {
+                valueEnd--;
+            }
+            // The port comes from the original destination instead.
+            size_t colon = value;
+            while (colon < valueEnd && data[colon] != ':') {
+                colon++;
+            }
+            if (!valid(data + value, colon - value)) {
+                return Result::NONE;
+            }
+            name = data + value;
+            nameLength = colon - value;
+            return Result::FOUND;
+        }
+    }
+};
+
+#endif
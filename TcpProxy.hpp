@@ -1,81 +1,334 @@
 #ifndef HGUARD_TCP_PROXY
 #define HGUARD_TCP_PROXY
 
+#include <memory>
+
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
+#include "Log.hpp"
+#include "Metrics.hpp"
 #include "Util.hpp"
 #include "ProxySettings.hpp"
 #include "Proxy.hpp"
+#include "EventLoop.hpp"
+#include "RelayChannel.hpp"
+#include "Handshake.hpp"
+#include "UpstreamPool.hpp"
+#include "UringRelay.hpp"
+#include "TargetName.hpp"
+
+/// Most client data forwarded ahead of the upstream proxy's reply.
+#ifndef TCP_EARLY_DATA_LIMIT
+#define TCP_EARLY_DATA_LIMIT 16384
+#endif
+
+/// Most of the client's first bytes looked at for the target's name: a
+/// whole TLS record.
+#ifndef TCP_PEEK_LIMIT
+#define TCP_PEEK_LIMIT (16384 + 5)
+#endif
+/// Longest to wait for the client to send enough to name the target,
+/// before going ahead by address. Only clients which don't speak first
+/// wait the whole time.
+#ifndef TCP_PEEK_TIMEOUT_MS
+#define TCP_PEEK_TIMEOUT_MS 200
+#endif
 
-class TcpProxy : public virtual Proxy {
+class TcpProxy : public virtual Proxy, public EventHandler {
 private:
+    enum class State {
+        IDLE,
+        PEEKING,
+        CONNECTING,
+        NEGOTIATING,
+        RELAYING,
+        CLOSED,
+    };
+
+    // Event loop engine state
+    EventLoop* loop;
+    State state;
+    /// Until the upstream connection is opened.
+    std::shared_ptr<UpstreamPool> upstreamPool;
+    int proxySocketFd;
+    bool pooledUpstream;
+    uint64_t acceptedUs;
+    uint64_t attemptStartUs;
+    std::unique_ptr<Handshake> negotiation;
+    EventTimer negotiationTimer;
+    RelayChannel upstream;   // client -> proxy
+    RelayChannel downstream; // proxy -> client
+    uint32_t clientEvents;
+    uint32_t proxyEvents;
+    // io_uring engine: relays once negotiated, instead of the loop
+    RelayRing* relayRing;
+    std::unique_ptr<UringRelay> ringRelay;
+
+    // Upstream proxy in use, and how many have been tried.
+    Upstream* chosen;
+    size_t attempts;
+
 protected:
     int clientSocketFd;
+    /// What the client called the target, if asked to find out and it
+    /// said; for asking the upstream proxy by name.
+    std::string targetName;
 
-    TcpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress, int clientSocketFd):
+    TcpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress, int clientSocketFd):
         Proxy(settings, clientAddress, targetAddress),
+        loop(nullptr),
+        state(State::IDLE),
+        proxySocketFd(-1),
+        pooledUpstream(false),
+        acceptedUs(monotonic_us()),
+        attemptStartUs(0),
+        clientEvents(0),
+        proxyEvents(0),
+        relayRing(nullptr),
+        chosen(nullptr),
+        attempts(0),
         clientSocketFd(clientSocketFd)
     {
+        Metrics::count(Metric::TUNNELS_OPENED);
     }
 
-    virtual ~TcpProxy() {
+    /// Negotiation needed with the upstream proxy before relaying, if
+    /// any.
+    virtual std::unique_ptr<Handshake> handshake() {
+        // Doesn't have to be implemented
+        return nullptr;
     }
 
-    virtual void proxy_negotiate(int proxySocketFd) {
-        // Doesn't have to be implemented
-        (void)proxySocketFd; // Prevent unused warning.
+    /// Negotiation needed over a connection from an UpstreamPool, which
+    /// has already been through the pool's preamble.
+    virtual std::unique_ptr<Handshake> pooled_handshake() {
+        return handshake();
     }
 
-    virtual void relay(int proxySocketFd) {
-        std::cerr << getpid() << "\t" << "Tunnel  " << clientHost << " -> " << targetHost << ":" << targetPort << std::endl;
+    /// Whatever the client has already sent, if it's to go out with the
+    /// handshake.
+    std::string read_early_data() {
+        if (!settings->earlyData) {
+            return std::string();
+        }
+        char data[TCP_EARLY_DATA_LIMIT];
+        ssize_t r = recv(clientSocketFd, data, sizeof(data), MSG_DONTWAIT);
+        if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            throw std::runtime_error("client read error");
+        }
+        // On EOF, the relay will find out soon enough.
+        return std::string(data, r > 0 ? r : 0);
+    }
+
+    void log_retry(const char* reason) {
+        if (Log::enabled(LogLevel::INFO)) {
+            Log::tunnel(LogLevel::INFO, "Retry   ", clientAddress, targetAddress, (std::string(" after: ") + reason).c_str());
+        }
+    }
+
+    /// Look for the target's name in what the client has sent so far,
+    /// leaving it unread for the relay. Returns false if there's more
+    /// worth waiting for, in which case the client socket only becomes
+    /// readable once there's enough to look again.
+    bool peek_target_name() {
+        char data[TCP_PEEK_LIMIT];
+        ssize_t r = recv(clientSocketFd, data, sizeof(data), MSG_PEEK | MSG_DONTWAIT);
+        if (r < 0) {
+            // Errors are left for the relay to find.
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+        const char* name = nullptr;
+        size_t nameLength = 0;
+        size_t wanted = 0;
+        switch (r == 0 ? TargetName::Result::NONE : TargetName::find(data, r, name, nameLength, wanted)) {
+        case TargetName::Result::FOUND:
+            targetName.assign(name, nameLength);
+            if (Log::enabled(LogLevel::DEBUG)) {
+                Log::tunnel(LogLevel::DEBUG, "Name    ", clientAddress, targetAddress, (" " + targetName).c_str());
+            }
+            return true;
+        case TargetName::Result::MORE:
+            if (size_t(r) < sizeof(data)) {
+                int lowWater = int(wanted < sizeof(data) ? wanted : sizeof(data));
+                setsockopt(clientSocketFd, SOL_SOCKET, SO_RCVLOWAT, &lowWater, sizeof(lowWater));
+                return false;
+            }
+            return true;
+        default:
+            return true;
+        }
+    }
+
+    /// Done with peek_target_name(), one way or another.
+    void stop_peeking() {
+        int lowWater = 1;
+        setsockopt(clientSocketFd, SOL_SOCKET, SO_RCVLOWAT, &lowWater, sizeof(lowWater));
+    }
+
+    /// Blocking equivalent of peeking from the event loop, for run().
+    void wait_for_target_name() {
+        uint64_t deadlineMs = monotonic_ms() + TCP_PEEK_TIMEOUT_MS;
+        while (!peek_target_name()) {
+            uint64_t nowMs = monotonic_ms();
+            if (nowMs >= deadlineMs) {
+                break;
+            }
+            struct pollfd pfd = {clientSocketFd, POLLIN, 0};
+            if (poll(&pfd, 1, int(deadlineMs - nowMs)) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+        stop_peeking();
+    }
+
+    /// Pick the upstream proxy for the next attempt, preferring one which
+    /// hasn't just failed.
+    virtual void choose_upstream() {
+        use_upstream(settings->upstreams->select(chosen));
+    }
+
+    /// Where the tunnel's upstream connection should go.
+    virtual const Endpoint& upstream_address() {
+        return chosen->address;
+    }
 
-        char data[65536] = {};
-        int data_len = 0;
-        bool clientOpen = true;
-        bool proxyOpen = true;
-        while (clientOpen || proxyOpen) {
+    void use_upstream(Upstream* next) {
+        if (chosen != nullptr) {
+            settings->upstreams->release(chosen);
+        }
+        chosen = next;
+        settings->upstreams->acquire(chosen);
+        attempts++;
+    }
+
+    /// The upstream proxy got us through (or at least answered).
+    void upstream_succeeded() {
+        if (chosen != nullptr) {
+            // Pooled connections skipped the connect, so would flatter.
+            settings->upstreams->succeeded(chosen, pooledUpstream ? 0 : monotonic_us() - attemptStartUs);
+        }
+    }
+
+    /// Mark the upstream proxy as failed. Returns whether there's another
+    /// one left to try.
+    bool upstream_failed() {
+        if (chosen == nullptr) {
+            return false;
+        }
+        settings->upstreams->failed(chosen);
+        return attempts < settings->upstreams->size();
+    }
+
+    /// negotiation, started afresh for another connection (if it had
+    /// been started at all).
+    std::unique_ptr<Handshake> renegotiation(const std::unique_ptr<Handshake>& negotiation) {
+        if (!negotiation) {
+            return nullptr;
+        }
+        std::unique_ptr<Handshake> fresh = handshake();
+        fresh->set_early_data(negotiation->early_data());
+        return fresh;
+    }
+
+    /// Relay between the client and proxySocketFd until both have hung
+    /// up, without blocking on either, so that each direction moves as
+    /// fast as its destination will take it. Used by run(), and sends on
+    /// whatever negotiation has left over.
+    virtual void relay(int proxySocketFd) {
+        tunnel_up();
+        if (!set_nonblocking(clientSocketFd, true) || !set_nonblocking(proxySocketFd, true)) {
+            throw std::runtime_error("could not configure sockets for relay");
+        }
+        open_channels(proxySocketFd);
+        while (!upstream.finished() || !downstream.finished()) {
+            short wantedClientEvents = (upstream.can_fill() ? POLLIN : 0) | (downstream.pending() ? POLLOUT : 0);
+            short wantedProxyEvents = (downstream.can_fill() ? POLLIN : 0) | (upstream.pending() ? POLLOUT : 0);
             struct pollfd fds[] = {
-                { clientSocketFd, short(clientOpen ? (POLLIN | POLLHUP) : -1), 0 },
-                { proxySocketFd, short(proxyOpen ? (POLLIN | POLLHUP) : -1), 0 },
+                { wantedClientEvents ? clientSocketFd : -1, wantedClientEvents, 0 },
+                { wantedProxyEvents ? proxySocketFd : -1, wantedProxyEvents, 0 },
             };
             if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
                 throw std::runtime_error("poll error whilst proxying");
-            } else {
-                if (clientOpen && fds[0].revents & (POLLIN | POLLHUP)) {
-                    data_len = read(clientSocketFd, data, sizeof(data));
-                    if (data_len < 0) {
-                        throw std::runtime_error("client read error");
-                    }
-                    if (data_len == 0) {
-                        clientOpen = false;
-                        std::cerr << getpid() << "\t" << "CliHUP  " << clientHost << " -> " << targetHost << ":" << targetPort << std::endl;
-                        shutdown(proxySocketFd, SHUT_WR);
-                    } else {
-                        if (write_exactly(proxySocketFd, data, data_len) < 0) {
-                            throw std::runtime_error("upstream proxy write error");
-                        }
-                    }
+            }
+            for (const struct pollfd& fd : fds) {
+                if (fd.revents) {
+                    move_data(fd.fd, fd.revents & (POLLIN | POLLHUP | POLLERR), fd.revents & (POLLOUT | POLLERR));
                 }
-                if (proxyOpen && fds[1].revents & (POLLIN | POLLHUP)) {
-                    data_len = read(proxySocketFd, data, sizeof(data));
-                    if (data_len < 0) {
-                        throw std::runtime_error("upstream proxy read error");
-                    }
-                    if (data_len == 0) {
-                        proxyOpen = false;
-                        std::cerr << getpid() << "\t" << "ProHUP  " << clientHost << " -> " << targetHost << ":" << targetPort << std::endl;
-                        shutdown(clientSocketFd, SHUT_WR);
-                    } else {
-                        if (write_exactly(clientSocketFd, data, data_len) < 0) {
-                            throw std::runtime_error("client write error");
-                        }
-                    }
+            }
+        }
+    }
+
+    /// Set up the channels between the client and proxySocketFd, queueing
+    /// anything left over from negotiation.
+    void open_channels(int proxySocketFd) {
+        bool zeroCopy = settings->relayEngine == ProxySettings::RelayEngine::SPLICE;
+        upstream.open(clientSocketFd, proxySocketFd, zeroCopy);
+        downstream.open(proxySocketFd, clientSocketFd, zeroCopy);
+        if (negotiation) {
+            downstream.preload(negotiation->surplus().data(), negotiation->surplus().size());
+            upstream.preload(negotiation->unsent_early_data().data(), negotiation->unsent_early_data().size());
+            negotiation.reset();
+        }
+    }
+
+    /// Move data along whichever channels fd's readiness affects.
+    void move_data(int fd, bool readable, bool writable) {
+        RelayChannel& reading = fd == clientSocketFd ? upstream : downstream;
+        RelayChannel& writing = fd == clientSocketFd ? downstream : upstream;
+        if (readable) {
+            transfer(reading, true);
+        }
+        if (writable) {
+            transfer(writing, false);
+        }
+    }
+
+    /// Read into channel if its source is readable and there's room, then
+    /// write out as much as its destination will take.
+    void transfer(RelayChannel& channel, bool readable) {
+        bool toProxy = &channel == &upstream;
+        if (readable && channel.can_fill()) {
+            ssize_t r = channel.fill();
+            if (r < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    throw std::runtime_error(toProxy ? "client read error" : "upstream proxy read error");
                 }
+            } else if (r > 0) {
+                Metrics::count(toProxy ? Metric::BYTES_UPSTREAM : Metric::BYTES_DOWNSTREAM, r);
+            } else {
+                Log::tunnel(LogLevel::INFO, toProxy ? "CliHUP  " : "ProHUP  ", clientAddress, targetAddress);
             }
         }
+        if (channel.pending()) {
+            if (channel.drain() < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                throw std::runtime_error(toProxy ? "upstream proxy write error" : "client write error");
+            }
+        }
+        if (channel.finished()) {
+            shutdown(channel.destination(), SHUT_WR);
+        }
+    }
+
+    /// Ready to relay.
+    void tunnel_up() {
+        Metrics::observe_handshake(size_t(settings->proxyProtocol), monotonic_us() - acceptedUs);
+        Log::tunnel(LogLevel::INFO, "Tunnel  ", clientAddress, targetAddress);
     }
 
 public:
+    virtual ~TcpProxy() {
+        if (chosen != nullptr) {
+            settings->upstreams->release(chosen);
+        }
+        settings->admission->tunnel_closed();
+        Metrics::count(Metric::TUNNELS_CLOSED);
+    }
+
     virtual void run() {
         // We will be finished with the client whenever this method
         // finishes.
@@ -84,18 +337,372 @@ public:
             });
 
         // Establish connection to proxy
-        int proxySocketFd = socket(AF_INET, SOCK_STREAM, 0);
+        int proxySocketFd = -1;
         Cleaner proxySocketFdCleaner([&proxySocketFd] {
                 close(proxySocketFd);
             });
 
-        if (connect(proxySocketFd, (struct sockaddr*)&settings.proxyAddress, sizeof(settings.proxyAddress)) < 0) {
+        if (settings->peekTargetName) {
+            wait_for_target_name();
+        }
+
+        std::unique_ptr<Handshake> negotiation = handshake();
+        bool earlyRead = false;
+        choose_upstream();
+        while (true) {
+            bool negotiating = false;
+            try {
+                close(proxySocketFd);
+                proxySocketFd = socket(upstream_address().family(), SOCK_STREAM | SOCK_NONBLOCK, 0);
+                if (proxySocketFd < 0) {
+                    throw std::runtime_error("could not open upstream socket");
+                }
+                settings->upstreamSocket.apply_connect(proxySocketFd);
+                attemptStartUs = monotonic_us();
+                if (!connect_within(proxySocketFd, upstream_address(), TCP_NEGOTIATION_TIMEOUT * 1000)) {
+                    throw std::runtime_error("could not connect to upstream proxy");
+                }
+                if (negotiation) {
+                    if (!earlyRead) {
+                        negotiation->set_early_data(read_early_data());
+                        earlyRead = true;
+                    }
+                    negotiating = true;
+                    negotiation->complete(proxySocketFd, TCP_NEGOTIATION_TIMEOUT * 1000);
+                }
+                upstream_succeeded();
+                break;
+            } catch (const TargetRefused&) {
+                upstream_succeeded();
+                throw;
+            } catch (const std::exception& e) {
+                std::unique_ptr<Handshake> retry = negotiating ? negotiation->fallback() : nullptr;
+                if (!retry) {
+                    if (!upstream_failed()) {
+                        throw;
+                    }
+                    choose_upstream();
+                    retry = negotiating ? renegotiation(negotiation) : std::move(negotiation);
+                }
+                log_retry(e.what());
+                negotiation = std::move(retry);
+            }
+        }
+        this->negotiation = std::move(negotiation);
+        relay(proxySocketFd);
+    }
+
+    /// Event loop equivalent of run(). Returns once the upstream connect
+    /// is under way (or the client is being peeked at for the target's
+    /// name); the loop drives the tunnel from then on, and the proxy
+    /// retires itself from the loop when the tunnel closes. If given a
+    /// pool, the upstream connection is taken from it where possible.
+    ///
+    /// On exception, the caller should finish() the proxy.
+    virtual void start(EventLoop& eventLoop, const std::shared_ptr<UpstreamPool>& pool) {
+        loop = &eventLoop;
+        upstreamPool = pool;
+
+        if (!set_nonblocking(clientSocketFd, true)) {
+            throw std::runtime_error("could not make client socket non-blocking");
+        }
+        if (settings->peekTargetName) {
+            if (!peek_target_name()) {
+                state = State::PEEKING;
+                clientEvents = EPOLLIN;
+                loop->add(clientSocketFd, clientEvents, this);
+                loop->schedule(negotiationTimer, this, TCP_PEEK_TIMEOUT_MS);
+                return;
+            }
+            stop_peeking();
+        }
+        open_upstream();
+    }
+
+    /// Once negotiated, relay through ring instead of the event loop. Must
+    /// be called before start().
+    void use_ring(RelayRing* ring) {
+        relayRing = ring;
+    }
+
+    /// Tear the tunnel down and hand the proxy back to the loop for
+    /// deletion. Unless the tunnel closed cleanly, the client connection
+    /// is reset.
+    void finish() {
+        if (state == State::CLOSED) {
+            return;
+        }
+        state = State::CLOSED;
+        loop->cancel(negotiationTimer);
+        if (proxySocketFd >= 0) {
+            loop->remove(proxySocketFd);
+            close(proxySocketFd);
+        }
+        loop->remove(clientSocketFd);
+        bool clean = ringRelay ? ringRelay->finished() : upstream.finished() && downstream.finished();
+        if (!clean) {
+            // Reset the connection (well, try)
+            struct sockaddr_in resetAddress = {};
+            resetAddress.sin_family = AF_UNSPEC;
+            connect(clientSocketFd, (struct sockaddr*)&resetAddress, sizeof(resetAddress));
+        }
+        close(clientSocketFd);
+        Log::tunnel(LogLevel::INFO, "Close   ", clientAddress, targetAddress);
+        loop->retire(this);
+    }
+
+    void handle_event(int fd, uint32_t events) override {
+        try {
+            switch (state) {
+            case State::PEEKING:
+                if (peek_target_name()) {
+                    peeked();
+                }
+                break;
+            case State::CONNECTING:
+                connected();
+                break;
+            case State::NEGOTIATING:
+                negotiate();
+                break;
+            case State::RELAYING:
+                pump(fd, events);
+                break;
+            default:
+                break;
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            finish();
+        }
+    }
+
+    /// Negotiation took too long.
+    void handle_timeout() override {
+        const char* reason = "upstream proxy negotiation timed out";
+        try {
+            if (state == State::PEEKING) {
+                // Never mind the name.
+                peeked();
+            } else if (!retry_negotiation(reason) && !fail_over(reason)) {
+                throw std::runtime_error(reason);
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            finish();
+        }
+    }
+
+private:
+    /// Go on to the upstream proxy, once the client has been peeked at.
+    void peeked() {
+        loop->cancel(negotiationTimer);
+        loop->remove(clientSocketFd);
+        clientEvents = 0;
+        stop_peeking();
+        open_upstream();
+    }
+
+    /// Take a connection from the pool, or start making one.
+    void open_upstream() {
+        Upstream* pooled = nullptr;
+        proxySocketFd = upstreamPool != nullptr ? upstreamPool->acquire(pooled) : -1;
+        // The worker may have moved on to a pool for new settings.
+        upstreamPool.reset();
+        if (proxySocketFd >= 0) {
+            // Already connected, so this will be writable straight away.
+            use_upstream(pooled);
+            pooledUpstream = true;
+            state = State::CONNECTING;
+            proxyEvents = EPOLLOUT;
+            loop->add(proxySocketFd, proxyEvents, this);
+        } else {
+            choose_upstream();
+            connect_upstream();
+        }
+    }
+
+    void connect_upstream() {
+        state = State::CONNECTING;
+        SocketAddress address = upstream_address().socket_address();
+        proxySocketFd = socket(address.generic.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (proxySocketFd < 0) {
+            throw std::runtime_error("could not open upstream socket");
+        }
+        settings->upstreamSocket.apply_connect(proxySocketFd);
+        attemptStartUs = monotonic_us();
+        if (connect(proxySocketFd, address.get(), address.length) < 0 && errno != EINPROGRESS) {
             throw std::runtime_error("could not connect to upstream proxy");
         }
+        proxyEvents = EPOLLOUT;
+        loop->add(proxySocketFd, proxyEvents, this);
+    }
 
-        proxy_negotiate(proxySocketFd);
+    void connected() {
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        if (getsockopt(proxySocketFd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0) {
+            if (retry_negotiation("pooled upstream connection went stale") || fail_over("could not connect to upstream proxy")) {
+                return;
+            }
+            throw std::runtime_error("could not connect to upstream proxy");
+        }
 
-        relay(proxySocketFd);
+        if (!negotiation) {
+            negotiation = pooledUpstream ? pooled_handshake() : handshake();
+            if (!negotiation) {
+                begin_relay();
+                return;
+            }
+            negotiation->set_early_data(read_early_data());
+        }
+        state = State::NEGOTIATING;
+        loop->schedule(negotiationTimer, this, TCP_NEGOTIATION_TIMEOUT * 1000);
+        negotiate();
+    }
+
+    /// Take the handshake as far as the upstream socket allows.
+    void negotiate() {
+        Handshake::Status status;
+        try {
+            status = negotiation->advance(proxySocketFd);
+        } catch (const TargetRefused&) {
+            upstream_succeeded();
+            throw;
+        } catch (const std::exception& e) {
+            if (!retry_negotiation(e.what()) && !fail_over(e.what())) {
+                throw;
+            }
+            return;
+        }
+        uint32_t wantedProxyEvents;
+        switch (status) {
+        case Handshake::Status::WANT_READ:
+            wantedProxyEvents = uint32_t(EPOLLIN);
+            break;
+        case Handshake::Status::WANT_WRITE:
+            wantedProxyEvents = uint32_t(EPOLLOUT);
+            break;
+        default:
+            loop->cancel(negotiationTimer);
+            begin_relay();
+            return;
+        }
+        if (wantedProxyEvents != proxyEvents) {
+            proxyEvents = wantedProxyEvents;
+            loop->modify(proxySocketFd, proxyEvents);
+        }
+    }
+
+    /// Start again on a fresh upstream connection, if the pooled one went
+    /// stale before the proxy had said anything or the handshake has a
+    /// fallback.
+    bool retry_negotiation(const char* reason) {
+        bool stale = pooledUpstream && !(negotiation && negotiation->replied());
+        if (!stale && state != State::NEGOTIATING) {
+            return false;
+        }
+        std::unique_ptr<Handshake> retry;
+        if (stale) {
+            pooledUpstream = false;
+            // If there's no negotiation yet, connected() will set one up.
+            retry = renegotiation(negotiation);
+        } else {
+            retry = negotiation->fallback();
+            if (!retry) {
+                return false;
+            }
+        }
+        log_retry(reason);
+        negotiation = std::move(retry);
+        reconnect();
+        return true;
+    }
+
+    /// Give up on the upstream proxy, and start again with another if
+    /// there's one left to try.
+    bool fail_over(const char* reason) {
+        if (!upstream_failed()) {
+            return false;
+        }
+        log_retry(reason);
+        pooledUpstream = false;
+        negotiation = renegotiation(negotiation);
+        choose_upstream();
+        reconnect();
+        return true;
+    }
+
+    void reconnect() {
+        loop->cancel(negotiationTimer);
+        loop->remove(proxySocketFd);
+        close(proxySocketFd);
+        proxySocketFd = -1;
+        connect_upstream();
+    }
+
+    void begin_relay() {
+        upstream_succeeded();
+        tunnel_up();
+        state = State::RELAYING;
+        if (relayRing != nullptr) {
+            begin_ring_relay();
+            return;
+        }
+        open_channels(proxySocketFd);
+        clientEvents = EPOLLIN;
+        loop->add(clientSocketFd, clientEvents, this);
+        update_events();
+    }
+
+    /// Hand both sockets over to a UringRelay, which calls finish() once
+    /// it's through with them.
+    void begin_ring_relay() {
+        loop->remove(proxySocketFd);
+        // The ring waits for readiness itself.
+        if (!set_nonblocking(clientSocketFd, false) || !set_nonblocking(proxySocketFd, false)) {
+            throw std::runtime_error("could not configure sockets for relay");
+        }
+        std::string surplus;
+        std::string earlyData;
+        if (negotiation) {
+            surplus = negotiation->surplus();
+            earlyData = negotiation->unsent_early_data();
+            negotiation.reset();
+        }
+        ringRelay.reset(new UringRelay(*relayRing, clientSocketFd, proxySocketFd,
+                                       settings->relayEngine == ProxySettings::RelayEngine::SPLICE,
+                                       [this](bool toProxy) {
+                                           Log::tunnel(LogLevel::INFO, toProxy ? "CliHUP  " : "ProHUP  ", clientAddress, targetAddress);
+                                       },
+                                       [this] {
+                                           finish();
+                                       }));
+        ringRelay->start(surplus, earlyData);
+    }
+
+    void pump(int fd, uint32_t events) {
+        move_data(fd, events & (EPOLLIN | EPOLLHUP | EPOLLERR), events & (EPOLLOUT | EPOLLERR));
+        if (upstream.finished() && downstream.finished()) {
+            finish();
+        } else {
+            update_events();
+        }
+    }
+
+    void update_events() {
+        uint32_t wantedClientEvents =
+            (upstream.can_fill() ? uint32_t(EPOLLIN) : 0) | (downstream.pending() ? uint32_t(EPOLLOUT) : 0);
+        uint32_t wantedProxyEvents =
+            (downstream.can_fill() ? uint32_t(EPOLLIN) : 0) | (upstream.pending() ? uint32_t(EPOLLOUT) : 0);
+        if (wantedClientEvents != clientEvents) {
+            clientEvents = wantedClientEvents;
+            loop->modify(clientSocketFd, clientEvents);
+        }
+        if (wantedProxyEvents != proxyEvents) {
+            proxyEvents = wantedProxyEvents;
+            loop->modify(proxySocketFd, proxyEvents);
+        }
     }
 };
 
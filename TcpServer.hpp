@@ -1,21 +1,45 @@
 #ifndef HGUARD_TCP_SERVER
 #define HGUARD_TCP_SERVER
 
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
 #include "ProxySettings.hpp"
+#include "LiveSettings.hpp"
+#include "Handoff.hpp"
 #include "Proxy.hpp"
 #include "DirectTcpProxy.hpp"
 #include "HttpTcpProxy.hpp"
 #include "Socks4TcpProxy.hpp"
 #include "Socks5TcpProxy.hpp"
+#include "EventLoop.hpp"
+#include "UpstreamPool.hpp"
+#include "IoUring.hpp"
+#include "UringRelay.hpp"
+#include "Threads.hpp"
+
+#ifndef TCP_LISTEN_BACKLOG
+#define TCP_LISTEN_BACKLOG SOMAXCONN
+#endif
 
 class TcpServer {
 private:
-    ProxySettings proxySettings;
+    LiveSettings& liveSettings;
+    Handoff& handoff;
     int listenPort;
 
 public:
-    TcpServer(ProxySettings proxySettings, int listenPort):
-        proxySettings(proxySettings),
+    /// Serves with whatever liveSettings hold at the time for each new
+    /// tunnel, on listening sockets taken over by handoff if it has any.
+    TcpServer(LiveSettings& liveSettings, Handoff& handoff, int listenPort):
+        liveSettings(liveSettings),
+        handoff(handoff),
         listenPort(listenPort)
     {
     }
@@ -23,88 +47,481 @@ public:
     ~TcpServer() {
     }
 
-    static struct sockaddr_in get_client_address(int clientSocketFd) {
-        struct sockaddr_in clientAddress = {};
-        socklen_t clientAddressLength = sizeof(clientAddress); // ???
+    static Endpoint get_client_address(int clientSocketFd) {
+        SocketAddress clientAddress = {};
+        clientAddress.length = sizeof(clientAddress.v6);
         if (getpeername(clientSocketFd,
-                        (struct sockaddr*)&clientAddress,
-                        &clientAddressLength
+                        &clientAddress.generic,
+                        &clientAddress.length
                         ) < 0) {
-            close(clientSocketFd);
-            exit(1);
+            throw std::runtime_error("could not get client address");
         }
-        return clientAddress;
+        return Endpoint::from(clientAddress.get());
     }
-    static struct sockaddr_in get_target_address(int clientSocketFd) {
-        struct sockaddr_in targetAddress = {};
-        socklen_t targetAddressLength = sizeof(targetAddress); // ???
+    /// Where clientAddress was going before it was redirected to us. IPv4
+    /// clients (v4-mapped, on a dual-stack listener) went through iptables,
+    /// the rest through ip6tables, and each keeps its own record of it.
+    static Endpoint get_target_address(int clientSocketFd, const Endpoint& clientAddress) {
+        SocketAddress targetAddress = {};
+        targetAddress.length = sizeof(targetAddress.v6);
         if (getsockopt(clientSocketFd,
-                       SOL_IP,
-                       SO_ORIGINAL_DST,
-                       (struct sockaddr*)&targetAddress,
-                       &targetAddressLength
+                       clientAddress.is_v4() ? SOL_IP : SOL_IPV6,
+                       clientAddress.is_v4() ? SO_ORIGINAL_DST : IP6T_SO_ORIGINAL_DST,
+                       &targetAddress.generic,
+                       &targetAddress.length
                        ) < 0) {
 #ifdef ALLOW_DIRECT_CONNECTIONS
             // Useful for debugging.
+            targetAddress.length = sizeof(targetAddress.v6);
             if (getsockname(clientSocketFd,
-                            (struct sockaddr*)&targetAddress,
-                            &targetAddressLength
+                            &targetAddress.generic,
+                            &targetAddress.length
                             ) < 0) {
-                close(clientSocketFd);
-                exit(1);
+                throw std::runtime_error("could not get target address");
             }
 #else
-            close(clientSocketFd);
-            exit(1);
+            throw std::runtime_error("could not get original destination address");
 #endif
         }
-        return targetAddress;
+        return Endpoint::from(targetAddress.get());
+    }
+
+    /// How many listening sockets run() needs.
+    static size_t listeners_needed(const ProxySettings& settings) {
+        return settings.tcpEngine == ProxySettings::TcpEngine::FORK ? 1 : settings.workers;
     }
 
     void run() {
-        int listeningSocketFd(socket(AF_INET, SOCK_STREAM, 0));
+        ProxySettings::Shared settings = liveSettings.get();
+        switch (settings->tcpEngine) {
+        case ProxySettings::TcpEngine::FORK:
+            {
+                std::vector<int> listeningSocketFds = listeners();
+                int listeningSocketFd = listeningSocketFds[0];
+                Cleaner listeningSocketFdCleaner([listeningSocketFd] {
+                        close(listeningSocketFd);
+                    });
+                Log::message(LogLevel::INFO, "Listening on ", listenPort, " (", ProxySettings::engine_name(settings->tcpEngine), ")");
+                // Children are tunnels, so the handoff is left to wait
+                // for them.
+                handoff.offer(listeningSocketFds, false);
+                run_forking(listeningSocketFd);
+            }
+            break;
+        case ProxySettings::TcpEngine::EPOLL:
+        case ProxySettings::TcpEngine::URING:
+            run_workers();
+            break;
+        default:
+            throw std::runtime_error("unknown TCP engine");
+        }
+    }
+
+private:
+    /// An event loop with its own listening socket, serving tunnels
+    /// independently of any other workers.
+    class Worker : public EventHandler {
+    private:
+        TcpServer& server;
+        int listeningSocketFd;
+        EventLoop loop;
+        SettingsView settings;
+        std::shared_ptr<UpstreamPool> pool;
+
+    public:
+        Worker(TcpServer& server, int listeningSocketFd):
+            server(server),
+            listeningSocketFd(listeningSocketFd),
+            settings(server.liveSettings),
+            pool(server.new_pool(loop, settings.get()))
+        {
+            if (!set_nonblocking(listeningSocketFd, true)) {
+                throw std::runtime_error("could not make server socket non-blocking");
+            }
+            loop.add(listeningSocketFd, EPOLLIN, this);
+            if (server.handoff.stop_fd() >= 0) {
+                loop.add(server.handoff.stop_fd(), EPOLLIN, this);
+            }
+        }
+
+        void run() {
+            while (1) {
+                loop.run_once(-1);
+            }
+        }
+
+        void handle_event(int fd, uint32_t events) override {
+            (void)events;
+            if (fd == server.handoff.stop_fd()) {
+                // Taken over: the tunnels left carry on, but no more are
+                // accepted. Both fds stay open, for the other workers.
+                loop.remove(listeningSocketFd);
+                loop.remove(fd);
+                return;
+            }
+            if (settings.refresh()) {
+                pool = server.new_pool(loop, settings.get());
+            }
+            while (1) {
+                int acceptedSocketFd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (acceptedSocketFd < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        Log::message(LogLevel::ERROR, "Error during accept: ", strerror(errno));
+                    }
+                    return;
+                }
+                Metrics::count(Metric::ACCEPTS);
+                server.open_tunnel(settings.get(), loop, pool, nullptr, acceptedSocketFd);
+            }
+        }
+    };
+
+    /// A worker which accepts connections and relays tunnels through an
+    /// io_uring. Its event loop is left with connecting to and negotiating
+    /// with the upstream proxy, and the ring polls the loop, so that one
+    /// submit waits for everything.
+    ///
+    /// The ring may only be used by the thread which made it, so a worker
+    /// must be made by the thread which runs it.
+    class UringWorker : public UringHandler, public EventHandler {
+    private:
+        enum Tag : unsigned {
+            ACCEPT,
+            LOOP,
+        };
+
+        TcpServer& server;
+        int listeningSocketFd;
+        IoUring ring;
+        RelayRing relays;
+        EventLoop loop;
+        SettingsView settings;
+        std::shared_ptr<UpstreamPool> pool;
+        bool loopReady;
+        bool stopped;
+
+    public:
+        UringWorker(TcpServer& server, int listeningSocketFd):
+            server(server),
+            listeningSocketFd(listeningSocketFd),
+            relays(ring),
+            settings(server.liveSettings),
+            pool(server.new_pool(loop, settings.get())),
+            loopReady(false),
+            stopped(false)
+        {
+            if (server.handoff.stop_fd() >= 0) {
+                loop.add(server.handoff.stop_fd(), EPOLLIN, this);
+            }
+        }
+
+        void run() {
+            arm_accept();
+            arm_loop();
+            uint64_t nextTickMs = monotonic_ms() + EVENT_LOOP_TICK_MS;
+            while (1) {
+                ring.submit(1, EVENT_LOOP_TICK_MS);
+                ring.reap();
+                uint64_t nowMs = monotonic_ms();
+                if (loopReady || nowMs >= nextTickMs) {
+                    // Also catches up with the loop's timers.
+                    loop.run_once(0);
+                    nextTickMs = nowMs + EVENT_LOOP_TICK_MS;
+                    if (loopReady) {
+                        loopReady = false;
+                        arm_loop();
+                    }
+                } else {
+                    // Tunnels which finished in the ring
+                    loop.reap();
+                }
+            }
+        }
+
+        void handle_completion(unsigned tag, int32_t result, uint32_t flags) override {
+            if (tag == LOOP) {
+                loopReady = true;
+                return;
+            }
+            if (result >= 0) {
+                Metrics::count(Metric::ACCEPTS);
+                if (settings.refresh()) {
+                    pool = server.new_pool(loop, settings.get());
+                }
+                server.open_tunnel(settings.get(), loop, pool, &relays, result);
+            } else if (result != -EINTR && result != -EAGAIN && result != -ECONNABORTED && result != -ECANCELED) {
+                Log::message(LogLevel::ERROR, "Error during accept: ", strerror(-result));
+            }
+            if (!(flags & IORING_CQE_F_MORE) && !stopped) {
+                arm_accept();
+            }
+        }
+
+        /// Taken over: stop accepting, but carry on with the tunnels left.
+        void handle_event(int fd, uint32_t events) override {
+            (void)events;
+            loop.remove(fd);
+            stopped = true;
+            struct io_uring_sqe* sqe = ring.sqe(nullptr, 0);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            // Matched by the multishot accept's user_data.
+            sqe->addr = uint64_t(uintptr_t(static_cast<UringHandler*>(this))) | ACCEPT;
+        }
+
+    private:
+        /// Accept connections as they come, until the ring says otherwise.
+        void arm_accept() {
+            struct io_uring_sqe* sqe = ring.sqe(this, ACCEPT);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listeningSocketFd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        }
+
+        /// Wake up once the loop has events. One shot, as the loop's
+        /// readiness is only re-checked when a poll is armed.
+        void arm_loop() {
+            struct io_uring_sqe* sqe = ring.sqe(this, LOOP);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = loop.fd();
+            sqe->poll32_events = POLLIN;
+        }
+    };
+
+    /// Start driving a freshly accepted connection from a worker's event
+    /// loop (and, given one, ring).
+    void open_tunnel(const ProxySettings::Shared& settings, EventLoop& loop, const std::shared_ptr<UpstreamPool>& pool, RelayRing* ring,
+                     int acceptedSocketFd) {
+        TcpProxy* proxy;
+        try {
+            Endpoint connectedClientAddress = get_client_address(acceptedSocketFd);
+            Endpoint connectedServerAddress = get_target_address(acceptedSocketFd, connectedClientAddress);
+            settings->clientSocket.apply(acceptedSocketFd);
+
+            // Released by the proxy once it's done.
+            if (!settings->admission->admit_tunnel(connectedClientAddress)) {
+                close(acceptedSocketFd);
+                return;
+            }
+
+            Log::tunnel(LogLevel::INFO, "Connect ", connectedClientAddress, connectedServerAddress);
+
+            proxy = new_proxy(settings, connectedClientAddress, connectedServerAddress, acceptedSocketFd);
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            close(acceptedSocketFd);
+            return;
+        }
+
+        try {
+            proxy->use_ring(ring);
+            proxy->start(loop, pool);
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            proxy->finish();
+        }
+    }
+
+    /// A worker's pool of upstream connections for settings, if there's to
+    /// be one. It keeps hold of the settings.
+    static std::shared_ptr<UpstreamPool> new_pool(EventLoop& loop, const ProxySettings::Shared& settings) {
+        if (settings->upstreamPool <= 0) {
+            return nullptr;
+        }
+        return std::make_shared<UpstreamPool>(loop, *settings->upstreams, settings->upstreamSocket, settings->upstreamPool,
+                                              settings->upstreamPoolIdle * 1000,
+                                              [settings] {
+                                                  return new_preamble(*settings);
+                                              });
+    }
+
+    /// The listening sockets taken over, or else freshly bound ones.
+    std::vector<int> listeners() {
+        const ProxySettings& settings = *liveSettings.get();
+        size_t needed = listeners_needed(settings);
+        if (!handoff.listeners().empty()) {
+            // Kept as the old instance set them up.
+            return handoff.listeners();
+        }
+        std::vector<int> listeningSocketFds;
+        Cleaner listeningSocketFdsCleaner([&listeningSocketFds] {
+                for (int fd : listeningSocketFds) {
+                    close(fd);
+                }
+            });
+        for (size_t i = 0; i < needed; i++) {
+            listeningSocketFds.push_back(open_listener(settings, needed > 1));
+        }
+        listeningSocketFdsCleaner.disable();
+        return listeningSocketFds;
+    }
+
+    /// Open, bind and listen on the server socket.
+    ///
+    /// With reusePort, every worker can bind its own socket to the same
+    /// port, and the kernel spreads incoming connections between them.
+    int open_listener(const ProxySettings& settings, bool reusePort) {
+        int listeningSocketFd = open_dual_stack_socket(SOCK_STREAM);
         if (listeningSocketFd < 0) {
             throw std::runtime_error("could not open server socket");
         }
-        Cleaner listeningSocketFdCleaner([&listeningSocketFd] {
+        Cleaner listeningSocketFdCleaner([listeningSocketFd] {
                 close(listeningSocketFd);
             });
 
-        struct sockaddr_in serverAddress = {};
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_port = htons(listenPort);
-        serverAddress.sin_addr.s_addr = INADDR_ANY;
+        const int on = 1;
+        if (reusePort && setsockopt(listeningSocketFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set SO_REUSEPORT");
+        }
 
-        if (bind(listeningSocketFd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        settings.clientSocket.apply_listener(listeningSocketFd);
+
+        SocketAddress serverAddress = any_address(listeningSocketFd, listenPort);
+        if (bind(listeningSocketFd, serverAddress.get(), serverAddress.length) < 0) {
             throw std::runtime_error("could not bind to address and port");
         }
-        listen(listeningSocketFd, 5);
-        std::cerr << "Listening on " << listenPort << std::endl;
+        if (listen(listeningSocketFd, TCP_LISTEN_BACKLOG) < 0) {
+            throw std::runtime_error("could not listen on server socket");
+        }
+        listeningSocketFdCleaner.disable();
+        return listeningSocketFd;
+    }
+
+    static TcpProxy* new_proxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress,
+                               int clientSocketFd) {
+        switch (settings->proxyProtocol) {
+        case ProxySettings::ProxyProtocol::DIRECT:
+            return new DirectTcpProxy(settings, clientAddress, targetAddress, clientSocketFd);
+        case ProxySettings::ProxyProtocol::HTTP:
+            return new HttpTcpProxy(settings, clientAddress, targetAddress, clientSocketFd);
+        case ProxySettings::ProxyProtocol::SOCKS4:
+            return new Socks4TcpProxy(settings, clientAddress, targetAddress, clientSocketFd);
+        case ProxySettings::ProxyProtocol::SOCKS5:
+            return new Socks5TcpProxy(settings, clientAddress, targetAddress, clientSocketFd);
+        default:
+            throw std::runtime_error("Cannot make unknown proxy type");
+        }
+    }
+
+    /// What pooled upstream connections go through before they're ready
+    /// for a tunnel.
+    static std::unique_ptr<Handshake> new_preamble(const ProxySettings& settings) {
+        switch (settings.proxyProtocol) {
+        case ProxySettings::ProxyProtocol::SOCKS5:
+            return Socks5Handshake::greeting(settings);
+        default:
+            return nullptr;
+        }
+    }
+
+    void run_workers() {
+        // A peer going away mid-write must not take every tunnel with it.
+        signal(SIGPIPE, SIG_IGN);
+
+        // Bind everything up front so that failures are reported here
+        // rather than from inside a worker thread.
+        ProxySettings::Shared settings = liveSettings.get();
+        std::vector<int> listeningSocketFds = listeners();
+        Cleaner listeningSocketFdsCleaner([&listeningSocketFds] {
+                for (int fd : listeningSocketFds) {
+                    close(fd);
+                }
+            });
+        int workerCount = listeningSocketFds.size();
+        ProxySettings::TcpEngine engine = settings->tcpEngine;
+        if (engine == ProxySettings::TcpEngine::URING && !uring_available()) {
+            engine = ProxySettings::TcpEngine::EPOLL;
+        }
+        Log::message(LogLevel::INFO, "Listening on ", listenPort, " (", ProxySettings::engine_name(engine),
+                     ", ", workerCount, workerCount == 1 ? " worker)" : " workers)");
+
+        if (engine == ProxySettings::TcpEngine::URING) {
+            handoff.offer(listeningSocketFds);
+            run_threads(workerCount, settings->pinWorkers, [this, &listeningSocketFds](int i) {
+                    UringWorker worker(*this, listeningSocketFds[i]);
+                    worker.run();
+                });
+            return;
+        }
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (int fd : listeningSocketFds) {
+            workers.emplace_back(new Worker(*this, fd));
+        }
+        handoff.offer(listeningSocketFds);
+        run_threads(workerCount, settings->pinWorkers, [&workers](int i) {
+                workers[i]->run();
+            });
+    }
+
+    /// Whether this kernel has everything the io_uring engine needs. If
+    /// not, says why.
+    static bool uring_available() {
+        try {
+            IoUring ring(8);
+            UringBufferRing buffers(ring, 0, 1, 1);
+            return true;
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::WARN, "Falling back to epoll, as ", e.what());
+            return false;
+        }
+    }
 
-        signal(SIGCHLD, SIG_IGN);
+    void run_forking(int listeningSocketFd) {
+        // Each child is a tunnel, so children are counted by reaping them
+        // ourselves.
+        signal(SIGCHLD, SIG_DFL);
         pid_t parent_pid = getpid();
+        struct pollfd fds[2] = {{listeningSocketFd, POLLIN, 0}, {handoff.stop_fd(), POLLIN, 0}};
         while (1) {
-            struct sockaddr_in clientAddress = {};
-            socklen_t clientAddressLength = sizeof(clientAddress); // ???
+            // Wakes up now and then regardless, to reap children.
+            int ready = poll(fds, 2, 1000);
+            {
+                Admission& admission = *liveSettings.get()->admission;
+                while (waitpid(-1, nullptr, WNOHANG) > 0) {
+                    admission.tunnel_closed();
+                }
+            }
+            if (ready > 0 && fds[1].revents) {
+                drain_children();
+            }
+            if (ready <= 0 || !(fds[0].revents & POLLIN)) {
+                continue;
+            }
+            SocketAddress clientAddress = {};
+            clientAddress.length = sizeof(clientAddress.v6);
             int acceptedSocketFd = accept(listeningSocketFd,
-                                          (struct sockaddr*)&clientAddress,
-                                          &clientAddressLength);
+                                          &clientAddress.generic,
+                                          &clientAddress.length);
             if (acceptedSocketFd < 0) {
-                perror("error");
-                std::cerr << "Error during accept." << std::endl;
+                Log::message(LogLevel::ERROR, "Error during accept: ", strerror(errno));
+                continue;
+            }
+            Metrics::count(Metric::ACCEPTS);
+
+            // For this tunnel, whatever a reload does meanwhile.
+            ProxySettings::Shared proxySettings = liveSettings.get();
+            Admission& admission = *proxySettings->admission;
+            // Before forking, so that a client opening connections in a
+            // loop can't fork-bomb us.
+            if (!admission.admit_tunnel(Endpoint::from(clientAddress.get()))) {
+                close(acceptedSocketFd);
                 continue;
             }
 
             pid_t pid = fork();
             if (pid < 0) {
-                std::cerr << "Unable to fork new connection handler process! Aborting connection." << std::endl;
+                Log::message(LogLevel::ERROR, "Unable to fork new connection handler process! Aborting connection.");
+                admission.tunnel_closed();
                 close(acceptedSocketFd);
             }
             else if (pid == 0) {
                 // Child!
 
                 if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0) {
-                    std::cerr << "Could not tie lifetime to parent lifetime" << std::endl;
+                    Log::message(LogLevel::ERROR, "Could not tie lifetime to parent lifetime");
                     exit(1);
                 }
                 if (getppid() != parent_pid) {
@@ -114,47 +531,52 @@ public:
 
                 close(listeningSocketFd); // Child doesn't need this.
 
-                struct sockaddr_in connectedServerAddress = get_target_address(acceptedSocketFd);
-                struct sockaddr_in connectedClientAddress = get_client_address(acceptedSocketFd);
-
-                char clientHost[256] = {};
-                inet_ntop(AF_INET, &connectedClientAddress.sin_addr, clientHost, sizeof(clientHost));
+                Endpoint connectedServerAddress;
+                Endpoint connectedClientAddress;
+                try {
+                    connectedClientAddress = get_client_address(acceptedSocketFd);
+                    connectedServerAddress = get_target_address(acceptedSocketFd, connectedClientAddress);
+                    proxySettings->clientSocket.apply(acceptedSocketFd);
+                } catch (const std::exception&) {
+                    close(acceptedSocketFd);
+                    exit(1);
+                }
 
-                char connectHost[256] = {};
-                inet_ntop(AF_INET, &connectedServerAddress.sin_addr, connectHost, sizeof(connectHost));
-                int connectPort = ntohs(connectedServerAddress.sin_port);
-                std::cerr << getpid() << "\t" << "Connect " << clientHost << " -> " << connectHost << ":" << connectPort << std::endl;
+                Log::tunnel(LogLevel::INFO, "Connect ", connectedClientAddress, connectedServerAddress);
 
                 try {
-                    switch (proxySettings.proxyProtocol) {
-                    case ProxySettings::ProxyProtocol::DIRECT:
-                        DirectTcpProxy(proxySettings, connectedClientAddress, connectedServerAddress, acceptedSocketFd).run();
-                        break;
-                    case ProxySettings::ProxyProtocol::HTTP:
-                        HttpTcpProxy(proxySettings, connectedClientAddress, connectedServerAddress, acceptedSocketFd).run();
-                        break;
-                    case ProxySettings::ProxyProtocol::SOCKS4:
-                        Socks4TcpProxy(proxySettings, connectedClientAddress, connectedServerAddress, acceptedSocketFd).run();
-                        break;
-                    case ProxySettings::ProxyProtocol::SOCKS5:
-                        Socks5TcpProxy(proxySettings, connectedClientAddress, connectedServerAddress, acceptedSocketFd).run();
-                        break;
-                    default:
-                        throw std::runtime_error("Cannot make unknown proxy type");
-                    }
+                    std::unique_ptr<TcpProxy>(new_proxy(proxySettings, connectedClientAddress, connectedServerAddress, acceptedSocketFd))->run();
                 } catch (const std::exception& e) {
-                    std::cerr << getpid() << "\t" << "Error: " << e.what() << std::endl;
+                    Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
                 }
                 // Reset the connection (well, try)
-                connectedServerAddress.sin_family = AF_UNSPEC;
-                connect(acceptedSocketFd, (struct sockaddr*)&connectedServerAddress, sizeof(connectedServerAddress));
+                struct sockaddr_in resetAddress = {};
+                resetAddress.sin_family = AF_UNSPEC;
+                connect(acceptedSocketFd, (struct sockaddr*)&resetAddress, sizeof(resetAddress));
                 close(acceptedSocketFd);
-                std::cerr << getpid() << "\t" << "Close   " << clientHost << " -> " << connectHost << ":" << connectPort << std::endl;
+                Log::tunnel(LogLevel::INFO, "Close   ", connectedClientAddress, connectedServerAddress);
                 exit(0);
             } else {
                 close(acceptedSocketFd); // Parent doesn't need this (anymore).
+                // The child chose from our copy of the set, so make sure
+                // the next child doesn't choose the same way.
+                proxySettings->upstreams->skip_turn();
+            }
+        }
+    }
+
+    /// Taken over: wait for every child to finish (they'd die with us),
+    /// then leave the rest to the new instance.
+    void drain_children() {
+        Admission& admission = *liveSettings.get()->admission;
+        while (true) {
+            if (wait(nullptr) > 0) {
+                admission.tunnel_closed();
+            } else if (errno != EINTR) {
+                break;
             }
         }
+        Handoff::exit_drained();
     }
 };
 
@@ -0,0 +1,71 @@
+#ifndef HGUARD_THREADS
+#define HGUARD_THREADS
+
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <pthread.h>
+
+#include "Log.hpp"
+
+/// Pin the calling thread to one of the CPUs we're allowed to use, chosen
+/// round-robin by worker index.
+static void pin_to_cpu(int workerIndex) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        Log::message(LogLevel::WARN, "Could not get CPU affinity for worker ", workerIndex);
+        return;
+    }
+    int skip = workerIndex % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) != 0) {
+                Log::message(LogLevel::WARN, "Could not pin worker ", workerIndex, " to CPU ", cpu);
+            }
+            return;
+        }
+    }
+}
+
+/// worker(i), exiting (once it's logged why) if it throws: a server
+/// missing a worker isn't worth carrying on with.
+static void run_worker(int i, const std::function<void(int)>& worker) {
+    try {
+        worker(i);
+    } catch (const std::exception& e) {
+        Log::message(LogLevel::ERROR, "Error: worker ", i, ": ", e.what());
+        Log::flush();
+        exit(1);
+    }
+}
+
+/// Run worker(i) for each of count workers, each in a thread of its own
+/// (pinned to a CPU, if asked). The main thread is worker 0. Returns once
+/// every worker has.
+static void run_threads(int count, bool pin, const std::function<void(int)>& worker) {
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; i++) {
+        threads.emplace_back([i, pin, &worker] {
+                if (pin) {
+                    pin_to_cpu(i);
+                }
+                run_worker(i, worker);
+            });
+    }
+    if (pin) {
+        pin_to_cpu(0);
+    }
+    run_worker(0, worker);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef HGUARD_TIMER_WHEEL
+#define HGUARD_TIMER_WHEEL
+
+#include <cstdint>
+
+#include <time.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/// Embed in anything scheduled on a TimerWheel.
+struct TimerNode {
+    TimerNode* timerPrev = nullptr;
+    TimerNode* timerNext = nullptr;
+    uint64_t timerExpiry = 0;
+    bool timerArmed = false;
+};
+
+/// Hierarchical timing wheel counting in abstract ticks.
+///
+/// Level 0 has one slot per tick, and each level above has slots
+/// TIMER_WHEEL_SLOTS times as wide. A timer sits in the lowest level at
+/// which its expiry and the current tick agree on every higher digit, and
+/// drops down a level each time the slot it is in comes round. Scheduling
+/// and cancelling are O(1), and advancing is amortized O(1) per tick and
+/// per timer.
+///
+/// Timers further away than one revolution of the top level are parked
+/// in the slot just behind the current one and looked at again when it
+/// comes round, so any expiry works.
+///
+/// Nodes are not owned by the wheel.
+class TimerWheel {
+private:
+    uint64_t current;
+    size_t count;
+    /// Circular lists, each headed by a sentinel.
+    TimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    static size_t digit(uint64_t tick, int level) {
+        return (tick >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+    }
+
+    static void clear(TimerNode* list) {
+        list->timerPrev = list;
+        list->timerNext = list;
+    }
+
+    static void append(TimerNode* list, TimerNode* node) {
+        node->timerPrev = list->timerPrev;
+        node->timerNext = list;
+        list->timerPrev->timerNext = node;
+        list->timerPrev = node;
+    }
+
+    static void unlink(TimerNode* node) {
+        node->timerPrev->timerNext = node->timerNext;
+        node->timerNext->timerPrev = node->timerPrev;
+        node->timerPrev = nullptr;
+        node->timerNext = nullptr;
+    }
+
+    /// Move all of list's nodes onto the (empty) list into.
+    static void take(TimerNode* list, TimerNode* into) {
+        if (list->timerNext == list) {
+            clear(into);
+            return;
+        }
+        into->timerNext = list->timerNext;
+        into->timerPrev = list->timerPrev;
+        into->timerNext->timerPrev = into;
+        into->timerPrev->timerNext = into;
+        clear(list);
+    }
+
+    void link(TimerNode* node) {
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS
+               && (node->timerExpiry >> ((level + 1) * TIMER_WHEEL_BITS)) != (current >> ((level + 1) * TIMER_WHEEL_BITS))) {
+            level++;
+        }
+        size_t slot;
+        if (level == TIMER_WHEEL_LEVELS) {
+            // Expiry is in the next revolution of the top level (its slot
+            // comes round again first), or further away still.
+            level = TIMER_WHEEL_LEVELS - 1;
+            if (node->timerExpiry - current < (uint64_t(1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))) {
+                slot = digit(node->timerExpiry, level);
+            } else {
+                slot = (digit(current, level) + TIMER_WHEEL_SLOTS - 1) & (TIMER_WHEEL_SLOTS - 1);
+            }
+        } else {
+            slot = digit(node->timerExpiry, level);
+        }
+        append(&slots[level][slot], node);
+    }
+
+    /// Redistribute level's current slot over the levels below.
+    void cascade(int level) {
+        TimerNode pending;
+        take(&slots[level][digit(current, level)], &pending);
+        while (pending.timerNext != &pending) {
+            TimerNode* node = pending.timerNext;
+            unlink(node);
+            link(node);
+        }
+    }
+
+public:
+    TimerWheel(uint64_t start = 0):
+        current(start),
+        count(0)
+    {
+        for (auto& level : slots) {
+            for (TimerNode& slot : level) {
+                clear(&slot);
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const {
+        return current;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    /// Arm (or re-arm) node to fire at tick expiry. Expiries which have
+    /// already passed fire on the next advance().
+    void schedule(TimerNode* node, uint64_t expiry) {
+        cancel(node);
+        node->timerExpiry = expiry > current ? expiry : current + 1;
+        node->timerArmed = true;
+        link(node);
+        count++;
+    }
+
+    void cancel(TimerNode* node) {
+        if (node->timerArmed) {
+            unlink(node);
+            node->timerArmed = false;
+            count--;
+        }
+    }
+
+    /// Move time forward to tick, calling expire(node) for each timer
+    /// which comes due. The callback may schedule or cancel any timer.
+    template <typename Callback>
+    void advance(uint64_t tick, Callback expire) {
+        while (current < tick) {
+            if (count == 0) {
+                current = tick;
+                break;
+            }
+            current++;
+            // Higher levels first, as they may refill the slots below.
+            int top = 0;
+            while (top + 1 < TIMER_WHEEL_LEVELS && digit(current, top) == 0) {
+                top++;
+            }
+            for (int level = top; level > 0; level--) {
+                cascade(level);
+            }
+            TimerNode due;
+            take(&slots[0][digit(current, 0)], &due);
+            while (due.timerNext != &due) {
+                TimerNode* node = due.timerNext;
+                unlink(node);
+                node->timerArmed = false;
+                count--;
+                expire(node);
+            }
+        }
+    }
+};
+
+/// Milliseconds on the monotonic clock.
+static inline uint64_t monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+#endif
@@ -3,95 +3,140 @@
 
 #include <unistd.h>
 
+#include "Log.hpp"
+#include "Metrics.hpp"
 #include "Util.hpp"
 #include "ProxySettings.hpp"
 #include "Proxy.hpp"
+#include "ReplySocket.hpp"
+#include "EventLoop.hpp"
+#include "LruList.hpp"
+#include "TimerWheel.hpp"
 
 
 
-#ifndef UDP_PROXY_TIMEOUT
-#define UDP_PROXY_TIMEOUT 300
-#endif
+template <class P>
+class UdpShard;
+
+
+
+/// Client and target address:port, identifying an association.
+struct AssociationKey {
+    Endpoint client;
+    Endpoint target;
 
-class UdpServer;
+    AssociationKey() {
+    }
+
+    AssociationKey(const Endpoint& client, const Endpoint& target):
+        client(client),
+        target(target)
+    {
+    }
+
+    bool operator==(const AssociationKey& other) const {
+        return client == other.client && target == other.target;
+    }
+};
+
+struct AssociationKeyHash {
+    size_t operator()(const AssociationKey& key) const {
+        return key.client.hash() ^ (key.target.hash() * 0x9e3779b97f4a7c15ULL);
+    }
+};
 
 
 
-class UdpProxy : public virtual Proxy {
-    friend class UdpServer;
+/// What every kind of association has in common. The kinds themselves
+/// (DirectUdpProxy, Socks5UdpProxy) are final, and each is served by a
+/// UdpShard of its own kind, so nothing on the way of a datagram is
+/// virtual.
+///
+/// Besides a constructor taking (settings, clientAddress, targetAddress,
+/// Context&), a kind has:
+///  - Context: whatever its associations on a shard share, made once by
+///    make_context(settings, loop, lose), where lose(proxy) must get rid
+///    of an association which can't go on
+///  - add_to(loop) and remove_from(loop), for its sockets
+///  - send_to_target(buffer, len), which may hold on to buffer (without
+///    copying it) until the next flush(), and flush()
+class UdpProxy : public Proxy, public LruNode, public TimerNode {
+    template <class P>
+    friend class UdpShard;
 
 protected:
     short mappedPort;
-    time_t startTime;
-    time_t lastPacketTime;
+    /// Tick of the last datagram in either direction.
+    uint64_t lastActivity;
+    bool unflushed;
+    /// Where replies to the client are sent from, shared with any other
+    /// associations for the same target. Set up on first use.
+    ReplySocketCache* replySockets;
+    std::shared_ptr<ReplySocket> replySocket;
+    /// clientAddress, ready for sendto().
+    SocketAddress clientSocketAddress;
+    /// The list this proxy is on (owned by UdpShard), if any.
+    LruList* lru;
+    /// Clock and expiry timer (owned by UdpShard), if any.
+    TimerWheel* timers;
 
 public:
-    UdpProxy(ProxySettings settings, struct sockaddr_in clientAddress, struct sockaddr_in targetAddress):
-        Proxy(settings, clientAddress, targetAddress)
+    UdpProxy(const ProxySettings::Shared& settings, const Endpoint& clientAddress, const Endpoint& targetAddress):
+        Proxy(settings, clientAddress, targetAddress),
+        clientSocketAddress(clientAddress.socket_address())
     {
-        startTime = time(nullptr);
-        lastPacketTime = startTime;
+        lastActivity = 0;
+        unflushed = false;
+        replySockets = nullptr;
+        lru = nullptr;
+        timers = nullptr;
+        Metrics::count(Metric::UDP_ASSOCIATIONS_OPENED);
     }
 
     virtual ~UdpProxy() {
-        std::cerr << "\t" << "DISASSOCIATED        " << clientHost << ":" << clientPort << " -- " << targetHost << ":" << targetPort << std::endl;
+        Metrics::count(Metric::UDP_ASSOCIATIONS_CLOSED);
+        Log::datagram(LogLevel::INFO, "DISASSOCIATED        ", clientAddress, " -- ", targetAddress);
+    }
+
+    AssociationKey key() const {
+        return AssociationKey(clientAddress, targetAddress);
     }
 
+    /// Note activity. The expiry timer isn't touched; it just finds out
+    /// when it fires.
     void update_time() {
-        lastPacketTime = time(nullptr);
+        if (timers) {
+            lastActivity = timers->now();
+        }
+        if (lru) {
+            lru->touch(this);
+        }
     }
 
     void send_to_client(char* buffer, size_t len) {
-        int sendFd = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sendFd < 0) {
-            std::cerr << "cannot open socket for sending to client" << std::endl;
-            return;
+        if (!replySocket) {
+            replySocket = replySockets->get(targetAddress);
         }
-        {
-            Cleaner sendFdCleaner([sendFd] {
-                                      close(sendFd);
-                                  });
-
-            const int on = 1;
-            if (setsockopt(sendFd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)) < 0) {
-                throw std::runtime_error("could not set IP_TRANSPARENT for sending to client");
-            }
-            if (bind(sendFd, (struct sockaddr*)&targetAddress, sizeof(targetAddress)) < 0) {
-                perror("bind failed sending to client");
-                std::cerr << "\t" << "failed bind: " << targetHost << ":" << targetPort << std::endl;
-                throw std::runtime_error("could not bind to address and port for sending to client");
-            }
-
-            if (sendto(sendFd, buffer, len, 0, (struct sockaddr*)&clientAddress, sizeof(clientAddress)) != (ssize_t)len) {
-                perror("sento failed sending to client");
-                std::cerr << "sendto failed sending to client" << std::endl;
-                return;
-            }
+        if (sendto(replySocket->get_fd(), buffer, len, 0, clientSocketAddress.get(), clientSocketAddress.length) != (ssize_t)len) {
+            static thread_local LogSampler failures;
+            log_datagram(LogLevel::WARN, failures, "FAILED SEND DGRAM   ", " <- ");
+            return;
         }
 
-        std::cerr << "\t" << "SEND    DOWN DGRAM   " << clientHost << ":" << clientPort << " <- " << targetHost << ":" << targetPort << std::endl;
+        Metrics::count(Metric::DATAGRAMS_DOWNSTREAM);
+        static thread_local LogSampler sends;
+        log_datagram(LogLevel::DEBUG, sends, "SEND    DOWN DGRAM   ", " <- ");
 
         update_time();
     }
 
-    virtual void send_to_target(const char* buffer, size_t len) = 0;
-
-    virtual void check_socket(int fd) = 0;
-
-    virtual std::vector<int> get_incoming_sockets() = 0;
-
-    virtual int eviction_score() {
-        int activityBias = lastPacketTime - startTime;
-        if (activityBias > 10) {
-            activityBias = 10;
+protected:
+    /// Log something which happens to (almost) every datagram, if sampler
+    /// lets it through.
+    void log_datagram(LogLevel level, LogSampler& sampler, const char* label, const char* arrow) const {
+        if (Log::sampled(level, sampler)) {
+            Log::datagram(level, label, clientAddress, arrow, targetAddress);
         }
-        time_t timeNow = time(nullptr);
-        return timeNow - lastPacketTime - activityBias;
-    }
-
-    virtual bool timed_out() {
-        time_t timeNow = time(nullptr);
-        return (timeNow - lastPacketTime) > UDP_PROXY_TIMEOUT;
     }
 };
 
@@ -1,172 +1,484 @@
 #ifndef HGUARD_UDP_SERVER
 #define HGUARD_UDP_SERVER
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 #include <unistd.h>
 
+#include "Log.hpp"
+#include "Metrics.hpp"
 #include "ProxySettings.hpp"
+#include "LiveSettings.hpp"
+#include "Handoff.hpp"
 #include "Proxy.hpp"
+#include "EventLoop.hpp"
+#include "FlatHashMap.hpp"
+#include "LruList.hpp"
+#include "TimerWheel.hpp"
 #include "UdpProxy.hpp"
 #include "DirectUdpProxy.hpp"
 #include "Socks5UdpProxy.hpp"
+#include "Threads.hpp"
 
 
 
-#define UDP_PROXY_LIMIT 256
+/// Resolution of association expiry.
+#define UDP_TIMER_TICK_MS 1000
 
+/// Datagrams picked up from the TPROXY socket per recvmmsg() call.
+#ifndef UDP_RECV_BATCH
+#define UDP_RECV_BATCH 32
+#endif
+#define UDP_RECV_BUFFER_SIZE 65536
+#define UDP_RECV_CONTROL_SIZE 128
 
+/// Associations looked at, least recently active first, for one belonging
+/// to a client with more than its share.
+#ifndef UDP_EVICTION_SCAN
+#define UDP_EVICTION_SCAN 64
+#endif
 
-class UdpServer {
-private:
-    ProxySettings proxySettings;
-    int bindPort;
 
-    /// Maps internal address:port and external address:port to re-mapped port.
-    /// E.g.:
-    ///  <192.168.1.123, 55555, 8.8.8.8, 53>, 44444
-    ///  for a NAT-ing of
-    ///  192.168.1.123:55555 <-> "8.8.8.8:53"/proxy:44444 <-> 8.8.8.8:53
-    std::map<std::tuple<unsigned long, short, unsigned long, short>, short> toMappedPort;
-    /// Maps external address:port and re-mapped port to internal address:port.
-    /// E.g.:
-    ///  <8.8.8.8, 53, 44444>, <192.168.1.123, 55555>
-    ///  for a NAT-ing of
-    ///  192.168.1.123:55555 <-> "8.8.8.8:53"/proxy:44444 <-> 8.8.8.8:53
-    std::map<std::tuple<unsigned long, short, short>, std::tuple<unsigned long, short>> fromMappedPort;
+
+/// One shard of the UDP server, with its own TPROXY socket, event loop and
+/// associations (and everything they use: reply sockets and SOCKS5
+/// sessions), so that nothing on the way of a datagram is shared with
+/// other shards. Runs in a thread of its own.
+///
+/// A shard serves one kind P of UdpProxy, so that every call it makes on
+/// the way of a datagram goes straight to P's (final) methods, and
+/// associations are held by plain pointer.
+///
+/// New associations get whatever settings are live when they're made.
+/// Each settings in use has its own P::Context, kept until the last
+/// association with them has gone.
+template <class P>
+class UdpShard : public EventHandler {
+private:
+    SettingsView proxySettings;
+    Handoff& handoff;
+    int bindSocketFd;
+    size_t proxyLimit;
+
+    /// Must outlive every proxy.
+    ReplySocketCache replySockets;
+
+    EventLoop loop;
+
+    /// Settings in use, and what's shared by every proxy with them (e.g.
+    /// upstream sessions for Socks5UdpProxies), which must outlive those
+    /// proxies.
+    struct Generation {
+        ProxySettings::Shared settings;
+        std::unique_ptr<typename P::Context> context;
+        size_t proxies;
+    };
+    /// The last is for new proxies.
+    std::vector<std::unique_ptr<Generation>> generations;
 
     /// Maps internal address:port and external address:port to proxy.
     /// E.g.:
     ///  <192.168.1.123, 55555, 8.8.8.8, 53>, proxy_44444
     ///  for a NAT-ing of
     ///  192.168.1.123:55555 <-> "8.8.8.8:53"/proxy:44444 <-> 8.8.8.8:53
-    std::map<std::tuple<unsigned long, short, unsigned long, short>, std::shared_ptr<UdpProxy>> proxies;
-
+    FlatHashMap<AssociationKey, P*, AssociationKeyHash> proxies;
+
+    /// Every proxy, most recently active first.
+    LruList lru;
+
+    /// How many proxies each client address has.
+    FlatHashMap<Endpoint, size_t, EndpointHash> clientProxies;
+
+    /// Expiry timers for every proxy, ticking every UDP_TIMER_TICK_MS.
+    TimerWheel timers;
+    uint64_t timeoutTicks;
+
+    /// Proxies sent to during the current ingress batch.
+    std::vector<P*> unflushedProxies;
+
+    // Preallocated receive slots, so that a single recvmmsg() can pick
+    // up a whole burst of datagrams.
+    std::vector<char> buffers;
+    std::vector<char> controlBuffers;
+    std::vector<SocketAddress> clientAddresses;
+    std::vector<struct iovec> iovs;
+    std::vector<struct mmsghdr> messages;
+
+    /// Evict a proxy to make room for one of client's: the least recently
+    /// active of those belonging to clients with at least their share of
+    /// the limit, so that a client churning through associations can only
+    /// take room from the others down to their share. (Failing that, in
+    /// the last UDP_EVICTION_SCAN, the least recently active of all.)
+    void evict_proxy(const Endpoint& client) {
+        LruNode* victim = lru.back();
+        if (victim == nullptr) {
+            return;
+        }
+        // The newcomer counts as one of the clients.
+        size_t clients = clientProxies.size() + (clientProxies.find(client.host()) == nullptr ? 1 : 0);
+        size_t share = (proxyLimit + clients - 1) / clients;
+        LruNode* node = victim;
+        for (size_t i = 0; node != nullptr && i < UDP_EVICTION_SCAN; i++, node = node->lruPrev) {
+            size_t* count = clientProxies.find(static_cast<P*>(node)->clientAddress.host());
+            if (count != nullptr && *count >= share) {
+                victim = node;
+                break;
+            }
+        }
+        Metrics::count(Metric::UDP_EVICTIONS);
+        delete_proxy(static_cast<P*>(victim));
+    }
 
-    std::map<short, int> portToSocket;
-    std::map<int, std::shared_ptr<UdpProxy>> socketToProxy;
+    /// Catch the timers up with the clock, dropping idle proxies.
+    void expire_proxies() {
+        timers.advance(monotonic_ms() / UDP_TIMER_TICK_MS, [this](TimerNode* node) {
+                P* proxy = static_cast<P*>(node);
+                uint64_t deadline = proxy->lastActivity + timeoutTicks;
+                if (deadline <= timers.now()) {
+                    delete_proxy(proxy);
+                } else {
+                    // Active since the timer was set.
+                    timers.schedule(proxy, deadline);
+                }
+            });
+    }
 
-    std::shared_ptr<UdpProxy> evict_proxy() {
-        int score = INT_MIN;
-        std::shared_ptr<UdpProxy> victim;
-        for (auto it = proxies.begin(); it != proxies.end(); it++) {
-            const std::shared_ptr<UdpProxy>& proxy = it->second;
-            int thisScore = proxy->eviction_score();
-            if (thisScore > score) {
-                score = thisScore;
-                victim = proxy;
-            }
+    void delete_proxy(P* proxy) {
+        Endpoint client = proxy->clientAddress.host();
+        size_t* count = clientProxies.find(client);
+        if (count != nullptr && --*count == 0) {
+            clientProxies.erase(client);
         }
-        if (victim) {
-            delete_proxy(victim);
+        lru.remove(proxy);
+        proxy->lru = nullptr;
+        timers.cancel(proxy);
+        proxy->remove_from(loop);
+        if (proxy->unflushed) {
+            // Evicted by a later datagram of the batch, or lost by the
+            // upstream. What it has queued still goes, as that would have
+            // been sent before whatever got rid of it.
+            try {
+                proxy->flush();
+            } catch (const std::exception& e) {
+                Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
+            }
+            unflushedProxies.erase(std::find(unflushedProxies.begin(), unflushedProxies.end(), proxy));
         }
-        return victim;
+        proxies.erase(proxy->key());
+        generation_of(proxy).proxies--;
+        delete proxy;
     }
 
-    int clean_proxies() {
-        int count = 0;
-        for (auto it = proxies.begin(); it != proxies.end(); it++) {
-            const std::shared_ptr<UdpProxy>& proxy = it->second;
-            if (proxy->timed_out()) {
-                count++;
-                delete_proxy(proxy);
+    Generation& generation_of(P* proxy) {
+        for (auto& generation : generations) {
+            if (generation->settings == proxy->settings) {
+                return *generation;
             }
         }
-        return count;
+        throw std::logic_error("UDP association with unknown settings");
     }
 
-    void delete_proxy(std::shared_ptr<UdpProxy> proxy) {
-        std::tuple<unsigned long, short, unsigned long, short> key = std::make_tuple<unsigned long, short, unsigned long, short>(proxy->clientAddress.sin_addr.s_addr, proxy->clientAddress.sin_port, proxy->targetAddress.sin_addr.s_addr, proxy->targetAddress.sin_port);
-
-        proxies.erase(key);
-
-        for (const int& socket : proxy->get_incoming_sockets()) {
-            socketToProxy.erase(socket);
-        }
+    /// Start using the live settings for new proxies.
+    void new_generation() {
+        std::unique_ptr<Generation> generation(new Generation());
+        generation->settings = proxySettings.get();
+        generation->context.reset(P::make_context(generation->settings, loop, [this](P* proxy) {
+                    delete_proxy(proxy);
+                }));
+        generation->proxies = 0;
+        generations.push_back(std::move(generation));
     }
 
-    std::shared_ptr<UdpProxy> new_proxy(struct sockaddr_in clientAddress, struct sockaddr_in targetAddress) {
-        std::shared_ptr<UdpProxy> proxy;
+    /// Drop the contexts of settings which no proxy uses any more. Not
+    /// from inside a context's callbacks.
+    void retire_generations() {
+        generations.erase(std::remove_if(generations.begin(), generations.end() - 1, [](const std::unique_ptr<Generation>& generation) {
+                    return generation->proxies == 0;
+                }), generations.end() - 1);
+    }
 
-        if (proxies.size() >= UDP_PROXY_LIMIT) {
-            evict_proxy();
+    P* new_proxy(const Endpoint& clientAddress, const Endpoint& targetAddress) {
+        if (proxies.size() >= proxyLimit) {
+            evict_proxy(clientAddress);
         }
 
-        switch (proxySettings.proxyProtocol) {
-        case ProxySettings::ProxyProtocol::DIRECT:
-            proxy = std::make_shared<DirectUdpProxy>(proxySettings, clientAddress, targetAddress);
-            break;
-        case ProxySettings::ProxyProtocol::SOCKS5:
-            proxy = std::make_shared<Socks5UdpProxy>(proxySettings, clientAddress, targetAddress);
-            break;
-        default:
-            throw std::runtime_error("invalid proxy protocol");
+        Generation& generation = *generations.back();
+        P* proxy = new P(generation.settings, clientAddress, targetAddress, *generation.context);
+        proxy->replySockets = &replySockets;
+        try {
+            proxy->add_to(loop);
+        } catch (...) {
+            delete proxy;
+            throw;
         }
 
-        std::tuple<unsigned long, unsigned short, unsigned long, unsigned short> index = std::make_tuple(clientAddress.sin_addr.s_addr, clientAddress.sin_port, targetAddress.sin_addr.s_addr, targetAddress.sin_port);
-        proxies.emplace(index, proxy);
-
-        for (const int& socket : proxy->get_incoming_sockets()) {
-            socketToProxy.emplace(socket, proxy);
+        proxies.insert(proxy->key(), proxy);
+        generation.proxies++;
+        size_t* count = clientProxies.find(clientAddress.host());
+        if (count != nullptr) {
+            ++*count;
+        } else {
+            clientProxies.insert(clientAddress.host(), 1);
         }
+        lru.push_front(proxy);
+        proxy->lru = &lru;
+        proxy->timers = &timers;
+        proxy->lastActivity = timers.now();
+        timers.schedule(proxy, timers.now() + timeoutTicks);
 
         return proxy;
     }
 
-    void send(sockaddr_in source, sockaddr_in destination, char* data, size_t len) {
-        std::tuple<unsigned long, short, unsigned long, short> index = std::make_tuple(source.sin_addr.s_addr, source.sin_port, destination.sin_addr.s_addr, destination.sin_port);
-
-        auto lookup = proxies.find(index);
-        std::shared_ptr<UdpProxy> proxy;
+    void send(const Endpoint& source, const Endpoint& destination, char* data, size_t len) {
+        P** lookup = proxies.find(AssociationKey(source, destination));
+        P* proxy;
         try {
-            if (lookup == proxies.end()) {
+            if (lookup == nullptr) {
+                if (!generations.back()->settings->admission->admit_association(source)) {
+                    return;
+                }
                 proxy = new_proxy(source, destination);
             } else {
-                proxy = lookup->second;
+                proxy = *lookup;
             }
 
             proxy->send_to_target(data, len);
+            proxy->update_time();
+            if (!proxy->unflushed) {
+                proxy->unflushed = true;
+                unflushedProxies.push_back(proxy);
+            }
         } catch (const std::exception& e) {
-            std::cerr << "\t" << "Error: " << e.what() << std::endl;
+            Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
         }
     }
 
-    void recv(int fd) {
-        // Dodge:
-        auto it = socketToProxy.find(fd);
-        if (it == socketToProxy.end()) {
-            throw std::runtime_error("attempt to use non-proxy socket");
+public:
+    /// Serves datagrams from bindSocketFd, keeping at most proxyLimit
+    /// associations.
+    UdpShard(const LiveSettings& liveSettings, Handoff& handoff, int bindSocketFd, size_t proxyLimit):
+        proxySettings(liveSettings),
+        handoff(handoff),
+        bindSocketFd(bindSocketFd),
+        proxyLimit(proxyLimit),
+        proxies(proxyLimit),
+        clientProxies(proxyLimit),
+        timers(monotonic_ms() / UDP_TIMER_TICK_MS),
+        timeoutTicks((uint64_t(proxySettings.get()->udpTimeout) * 1000 + UDP_TIMER_TICK_MS - 1) / UDP_TIMER_TICK_MS)
+    {
+    }
+
+    UdpShard(const UdpShard&) = delete;
+    UdpShard& operator=(const UdpShard&) = delete;
+
+    ~UdpShard() {
+        while (LruNode* node = lru.back()) {
+            delete_proxy(static_cast<P*>(node));
         }
-        UdpProxy& proxy = *(it->second);
+    }
 
-        try {
-            proxy.check_socket(fd);
-        } catch (const std::exception& e) {
-            std::cerr << "\t" << "Error: " << e.what() << std::endl;
+    void run() {
+        buffers.resize(UDP_RECV_BATCH * UDP_RECV_BUFFER_SIZE);
+        controlBuffers.resize(UDP_RECV_BATCH * UDP_RECV_CONTROL_SIZE);
+        clientAddresses.resize(UDP_RECV_BATCH);
+        iovs.resize(UDP_RECV_BATCH);
+        messages.resize(UDP_RECV_BATCH);
+        for (size_t i = 0; i < UDP_RECV_BATCH; i++) {
+            iovs[i].iov_base = &buffers[i * UDP_RECV_BUFFER_SIZE];
+            iovs[i].iov_len = UDP_RECV_BUFFER_SIZE;
+            struct msghdr& message = messages[i].msg_hdr;
+            message = {};
+            message.msg_name = &clientAddresses[i].generic;
+            message.msg_iov = &iovs[i];
+            message.msg_iovlen = 1;
+            message.msg_control = &controlBuffers[i * UDP_RECV_CONTROL_SIZE];
+        }
+
+        new_generation();
+
+        loop.add(bindSocketFd, EPOLLIN, this);
+        if (handoff.stop_fd() >= 0) {
+            loop.add(handoff.stop_fd(), EPOLLIN, this);
+        }
+
+        while (1) {
+            loop.run_once(UDP_TIMER_TICK_MS);
+            expire_proxies();
+            if (proxySettings.refresh()) {
+                new_generation();
+            }
+            retire_generations();
+        }
+    }
+
+    /// The TPROXY socket is readable (or, once taken over, the handoff's
+    /// stop_fd(): the associations left carry on until they expire, but
+    /// no datagrams are taken from the TPROXY socket any more).
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        if (fd == handoff.stop_fd()) {
+            loop.remove(bindSocketFd);
+            loop.remove(fd);
+            return;
+        }
+        for (size_t i = 0; i < UDP_RECV_BATCH; i++) {
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+            messages[i].msg_hdr.msg_controllen = UDP_RECV_CONTROL_SIZE;
+        }
+        int count = recvmmsg(fd, messages.data(), UDP_RECV_BATCH, MSG_DONTWAIT, nullptr);
+
+        if (count <= 0) {
+            if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                Log::message(LogLevel::ERROR, "Error during recvmmsg: ", strerror(errno));
+            }
+            return;
         }
+
+        for (int i = 0; i < count; i++) {
+            receive_from_client(messages[i].msg_hdr, messages[i].msg_len);
+        }
+        // Proxies may still refer to the receive buffers, so this must
+        // happen before they are reused.
+        flush_proxies();
+    }
+
+private:
+    void flush_proxies() {
+        for (P* proxy : unflushedProxies) {
+            proxy->unflushed = false;
+            try {
+                proxy->flush();
+            } catch (const std::exception& e) {
+                Log::message(LogLevel::ERROR, "\t", "Error: ", e.what());
+            }
+        }
+        unflushedProxies.clear();
+    }
+
+    /// Handle one datagram picked up by the TPROXY socket.
+    void receive_from_client(struct msghdr& message, size_t len) {
+        Endpoint clientAddress = Endpoint::from((const struct sockaddr*)message.msg_name);
+        Endpoint targetAddress = Endpoint::unspecified(clientAddress.family());
+
+        // IPv4 datagrams (v4-mapped, on a dual-stack socket) come with
+        // IP_ORIGDSTADDR, IPv6 ones with IPV6_ORIGDSTADDR.
+        struct cmsghdr *cmsg;
+        bool gotOrigAddr = false;
+        for (cmsg = CMSG_FIRSTHDR(&message); cmsg;
+             cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_ORIGDSTADDR) {
+                struct sockaddr_in original;
+                std::memcpy(&original, CMSG_DATA(cmsg), sizeof(original));
+                targetAddress = Endpoint(original);
+                gotOrigAddr = true;
+            } else if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_ORIGDSTADDR) {
+                struct sockaddr_in6 original;
+                std::memcpy(&original, CMSG_DATA(cmsg), sizeof(original));
+                targetAddress = Endpoint(original);
+                gotOrigAddr = true;
+            }
+        }
+        if (!gotOrigAddr) {
+            Log::message(LogLevel::DEBUG, "Got direct datagram.");
+        }
+
+        Metrics::count(Metric::DATAGRAMS_UPSTREAM);
+        static thread_local LogSampler receives;
+        if (Log::sampled(LogLevel::DEBUG, receives)) {
+            Log::datagram(LogLevel::DEBUG, "RECEIVE UP   DGRAM   ", clientAddress, " -> ", targetAddress);
+        }
+
+        send(clientAddress, targetAddress, (char*)message.msg_iov->iov_base, len);
     }
+};
+
+/// Receives TPROXY-redirected datagrams on a port, spread over
+/// ProxySettings::workers UdpShards.
+///
+/// Each shard binds its own socket to the port with SO_REUSEPORT. The
+/// kernel picks the socket for a datagram by a hash of its source and
+/// (original) destination addresses and ports, so every datagram of a flow
+/// lands on the same shard, which is the only one to know of its
+/// association.
+class UdpServer {
+private:
+    LiveSettings& liveSettings;
+    Handoff& handoff;
+    int bindPort;
 
 public:
-    UdpServer(ProxySettings proxySettings, int bindPort):
-        proxySettings(proxySettings),
+    /// Serves with whatever liveSettings hold at the time for each new
+    /// association (bar the timeout and limit, which are kept from the
+    /// start), on TPROXY sockets taken over by handoff if it has any.
+    UdpServer(LiveSettings& liveSettings, Handoff& handoff, int bindPort):
+        liveSettings(liveSettings),
+        handoff(handoff),
         bindPort(bindPort)
     {
     }
 
-    ~UdpServer() {
+    void run() {
+        ProxySettings::Shared proxySettings = liveSettings.get();
+        // Bind everything up front so that failures are reported here
+        // rather than from inside a shard's thread.
+        std::vector<int> bindSocketFds = handoff.listeners();
+        Cleaner bindSocketFdsCleaner([&bindSocketFds] {
+                for (int fd : bindSocketFds) {
+                    close(fd);
+                }
+            });
+        if (bindSocketFds.empty()) {
+            for (int i = 0; i < proxySettings->workers; i++) {
+                bindSocketFds.push_back(open_socket(proxySettings->workers > 1));
+            }
+        }
+        int shardCount = int(bindSocketFds.size());
+        Log::message(LogLevel::INFO, "Bound on ", bindPort, " (", shardCount, shardCount == 1 ? " shard)" : " shards)");
+        if (proxySettings->proxyProtocol == ProxySettings::ProxyProtocol::SOCKS5) {
+            Log::message(LogLevel::INFO, "Warming ", proxySettings->udpSessionPool, " SOCKS5 UDP sessions",
+                         shardCount == 1 ? "" : " per shard");
+        }
+
+        handoff.offer(bindSocketFds);
+        switch (proxySettings->proxyProtocol) {
+        case ProxySettings::ProxyProtocol::DIRECT:
+            run_shards<DirectUdpProxy>(bindSocketFds);
+            break;
+        case ProxySettings::ProxyProtocol::SOCKS5:
+            run_shards<Socks5UdpProxy>(bindSocketFds);
+            break;
+        default:
+            throw std::runtime_error("invalid proxy protocol");
+        }
+    }
+
+private:
+    template <class P>
+    void run_shards(const std::vector<int>& bindSocketFds) {
+        ProxySettings::Shared proxySettings = liveSettings.get();
+        int shardCount = int(bindSocketFds.size());
+        // The association limit is for the whole server.
+        size_t proxyLimit = (size_t(proxySettings->udpProxyLimit) + shardCount - 1) / shardCount;
+        run_threads(shardCount, proxySettings->pinWorkers, [this, &bindSocketFds, proxyLimit](int i) {
+                UdpShard<P>(liveSettings, handoff, bindSocketFds[i], proxyLimit).run();
+            });
     }
 
-    void run() {
-        int bindSocketFd(socket(AF_INET, SOCK_DGRAM, 0));
+    /// A TPROXY socket bound to the port, for both IPv4 and IPv6 where
+    /// there's IPv6. With reusePort, every shard can have one.
+    int open_socket(bool reusePort) {
+        int bindSocketFd = open_dual_stack_socket(SOCK_DGRAM);
         if (bindSocketFd < 0) {
             throw std::runtime_error("could not open server socket");
         }
-        Cleaner bindSocketFdCleaner([&bindSocketFd] {
+        Cleaner bindSocketFdCleaner([bindSocketFd] {
                 close(bindSocketFd);
             });
 
-        struct sockaddr_in serverAddress = {};
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_port = htons(bindPort);
-        serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+        SocketAddress serverAddress = any_address(bindSocketFd, bindPort);
+        bool dualStack = serverAddress.generic.sa_family == AF_INET6;
 
         const int on = 1;
 
@@ -176,82 +488,26 @@ public:
         if (setsockopt(bindSocketFd, IPPROTO_IP, IP_RECVORIGDSTADDR, &on, sizeof(on)) < 0) {
             throw std::runtime_error("could not set IP_RECVORIGDSTADDR");
         }
-
-        if (bind(bindSocketFd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
-            throw std::runtime_error("could not bind to address and port");
+        if (dualStack && setsockopt(bindSocketFd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set IPV6_TRANSPARENT");
+        }
+        if (dualStack && setsockopt(bindSocketFd, IPPROTO_IPV6, IPV6_RECVORIGDSTADDR, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set IPV6_RECVORIGDSTADDR");
+        }
+        // Lets reply sockets bind to target addresses which happen to be
+        // local with our port.
+        if (setsockopt(bindSocketFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set SO_REUSEADDR");
+        }
+        if (reusePort && setsockopt(bindSocketFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            throw std::runtime_error("could not set SO_REUSEPORT");
         }
-        std::cerr << "Bound on " << bindPort << std::endl;
-
-        char buffer[65536] = {};
-        char controlBuffer[512] = {};
-        struct sockaddr_in clientAddress = {};
-        struct sockaddr_in targetAddress = {};
-        struct iovec iov;
-        iov.iov_base = buffer;
-        iov.iov_len = sizeof(buffer);
-        struct msghdr message;
-        message.msg_name=&clientAddress;
-        message.msg_namelen=sizeof(clientAddress);
-        message.msg_iov=&iov;
-        message.msg_iovlen=1;
-        message.msg_control=controlBuffer;
-        message.msg_controllen=sizeof(controlBuffer);
-
-        while (1) {
-            std::vector<struct pollfd> fds;
-            fds.push_back({bindSocketFd, POLLIN, 0});
-            for (const std::pair<int, std::shared_ptr<UdpProxy>>& p : socketToProxy) {
-                fds.push_back({p.first, POLLIN, 0});
-            }
-            if (poll(fds.data(), fds.size(), 1000) < 0) {
-                throw std::runtime_error("poll error whilst proxying");
-            }
-
-            for (size_t i = 1; i < fds.size(); i++) {
-                if (fds[i].revents & POLLIN) {
-                    recv(fds[i].fd);
-                }
-            }
-
-            if (fds[0].revents & POLLIN) {
-                int recv_len = recvmsg(bindSocketFd, &message, 0);
-
-                if (recv_len <= 0) {
-                    perror("error");
-                    std::cerr << "Error during recvfrom." << std::endl;
-                    continue;
-                }
-
-                struct cmsghdr *cmsg;
-                bool gotOrigAddr = false;
-                for (cmsg = CMSG_FIRSTHDR(&message); cmsg;
-                     cmsg = CMSG_NXTHDR(&message, cmsg)) {
-                    if (cmsg->cmsg_level == SOL_IP) {
-                        switch (cmsg->cmsg_type) {
-                        case IP_ORIGDSTADDR:
-                            targetAddress = *((struct sockaddr_in *)CMSG_DATA(cmsg));
-                            gotOrigAddr = true;
-                            break;
-                        }
-                    }
-                }
-                if (!gotOrigAddr) {
-                    std::cerr << "Got direct datagram." << std::endl;
-                }
-
-                char clientHost[256] = {};
-                inet_ntop(AF_INET, &clientAddress.sin_addr, clientHost, sizeof(clientHost));
-                int clientPort = ntohs(clientAddress.sin_port);
-
-                char targetHost[256] = {};
-                inet_ntop(AF_INET, &targetAddress.sin_addr, targetHost, sizeof(targetHost));
-                int targetPort = ntohs(targetAddress.sin_port);
-
-                std::cerr << "\t" << "RECEIVE UP   DGRAM   " << clientHost << ":" << clientPort << " -> " << targetHost << ":" << targetPort << std::endl;
 
-                send(clientAddress, targetAddress, buffer, recv_len);
-            }
+        if (bind(bindSocketFd, serverAddress.get(), serverAddress.length) < 0) {
+            throw std::runtime_error("could not bind to address and port");
         }
+        bindSocketFdCleaner.disable();
+        return bindSocketFd;
     }
 };
 
@@ -0,0 +1,225 @@
+#ifndef HGUARD_UPSTREAM_POOL
+#define HGUARD_UPSTREAM_POOL
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "EventLoop.hpp"
+#include "Handshake.hpp"
+#include "Log.hpp"
+#include "TimerWheel.hpp"
+#include "SocketTuning.hpp"
+#include "Upstreams.hpp"
+
+/// How often the pool is topped up and checked for stale connections.
+#ifndef UPSTREAM_POOL_CHECK_MS
+#define UPSTREAM_POOL_CHECK_MS 1000
+#endif
+
+/// Idle connections to the upstream proxy, made ahead of time so that new
+/// tunnels needn't wait for them.
+///
+/// Each connection can be put through a preamble (for SOCKS5, greeting and
+/// authentication) before it's counted as ready. The pool belongs to one
+/// event loop, and keeps up to size connections ready or on their way,
+/// topping up whenever one is taken and on every check. Proxies tend to
+/// hang up on quiet connections, so any which have been ready for longer
+/// than maxIdleMs are dropped, as are any which the proxy closes. Each new
+/// connection goes to whichever upstream proxy the set picks, and counts
+/// towards its health.
+class UpstreamPool : public EventHandler {
+public:
+    typedef std::function<std::unique_ptr<Handshake>()> PreambleFactory;
+
+private:
+    struct Connection {
+        Upstream* upstream;
+        std::unique_ptr<Handshake> preamble;
+        bool connected;
+        bool ready;
+        uint64_t since; // When opened, or once ready, when it became so.
+    };
+
+    EventLoop& loop;
+    UpstreamSet& upstreams;
+    const SocketTuning& tuning;
+    size_t size;
+    uint64_t maxIdleMs;
+    PreambleFactory preamble;
+    std::vector<std::unique_ptr<Connection>> connections; // By fd
+    std::deque<int> ready; // Oldest first
+    size_t warming;
+    EventTimer checkTimer;
+
+public:
+    /// upstreams and tuning must outlive the pool.
+    UpstreamPool(EventLoop& loop, UpstreamSet& upstreams, const SocketTuning& tuning, size_t size, uint64_t maxIdleMs, PreambleFactory preamble):
+        loop(loop),
+        upstreams(upstreams),
+        tuning(tuning),
+        size(size),
+        maxIdleMs(maxIdleMs),
+        preamble(preamble),
+        warming(0)
+    {
+        top_up();
+        loop.schedule(checkTimer, this, UPSTREAM_POOL_CHECK_MS);
+    }
+
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+    ~UpstreamPool() {
+        loop.cancel(checkTimer);
+        for (size_t fd = 0; fd < connections.size(); fd++) {
+            if (connections[fd]) {
+                loop.remove(fd);
+                close(fd);
+            }
+        }
+    }
+
+    /// Take a ready connection, if there is one, setting upstream to the
+    /// proxy it goes to. The caller owns the returned socket, which isn't
+    /// watched by the loop any more. Returns -1 if none are ready.
+    int acquire(Upstream*& upstream) {
+        int fd = -1;
+        if (!ready.empty()) {
+            // The freshest is the least likely to have gone stale.
+            fd = ready.back();
+            ready.pop_back();
+            upstream = connections[fd]->upstream;
+            loop.remove(fd);
+            connections[fd].reset();
+        }
+        top_up();
+        return fd;
+    }
+
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        Connection* connection = size_t(fd) < connections.size() ? connections[fd].get() : nullptr;
+        if (connection == nullptr) {
+            return;
+        }
+        if (connection->ready) {
+            // The proxy has hung up (or spoken out of turn).
+            drop(fd);
+            return;
+        }
+        try {
+            if (!connection->connected) {
+                int error = 0;
+                socklen_t errorLength = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0) {
+                    throw std::runtime_error("could not connect to upstream proxy");
+                }
+                connection->connected = true;
+            }
+            if (connection->preamble) {
+                switch (connection->preamble->advance(fd)) {
+                case Handshake::Status::WANT_READ:
+                    loop.modify(fd, EPOLLIN);
+                    return;
+                case Handshake::Status::WANT_WRITE:
+                    loop.modify(fd, EPOLLOUT);
+                    return;
+                default:
+                    connection->preamble.reset();
+                    break;
+                }
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: pooled upstream connection: ", e.what());
+            upstreams.failed(connection->upstream);
+            drop(fd);
+            return;
+        }
+        warming--;
+        connection->ready = true;
+        upstreams.succeeded(connection->upstream, (monotonic_ms() - connection->since) * 1000);
+        connection->since = monotonic_ms();
+        ready.push_back(fd);
+        // Only to notice the proxy hanging up.
+        loop.modify(fd, EPOLLIN);
+    }
+
+    void handle_timeout() override {
+        uint64_t now = monotonic_ms();
+        while (!ready.empty() && now - connections[ready.front()]->since >= maxIdleMs) {
+            drop(ready.front());
+        }
+        for (size_t fd = 0; fd < connections.size(); fd++) {
+            if (connections[fd] && !connections[fd]->ready && now - connections[fd]->since >= TCP_NEGOTIATION_TIMEOUT * 1000) {
+                Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: pooled upstream connection: upstream proxy negotiation timed out");
+                upstreams.failed(connections[fd]->upstream);
+                drop(fd);
+            }
+        }
+        top_up();
+        loop.schedule(checkTimer, this, UPSTREAM_POOL_CHECK_MS);
+    }
+
+private:
+    void top_up() {
+        while (ready.size() + warming < size) {
+            Upstream* upstream = upstreams.select();
+            SocketAddress address = upstream->address.socket_address();
+            int fd = socket(address.generic.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: could not open pooled upstream socket");
+                return;
+            }
+            std::unique_ptr<Handshake> handshake = preamble();
+            try {
+                // With nothing to say yet, Fast Open would put off
+                // connecting until the tunnel is up.
+                if (handshake) {
+                    tuning.apply_connect(fd);
+                } else {
+                    tuning.apply(fd);
+                }
+            } catch (const std::exception& e) {
+                Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: pooled upstream connection: ", e.what());
+                close(fd);
+                return;
+            }
+            if (connect(fd, address.get(), address.length) < 0 && errno != EINPROGRESS) {
+                Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: pooled upstream connection: could not connect to upstream proxy");
+                upstreams.failed(upstream);
+                close(fd);
+                return;
+            }
+            if (size_t(fd) >= connections.size()) {
+                connections.resize(fd + 1);
+            }
+            connections[fd].reset(new Connection{upstream, std::move(handshake), false, false, monotonic_ms()});
+            warming++;
+            loop.add(fd, EPOLLOUT, this);
+        }
+    }
+
+    void drop(int fd) {
+        if (connections[fd]->ready) {
+            for (auto it = ready.begin(); it != ready.end(); ++it) {
+                if (*it == fd) {
+                    ready.erase(it);
+                    break;
+                }
+            }
+        } else {
+            warming--;
+        }
+        connections[fd].reset();
+        loop.remove(fd);
+        close(fd);
+    }
+};
+
+#endif
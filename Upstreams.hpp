@@ -0,0 +1,252 @@
+#ifndef HGUARD_UPSTREAMS
+#define HGUARD_UPSTREAMS
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Util.hpp"
+
+/// Seconds between health checks of each upstream proxy.
+#ifndef UPSTREAM_HEALTH_INTERVAL
+#define UPSTREAM_HEALTH_INTERVAL 5
+#endif
+/// Milliseconds a health check may take to connect.
+#ifndef UPSTREAM_HEALTH_TIMEOUT_MS
+#define UPSTREAM_HEALTH_TIMEOUT_MS 2000
+#endif
+/// Seconds an upstream proxy is avoided after its first failure. Doubles
+/// with each failure in a row, up to UPSTREAM_DOWN_MAX.
+#ifndef UPSTREAM_DOWN_MIN
+#define UPSTREAM_DOWN_MIN 1
+#endif
+#ifndef UPSTREAM_DOWN_MAX
+#define UPSTREAM_DOWN_MAX 30
+#endif
+/// Each new latency sample counts for 1/UPSTREAM_LATENCY_DECAY of the
+/// moving average.
+#ifndef UPSTREAM_LATENCY_DECAY
+#define UPSTREAM_LATENCY_DECAY 8
+#endif
+
+static inline uint64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+/// One upstream proxy, and what we've learnt about it.
+///
+/// Shared by every worker thread, so everything which changes is atomic.
+/// Updates race harmlessly: at worst a sample or a failure is lost.
+struct Upstream {
+    Endpoint address;
+    std::string name;
+    int weight;
+    /// Tunnels (or SOCKS5 UDP sessions) currently using it.
+    std::atomic<int> active;
+    /// Moving average of connect and negotiation time. 0 until measured.
+    std::atomic<uint64_t> latencyUs;
+    std::atomic<int> failures;
+    std::atomic<uint64_t> downUntilUs;
+
+    Upstream(const Endpoint& address, const std::string& name, int weight):
+        address(address),
+        name(name),
+        weight(weight),
+        active(0),
+        latencyUs(0),
+        failures(0),
+        downUntilUs(0)
+    {
+    }
+
+    bool healthy(uint64_t now) const {
+        return downUntilUs.load(std::memory_order_relaxed) <= now;
+    }
+};
+
+/// The upstream proxies to choose between, with health tracking.
+///
+/// Tunnels report back how each attempt went. A failure (or a failed
+/// health check) takes an upstream out of rotation for a while, backing
+/// off exponentially; a success brings it straight back.
+class UpstreamSet : public std::enable_shared_from_this<UpstreamSet> {
+public:
+    enum class Policy {
+        /// Fewest active tunnels relative to weight.
+        LEAST_CONNECTIONS,
+        /// Lowest moving average latency, scaled up by load and down by
+        /// weight, so that the quickest proxy isn't simply swamped.
+        LATENCY,
+    };
+
+private:
+    std::vector<std::unique_ptr<Upstream>> upstreams;
+    Policy policy;
+    std::atomic<unsigned> rotation;
+
+public:
+    UpstreamSet():
+        policy(Policy::LEAST_CONNECTIONS),
+        rotation(0)
+    {
+    }
+
+    UpstreamSet(const UpstreamSet&) = delete;
+    UpstreamSet& operator=(const UpstreamSet&) = delete;
+
+    void add(const Endpoint& address, const std::string& name, int weight) {
+        upstreams.emplace_back(new Upstream(address, name, weight));
+    }
+
+    void set_policy(Policy policy) {
+        this->policy = policy;
+    }
+
+    size_t size() const {
+        return upstreams.size();
+    }
+
+    /// The best upstream to try next, other than avoid (unless it's the
+    /// only one). Prefers healthy upstreams, but if none are, picks the
+    /// one due back soonest.
+    Upstream* select(const Upstream* avoid = nullptr) {
+        uint64_t now = monotonic_us();
+        size_t count = upstreams.size();
+        // Start somewhere different each time, so that ties rotate.
+        size_t offset = rotation.fetch_add(1, std::memory_order_relaxed);
+        Upstream* best = nullptr;
+        Upstream* soonest = nullptr;
+        for (size_t i = 0; i < count; i++) {
+            Upstream* upstream = upstreams[(offset + i) % count].get();
+            if (upstream == avoid && count > 1) {
+                continue;
+            }
+            if (!upstream->healthy(now)) {
+                if (soonest == nullptr || upstream->downUntilUs < soonest->downUntilUs) {
+                    soonest = upstream;
+                }
+                continue;
+            }
+            if (best == nullptr || better(*upstream, *best)) {
+                best = upstream;
+            }
+        }
+        return best != nullptr ? best : soonest;
+    }
+
+    /// Move ties on to the next upstream without selecting one.
+    void skip_turn() {
+        rotation.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void acquire(Upstream* upstream) {
+        upstream->active.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(Upstream* upstream) {
+        upstream->active.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /// upstream was connected to and negotiated with in latencyUs.
+    void succeeded(Upstream* upstream, uint64_t latencyUs) {
+        uint64_t average = upstream->latencyUs.load(std::memory_order_relaxed);
+        if (average == 0) {
+            average = latencyUs;
+        } else {
+            average = (average * (UPSTREAM_LATENCY_DECAY - 1) + latencyUs) / UPSTREAM_LATENCY_DECAY;
+        }
+        upstream->latencyUs.store(average > 0 ? average : 1, std::memory_order_relaxed);
+        recovered(upstream);
+    }
+
+    /// upstream couldn't be connected to, or negotiation with it failed.
+    void failed(Upstream* upstream) {
+        Metrics::count(Metric::UPSTREAM_FAILURES);
+        int failures = upstream->failures.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t downSeconds = UPSTREAM_DOWN_MIN;
+        for (int i = 1; i < failures && downSeconds < UPSTREAM_DOWN_MAX; i++) {
+            downSeconds *= 2;
+        }
+        if (downSeconds > UPSTREAM_DOWN_MAX) {
+            downSeconds = UPSTREAM_DOWN_MAX;
+        }
+        upstream->downUntilUs.store(monotonic_us() + downSeconds * 1000000, std::memory_order_relaxed);
+        if (failures == 1 && upstreams.size() > 1) {
+            Log::message(LogLevel::WARN, "Upstream ", upstream->name, " is down");
+        }
+    }
+
+    /// Connect to every upstream in turn, for as long as the set is in
+    /// use, to find out which are up before any tunnel has to. Only worth
+    /// it with more than one upstream to choose from. The set must be
+    /// owned by a shared_ptr.
+    void start_health_checks() {
+        if (upstreams.size() < 2) {
+            return;
+        }
+        // Doesn't keep the set alive (once a reload has replaced it) in
+        // between rounds.
+        std::weak_ptr<UpstreamSet> weak = shared_from_this();
+        std::thread([weak] {
+                while (std::shared_ptr<UpstreamSet> set = weak.lock()) {
+                    for (const std::unique_ptr<Upstream>& upstream : set->upstreams) {
+                        set->check(upstream.get());
+                    }
+                    set.reset();
+                    sleep(UPSTREAM_HEALTH_INTERVAL);
+                }
+            }).detach();
+    }
+
+private:
+    bool better(const Upstream& a, const Upstream& b) const {
+        switch (policy) {
+        case Policy::LATENCY:
+            return (a.latencyUs * (a.active + 1)) * b.weight < (b.latencyUs * (b.active + 1)) * a.weight;
+        default:
+            return uint64_t(a.active) * b.weight < uint64_t(b.active) * a.weight;
+        }
+    }
+
+    /// Bring upstream straight back, if it was down.
+    void recovered(Upstream* upstream) {
+        if (upstream->failures.exchange(0, std::memory_order_relaxed) > 0) {
+            upstream->downUntilUs.store(0, std::memory_order_relaxed);
+            if (upstreams.size() > 1) {
+                Log::message(LogLevel::WARN, "Upstream ", upstream->name, " is back");
+            }
+        }
+    }
+
+    /// A connect alone says nothing of how long negotiation takes, so
+    /// it ends any back off without being a latency sample.
+    void check(Upstream* upstream) {
+        int fd = socket(upstream->address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return;
+        }
+        bool up = connect_within(fd, upstream->address, UPSTREAM_HEALTH_TIMEOUT_MS);
+        close(fd);
+        if (up) {
+            recovered(upstream);
+        } else if (upstream->healthy(monotonic_us())) {
+            // Newly down. One which is already down is left alone, so
+            // that its back off runs its course.
+            failed(upstream);
+        }
+    }
+};
+
+#endif
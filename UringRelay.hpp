@@ -0,0 +1,492 @@
+#ifndef HGUARD_URING_RELAY
+#define HGUARD_URING_RELAY
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "IoUring.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "RelayChannel.hpp"
+
+/// Copy mode buffers each io_uring worker hands the kernel. Must be a
+/// power of two. Only buffers with data in them are in use, so quiet
+/// tunnels don't tie any up.
+#ifndef URING_RELAY_BUFFERS
+#define URING_RELAY_BUFFERS 1024
+#endif
+#ifndef URING_RELAY_BUFFER_SIZE
+#define URING_RELAY_BUFFER_SIZE 32768
+#endif
+/// Most buffers one direction of a tunnel reads ahead into whilst its
+/// destination catches up.
+#ifndef URING_RELAY_DEPTH
+#define URING_RELAY_DEPTH 4
+#endif
+
+class UringRelay;
+
+/// A worker's io_uring, along with the buffers its tunnels relay through.
+class RelayRing {
+private:
+    IoUring& ring;
+    UringBufferRing buffers;
+    /// Directions whose reads found no buffer free, waiting for one.
+    std::deque<std::pair<UringRelay*, unsigned>> starved;
+
+    friend class UringRelay;
+
+public:
+    explicit RelayRing(IoUring& ring):
+        ring(ring),
+        buffers(ring, 0, URING_RELAY_BUFFERS, URING_RELAY_BUFFER_SIZE)
+    {
+    }
+
+    RelayRing(const RelayRing&) = delete;
+    RelayRing& operator=(const RelayRing&) = delete;
+
+private:
+    /// Buffer id is free again.
+    void give_back(unsigned id);
+};
+
+/// Both directions of a tunnel, relayed through io_uring instead of an
+/// EventLoop: the io_uring equivalent of a pair of RelayChannels.
+///
+/// Each direction keeps a read queued on its source, as one entry which
+/// the kernel only gives a buffer to once there's data, and writes out
+/// what's been read in order, a buffer at a time, reading ahead by up to
+/// URING_RELAY_DEPTH buffers. Reads and writes are queued from each
+/// other's completions, so they go to the kernel along with everything
+/// else at the worker's next submit, without system calls of their own.
+///
+/// Zero copy directions splice through a pipe instead, each splice linked
+/// behind a poll on its socket, as a splice would otherwise tie up one of
+/// the kernel's io_uring worker threads for as long as the socket stayed
+/// idle. Reads can't be linked to writes in the same way: a short read
+/// (which any stream socket might return) would cancel the write, and the
+/// write's length isn't known until the read completes.
+///
+/// Once both sources have hung up and everything has gone out, or
+/// something has gone wrong and every operation has come back, done() is
+/// called. The sockets must stay open until then.
+class UringRelay : public UringHandler {
+private:
+    enum Tag : unsigned {
+        // Low bit is the direction
+        READ = 0,
+        WRITE = 2,
+        POLL = 4,
+    };
+
+    struct Direction {
+        int srcFd;
+        int dstFd;
+        bool toProxy;
+        bool zeroCopy;
+        bool srcOpen;
+        bool reading;
+        bool writing;
+        bool parked;
+
+        // Copy mode: buffers read but not yet written, oldest first, and
+        // how much of the oldest has gone out
+        unsigned buffers[URING_RELAY_DEPTH];
+        size_t lengths[URING_RELAY_DEPTH];
+        unsigned first;
+        unsigned queued;
+        size_t written;
+        // Left over from negotiation, to go first
+        std::string preload;
+        size_t preloaded;
+
+        // Zero copy mode
+        int pipeFds[2];
+        size_t piped;
+    };
+
+    RelayRing& rings;
+    Direction directions[2]; // client -> proxy, proxy -> client
+    unsigned pending;
+    bool failed;
+    bool closed;
+    std::function<void(bool toProxy)> hungUp;
+    std::function<void()> done;
+
+public:
+    /// hungUp is told when either source hangs up cleanly, and done when
+    /// the tunnel is over.
+    UringRelay(RelayRing& rings, int clientSocketFd, int proxySocketFd, bool zeroCopy,
+               std::function<void(bool toProxy)> hungUp, std::function<void()> done):
+        rings(rings),
+        pending(0),
+        failed(false),
+        closed(false),
+        hungUp(std::move(hungUp)),
+        done(std::move(done))
+    {
+        open(directions[0], clientSocketFd, proxySocketFd, true, zeroCopy);
+        open(directions[1], proxySocketFd, clientSocketFd, false, zeroCopy);
+    }
+
+    UringRelay(const UringRelay&) = delete;
+    UringRelay& operator=(const UringRelay&) = delete;
+
+    ~UringRelay() {
+        for (Direction& direction : directions) {
+            close_pipe(direction);
+            release(direction);
+        }
+    }
+
+    /// Send whatever negotiation left over (the proxy's surplus to the
+    /// client, early data to the proxy), then start relaying.
+    void start(const std::string& toClient, const std::string& toProxy) {
+        try {
+            preload(directions[0], toProxy);
+            preload(directions[1], toClient);
+            for (Direction& direction : directions) {
+                if (direction.piped > 0 || !direction.preload.empty()) {
+                    write(direction);
+                } else {
+                    read(direction);
+                }
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            fail();
+        }
+        check_done();
+    }
+
+    /// Whether both directions ran to completion.
+    bool finished() const {
+        return !failed && !directions[0].srcOpen && !directions[1].srcOpen;
+    }
+
+    void handle_completion(unsigned tag, int32_t result, uint32_t flags) override {
+        pending--;
+        Direction& direction = directions[tag & 1];
+        try {
+            switch (tag & ~1u) {
+            case READ:
+                direction.reading = false;
+                read_done(direction, result, flags);
+                break;
+            case WRITE:
+                direction.writing = false;
+                write_done(direction, result);
+                break;
+            default:
+                // A poll ahead of a splice: the splice's completion says
+                // all there is to know.
+                break;
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            fail();
+        }
+        check_done();
+    }
+
+private:
+    void open(Direction& direction, int srcFd, int dstFd, bool toProxy, bool zeroCopy) {
+        direction.srcFd = srcFd;
+        direction.dstFd = dstFd;
+        direction.toProxy = toProxy;
+        direction.zeroCopy = false;
+        direction.srcOpen = true;
+        direction.reading = false;
+        direction.writing = false;
+        direction.parked = false;
+        direction.first = 0;
+        direction.queued = 0;
+        direction.written = 0;
+        direction.preloaded = 0;
+        direction.pipeFds[0] = -1;
+        direction.pipeFds[1] = -1;
+        direction.piped = 0;
+        if (zeroCopy && pipe2(direction.pipeFds, O_CLOEXEC) == 0) {
+            // Harmless if refused: splices just move less at a time.
+            fcntl(direction.pipeFds[1], F_SETPIPE_SZ, RELAY_BUFFER_SIZE);
+            direction.zeroCopy = true;
+        }
+    }
+
+    void preload(Direction& direction, const std::string& data) {
+        if (data.empty()) {
+            return;
+        }
+        if (direction.zeroCopy) {
+            // Far smaller than the pipe, so this can't block.
+            ssize_t r = ::write(direction.pipeFds[1], data.data(), data.size());
+            if (r < 0 || size_t(r) != data.size()) {
+                throw std::runtime_error("could not queue early tunnel data");
+            }
+            direction.piped = data.size();
+        } else {
+            direction.preload = data;
+        }
+    }
+
+    static unsigned tag(const Direction& direction, Tag kind) {
+        return kind | (direction.toProxy ? 0 : 1);
+    }
+
+    /// Worth queueing another read: the source is open, nothing's being
+    /// read yet, and there'll be room for what comes back.
+    static bool can_read(const Direction& direction) {
+        if (!direction.srcOpen || direction.reading || direction.parked || direction.preloaded < direction.preload.size()) {
+            return false;
+        }
+        return direction.zeroCopy ? direction.piped == 0 : direction.queued < URING_RELAY_DEPTH;
+    }
+
+    void read(Direction& direction) {
+        IoUring& ring = rings.ring;
+        if (direction.zeroCopy) {
+            struct io_uring_sqe* poll = ring.sqe(this, tag(direction, POLL));
+            poll->opcode = IORING_OP_POLL_ADD;
+            poll->fd = direction.srcFd;
+            poll->poll32_events = POLLIN;
+            poll->flags = IOSQE_IO_LINK;
+            struct io_uring_sqe* splice = ring.sqe(this, tag(direction, READ));
+            splice->opcode = IORING_OP_SPLICE;
+            splice->splice_fd_in = direction.srcFd;
+            splice->splice_off_in = uint64_t(-1);
+            splice->fd = direction.pipeFds[1];
+            splice->off = uint64_t(-1);
+            splice->len = RELAY_BUFFER_SIZE;
+            splice->splice_flags = SPLICE_F_MOVE;
+            pending += 2;
+        } else {
+            struct io_uring_sqe* recv = ring.sqe(this, tag(direction, READ));
+            recv->opcode = IORING_OP_RECV;
+            recv->fd = direction.srcFd;
+            recv->len = uint32_t(rings.buffers.size());
+            recv->flags = IOSQE_BUFFER_SELECT;
+            recv->buf_group = rings.buffers.id();
+            pending++;
+        }
+        direction.reading = true;
+    }
+
+    void write(Direction& direction) {
+        IoUring& ring = rings.ring;
+        if (direction.zeroCopy && direction.piped > 0) {
+            struct io_uring_sqe* poll = ring.sqe(this, tag(direction, POLL));
+            poll->opcode = IORING_OP_POLL_ADD;
+            poll->fd = direction.dstFd;
+            poll->poll32_events = POLLOUT;
+            poll->flags = IOSQE_IO_LINK;
+            struct io_uring_sqe* splice = ring.sqe(this, tag(direction, WRITE));
+            splice->opcode = IORING_OP_SPLICE;
+            splice->splice_fd_in = direction.pipeFds[0];
+            splice->splice_off_in = uint64_t(-1);
+            splice->fd = direction.dstFd;
+            splice->off = uint64_t(-1);
+            splice->len = uint32_t(direction.piped);
+            splice->splice_flags = SPLICE_F_MOVE;
+            pending += 2;
+            direction.writing = true;
+            return;
+        }
+        const char* data;
+        size_t length;
+        if (direction.preloaded < direction.preload.size()) {
+            data = direction.preload.data() + direction.preloaded;
+            length = direction.preload.size() - direction.preloaded;
+        } else {
+            data = rings.buffers.buffer(direction.buffers[direction.first]) + direction.written;
+            length = direction.lengths[direction.first] - direction.written;
+        }
+        struct io_uring_sqe* send = ring.sqe(this, tag(direction, WRITE));
+        send->opcode = IORING_OP_SEND;
+        send->fd = direction.dstFd;
+        send->addr = uint64_t(uintptr_t(data));
+        send->len = uint32_t(length);
+        send->msg_flags = MSG_NOSIGNAL;
+        pending++;
+        direction.writing = true;
+    }
+
+    void read_done(Direction& direction, int32_t result, uint32_t flags) {
+        bool buffered = flags & IORING_CQE_F_BUFFER;
+        unsigned buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (failed || result <= 0) {
+            if (buffered) {
+                rings.give_back(buffer);
+            }
+            if (failed) {
+                return;
+            }
+        }
+        if (result > 0) {
+            Metrics::count(direction.toProxy ? Metric::BYTES_UPSTREAM : Metric::BYTES_DOWNSTREAM, result);
+            if (direction.zeroCopy) {
+                direction.piped = result;
+            } else {
+                unsigned slot = (direction.first + direction.queued) % URING_RELAY_DEPTH;
+                direction.buffers[slot] = buffer;
+                direction.lengths[slot] = result;
+                direction.queued++;
+            }
+            if (!direction.writing) {
+                write(direction);
+            }
+            if (can_read(direction)) {
+                read(direction);
+            }
+        } else if (result == 0) {
+            direction.srcOpen = false;
+            hungUp(direction.toProxy);
+            if (!direction.writing) {
+                shutdown(direction.dstFd, SHUT_WR);
+            }
+        } else if (result == -ENOBUFS) {
+            // Every buffer's busy: wait for one to come back.
+            direction.parked = true;
+            rings.starved.emplace_back(this, tag(direction, READ));
+        } else if (result == -EINTR || result == -EAGAIN) {
+            read(direction);
+        } else if (direction.zeroCopy && result == -EINVAL) {
+            // Splicing from the source isn't supported.
+            close_pipe(direction);
+            direction.zeroCopy = false;
+            read(direction);
+        } else {
+            throw std::runtime_error(direction.toProxy ? "client read error" : "upstream proxy read error");
+        }
+    }
+
+    void write_done(Direction& direction, int32_t result) {
+        if (failed) {
+            return;
+        }
+        if (result <= 0) {
+            if (result == 0 || result == -EINTR || result == -EAGAIN) {
+                write(direction);
+                return;
+            }
+            throw std::runtime_error(direction.toProxy ? "upstream proxy write error" : "client write error");
+        }
+        bool more;
+        if (direction.preloaded < direction.preload.size()) {
+            direction.preloaded += result;
+            more = direction.preloaded < direction.preload.size();
+            if (!more) {
+                direction.preload = std::string();
+            }
+        } else if (direction.zeroCopy) {
+            direction.piped -= result;
+            more = direction.piped > 0;
+        } else {
+            direction.written += result;
+            if (direction.written == direction.lengths[direction.first]) {
+                unsigned buffer = direction.buffers[direction.first];
+                direction.first = (direction.first + 1) % URING_RELAY_DEPTH;
+                direction.queued--;
+                direction.written = 0;
+                rings.give_back(buffer);
+            }
+            more = direction.queued > 0;
+        }
+        if (more) {
+            write(direction);
+        } else if (!direction.srcOpen) {
+            shutdown(direction.dstFd, SHUT_WR);
+        }
+        if (can_read(direction)) {
+            read(direction);
+        }
+    }
+
+    /// Give up: wake whatever's in flight (shutting the sockets down has
+    /// every read and write come straight back) so that done() can be
+    /// called once it has.
+    void fail() {
+        if (failed) {
+            return;
+        }
+        failed = true;
+        for (Direction& direction : directions) {
+            direction.parked = false;
+        }
+        std::deque<std::pair<UringRelay*, unsigned>>& starved = rings.starved;
+        starved.erase(std::remove_if(starved.begin(), starved.end(), [this](const std::pair<UringRelay*, unsigned>& entry) {
+                    return entry.first == this;
+                }), starved.end());
+        shutdown(directions[0].srcFd, SHUT_RDWR);
+        shutdown(directions[1].srcFd, SHUT_RDWR);
+    }
+
+    void check_done() {
+        if (closed || pending > 0 || directions[0].parked || directions[1].parked) {
+            return;
+        }
+        if (failed || (!directions[0].srcOpen && !directions[1].srcOpen)) {
+            closed = true;
+            for (Direction& direction : directions) {
+                release(direction);
+            }
+            done();
+        }
+    }
+
+    /// A buffer came free, and this direction wants it.
+    void resume(unsigned readTag) {
+        Direction& direction = directions[readTag & 1];
+        direction.parked = false;
+        try {
+            if (can_read(direction)) {
+                read(direction);
+            }
+        } catch (const std::exception& e) {
+            Log::message(LogLevel::ERROR, Log::pid(), "\t", "Error: ", e.what());
+            fail();
+        }
+        check_done();
+    }
+
+    /// Hand back whatever buffers are still queued. Nothing may be being
+    /// written from them.
+    void release(Direction& direction) {
+        while (direction.queued > 0) {
+            unsigned buffer = direction.buffers[direction.first];
+            direction.first = (direction.first + 1) % URING_RELAY_DEPTH;
+            direction.queued--;
+            rings.give_back(buffer);
+        }
+    }
+
+    static void close_pipe(Direction& direction) {
+        if (direction.pipeFds[0] >= 0) {
+            close(direction.pipeFds[0]);
+            close(direction.pipeFds[1]);
+            direction.pipeFds[0] = -1;
+            direction.pipeFds[1] = -1;
+        }
+    }
+
+    friend class RelayRing;
+};
+
+inline void RelayRing::give_back(unsigned id) {
+    buffers.provide(id);
+    if (!starved.empty()) {
+        std::pair<UringRelay*, unsigned> next = starved.front();
+        starved.pop_front();
+        next.first->resume(next.second);
+    }
+}
+
+#endif
@@ -1,53 +1,84 @@
 #ifndef HGUARD_UTIL
 #define HGUARD_UTIL
 
+#include <sstream>
+#include <cstring>
+
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "Endpoint.hpp"
+
+/// Switch O_NONBLOCK on or off. Returns false on failure.
+static bool set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return false;
+    }
+    flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags) >= 0;
+}
 
-/// read(), but keep reading until count bytes extracted.
-///
-/// Will only return less than count bytes if EOF is reached.
-///
-/// Returns -1 on any errors (well, whatever read() does).
-static ssize_t read_exactly(int fd, void* buf, size_t count) {
-    size_t i = 0;
-    while (i < count) {
-        int r = read(fd, ((char*)buf)+i, count-i);
-        if (r < 0) {
-            return r;
-        } else if (r == 0) {
-            return i;
-        } else {
-            i += r;
-        }
+/// connect() a non-blocking socket, waiting up to timeoutMs for it to
+/// finish. Returns false on failure or timeout.
+static bool connect_within(int fd, const Endpoint& endpoint, int timeoutMs) {
+    SocketAddress address = endpoint.socket_address();
+    if (connect(fd, address.get(), address.length) == 0) {
+        return true;
+    }
+    if (errno != EINPROGRESS) {
+        return false;
     }
-    return i;
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int r;
+    do {
+        r = poll(&pfd, 1, timeoutMs);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) {
+        return false;
+    }
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == 0 && error == 0;
 }
 
-/// Used for constructing packets before write.
-static ssize_t build_packet(void* packet, size_t max_packet_length, size_t* packet_len, const void* buf, size_t count) {
-    if (*packet_len + count > max_packet_length) {
+/// A socket of type taking both IPv4 and IPv6 (IPv4 peers showing up
+/// v4-mapped), or only IPv4 on a kernel without IPv6. -1 on failure.
+static int open_dual_stack_socket(int type) {
+    int fd = socket(AF_INET6, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return errno == EAFNOSUPPORT ? socket(AF_INET, type | SOCK_CLOEXEC, 0) : -1;
+    }
+    const int off = 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+        close(fd);
         return -1;
     }
-    memcpy((char*)packet + *packet_len, buf, count);
-    *packet_len += count;
-    return count;
+    return fd;
 }
 
-/// write(), but keep writing until count bytes written.
-///
-/// Returns -1 on any errors (well, whatever read() does).
-/// Otherwise, never returns less than count.
-static ssize_t write_exactly(int fd, const void* buf, size_t count) {
-    size_t i = 0;
-    while (i < count) {
-        int r = write(fd, ((const char*)buf)+i, count-i);
-        if (r < 0) {
-            return r;
-        } else {
-            i += r;
-        }
+/// The wildcard address on port, in the family of fd, to bind() it to.
+static SocketAddress any_address(int fd, int port) {
+    int family = AF_INET;
+    socklen_t familyLength = sizeof(family);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &familyLength);
+    SocketAddress address = {};
+    if (family == AF_INET6) {
+        address.v6.sin6_family = AF_INET6;
+        address.v6.sin6_port = htons(port);
+        address.v6.sin6_addr = in6addr_any;
+        address.length = sizeof(address.v6);
+    } else {
+        address.v4.sin_family = AF_INET;
+        address.v4.sin_port = htons(port);
+        address.v4.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.length = sizeof(address.v4);
     }
-    return i;
+    return address;
 }
 
 /// Encode string to base64
@@ -0,0 +1,1080 @@
+// Benchmark harness for transproxify.
+//
+// Runs transproxify against a mock upstream proxy living in this process,
+// for each TCP engine and proxy protocol asked for, and measures:
+//
+//   connect:    tunnels set up per second, and how long each took
+//   concurrent: how many tunnels can be held open at once
+//   bulk:       relay throughput
+//   udp:        SOCKS5 UDP datagrams relayed per second, each way
+//
+// Results go to stdout as one JSON object per line; progress goes to
+// stderr.
+//
+// There's no iptables involved, so tunnels are made by connecting straight
+// to transproxify, which (built with ALLOW_DIRECT_CONNECTIONS) then takes
+// itself for the target. The mock proxy ignores the target it's asked for
+// and plays the part itself: the first byte of each tunnel says whether to
+// echo ('E') or to sink everything and report the byte count on EOF ('S').
+//
+// UDP is measured one way at a time: as soon as transproxify replies to a
+// client, the socket it replies from (bound to the target, which here is
+// transproxify itself) gets the client's next datagrams. So the mock's UDP
+// relay first just counts what arrives, then floods the clients with
+// copies of the last datagram instead. UDP needs the privileges TPROXY
+// needs, and is skipped without them.
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Cleaner.hpp"
+#include "EventLoop.hpp"
+
+/// Bytes sent and echoed by each connect probe.
+#define BENCH_PING_SIZE 32
+#define BENCH_UDP_PAYLOAD 64
+/// Datagrams sent to each client at a time when flooding.
+#define BENCH_UDP_BURST 64
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+static int bound_port(int fd) {
+    struct sockaddr_in address = {};
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*)&address, &length) < 0) {
+        throw std::runtime_error("could not get bound port");
+    }
+    return ntohs(address.sin_port);
+}
+
+/// A port nothing seems to be using.
+static int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    Cleaner fdCleaner([fd] {
+            close(fd);
+        });
+    struct sockaddr_in address = loopback(0);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        throw std::runtime_error("could not find a free port");
+    }
+    return bound_port(fd);
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+        if (w <= 0) {
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t r = recv(fd, data, len, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+static double percentile(std::vector<uint64_t>& samples, double fraction) {
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t index = std::min(samples.size() - 1, size_t(fraction * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+
+class MockUpstream;
+
+/// One connection to the mock proxy: a handshake, then echo or sink.
+class MockConnection : public EventHandler {
+private:
+    enum class Phase {
+        GREETING, // SOCKS5 only
+        REQUEST,
+        MODE,
+        ECHO,
+        SINK,
+    };
+
+    MockUpstream& mock;
+    EventLoop& loop;
+    int fd;
+    int udpFd;
+    Phase phase;
+    std::string in;
+    std::string out;
+    uint64_t sunk;
+    bool closing;
+    bool finished;
+    uint32_t watching;
+    // Last datagram through the UDP relay, and who from.
+    std::string datagram;
+    struct sockaddr_in datagramSource;
+
+public:
+    MockConnection(MockUpstream& mock, EventLoop& loop, int fd);
+
+    ~MockConnection() override;
+
+    void handle_event(int eventFd, uint32_t events) override {
+        if (eventFd == udpFd) {
+            receive_datagrams();
+            return;
+        }
+        if ((events & EPOLLOUT) && !flush()) {
+            finish();
+            return;
+        }
+        if (out.empty() && closing) {
+            finish();
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            receive();
+        }
+    }
+
+    void finish();
+
+    /// Send a burst of copies of the last datagram back where it came
+    /// from.
+    void flood() {
+        if (datagram.empty()) {
+            return;
+        }
+        for (int i = 0; i < BENCH_UDP_BURST; i++) {
+            if (sendto(udpFd, datagram.data(), datagram.size(), 0, (struct sockaddr*)&datagramSource, sizeof(datagramSource)) < 0) {
+                return;
+            }
+        }
+    }
+
+private:
+    void receive() {
+        char buffer[65536];
+        while (out.empty()) {
+            ssize_t r = recv(fd, buffer, sizeof(buffer), 0);
+            if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                finish();
+                return;
+            }
+            if (r == 0) {
+                if (phase == Phase::SINK) {
+                    out.append((const char*)&sunk, sizeof(sunk));
+                    closing = true;
+                    break;
+                }
+                finish();
+                return;
+            }
+            if (phase == Phase::SINK) {
+                sunk += r;
+            } else if (phase == Phase::ECHO) {
+                out.append(buffer, r);
+            } else {
+                in.append(buffer, r);
+                if (!advance()) {
+                    finish();
+                    return;
+                }
+            }
+        }
+        if (!flush()) {
+            finish();
+            return;
+        }
+        if (out.empty() && closing) {
+            finish();
+            return;
+        }
+        // Don't take more until the peer has taken what it's owed.
+        watch(out.empty() ? EPOLLIN : EPOLLOUT);
+    }
+
+    void watch(uint32_t events) {
+        if (events != watching) {
+            watching = events;
+            loop.modify(fd, events);
+        }
+    }
+
+    bool flush() {
+        while (!out.empty()) {
+            ssize_t w = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+            if (w < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            out.erase(0, w);
+        }
+        if (!closing) {
+            watch(EPOLLIN);
+        }
+        return true;
+    }
+
+    /// Work through whatever's arrived. Returns false if it makes no
+    /// sense.
+    bool advance();
+
+    /// The client asked for UDP ASSOCIATE: open a relay for its
+    /// datagrams, and return where it is.
+    std::string open_relay() {
+        udpFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_in address = loopback(0);
+        if (udpFd < 0 || bind(udpFd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            throw std::runtime_error("mock could not open UDP relay");
+        }
+        int size = 4 << 20;
+        setsockopt(udpFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(udpFd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        loop.add(udpFd, EPOLLIN, this);
+        address.sin_port = htons(bound_port(udpFd));
+        return std::string((const char*)&address.sin_addr, 4) + std::string((const char*)&address.sin_port, 2);
+    }
+
+    void receive_datagrams();
+};
+
+/// An upstream proxy speaking one protocol, which is also every tunnel's
+/// target, on a thread of its own.
+class MockUpstream : public EventHandler {
+public:
+    const std::string protocol;
+    /// Datagrams received by UDP relays.
+    std::atomic<uint64_t> datagrams;
+    /// Whether UDP relays are flooding their clients.
+    std::atomic<bool> flooding;
+
+private:
+    EventLoop loop;
+    int listeningSocketFd;
+    int port;
+    std::unordered_set<MockConnection*> connections;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+public:
+    explicit MockUpstream(const std::string& protocol):
+        protocol(protocol),
+        datagrams(0),
+        flooding(false),
+        stopping(false)
+    {
+        listeningSocketFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_in address = loopback(0);
+        if (listeningSocketFd < 0
+            || bind(listeningSocketFd, (struct sockaddr*)&address, sizeof(address)) < 0
+            || listen(listeningSocketFd, 4096) < 0) {
+            throw std::runtime_error("mock could not listen");
+        }
+        port = bound_port(listeningSocketFd);
+        loop.add(listeningSocketFd, EPOLLIN, this);
+        thread = std::thread([this] {
+                while (!stopping) {
+                    bool flood = flooding;
+                    loop.run_once(flood ? 0 : 100);
+                    if (flood) {
+                        for (MockConnection* connection : connections) {
+                            connection->flood();
+                        }
+                    }
+                }
+            });
+    }
+
+    ~MockUpstream() override {
+        stopping = true;
+        thread.join();
+        while (!connections.empty()) {
+            delete *connections.begin();
+        }
+        close(listeningSocketFd);
+    }
+
+    int get_port() const {
+        return port;
+    }
+
+    void handle_event(int fd, uint32_t events) override {
+        (void)events;
+        while (true) {
+            int acceptedSocketFd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (acceptedSocketFd < 0) {
+                return;
+            }
+            connections.insert(new MockConnection(*this, loop, acceptedSocketFd));
+        }
+    }
+
+    void forget(MockConnection* connection) {
+        connections.erase(connection);
+    }
+};
+
+MockConnection::MockConnection(MockUpstream& mock, EventLoop& loop, int fd):
+    mock(mock),
+    loop(loop),
+    fd(fd),
+    udpFd(-1),
+    phase(mock.protocol == "socks5" ? Phase::GREETING : Phase::REQUEST),
+    sunk(0),
+    closing(false),
+    finished(false),
+    watching(EPOLLIN)
+{
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    loop.add(fd, EPOLLIN, this);
+}
+
+MockConnection::~MockConnection() {
+    if (!finished) {
+        loop.remove(fd);
+        if (udpFd >= 0) {
+            loop.remove(udpFd);
+        }
+        mock.forget(this);
+    }
+    if (udpFd >= 0) {
+        close(udpFd);
+    }
+    close(fd);
+}
+
+void MockConnection::receive_datagrams() {
+    char buffer[65536];
+    uint64_t count = 0;
+    for (int i = 0; i < 256; i++) {
+        socklen_t sourceLength = sizeof(datagramSource);
+        ssize_t r = recvfrom(udpFd, buffer, sizeof(buffer), 0, (struct sockaddr*)&datagramSource, &sourceLength);
+        if (r < 0) {
+            break;
+        }
+        count++;
+        if (mock.flooding) {
+            datagram.assign(buffer, r);
+        }
+    }
+    mock.datagrams.fetch_add(count, std::memory_order_relaxed);
+}
+
+void MockConnection::finish() {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    loop.remove(fd);
+    if (udpFd >= 0) {
+        loop.remove(udpFd);
+    }
+    mock.forget(this);
+    loop.retire(this);
+}
+
+bool MockConnection::advance() {
+    while (true) {
+        switch (phase) {
+        case Phase::GREETING:
+            if (in.size() < 2 || in.size() < 2 + size_t((uint8_t)in[1])) {
+                return true;
+            }
+            in.erase(0, 2 + (uint8_t)in[1]);
+            out += std::string("\x05\x00", 2);
+            phase = Phase::REQUEST;
+            break;
+        case Phase::REQUEST:
+            if (mock.protocol == "http") {
+                // transproxify ends lines with just '\n'.
+                size_t end = in.find("\n\n");
+                size_t crlfEnd = in.find("\r\n\r\n");
+                if (end == std::string::npos && crlfEnd == std::string::npos) {
+                    return in.size() < 8192;
+                }
+                in.erase(0, std::min(end == std::string::npos ? end : end + 2, crlfEnd == std::string::npos ? crlfEnd : crlfEnd + 4));
+                out += "HTTP/1.1 200 Connection established\r\n\r\n";
+            } else if (mock.protocol == "socks4") {
+                size_t end = in.size() > 8 ? in.find('\0', 8) : std::string::npos;
+                if (end == std::string::npos) {
+                    return in.size() < 1024;
+                }
+                in.erase(0, end + 1);
+                out += std::string("\x00\x5a\x00\x00\x00\x00\x00\x00", 8);
+            } else {
+                if (in.size() < 5) {
+                    return true;
+                }
+                size_t addressLength = in[3] == 1 ? 4 : in[3] == 4 ? 16 : 1 + (uint8_t)in[4];
+                if (in.size() < 4 + addressLength + 2) {
+                    return true;
+                }
+                bool associate = in[1] == 3;
+                in.erase(0, 4 + addressLength + 2);
+                std::string bound = associate ? open_relay() : std::string(6, '\0');
+                out += std::string("\x05\x00\x00\x01", 4) + bound;
+            }
+            phase = Phase::MODE;
+            break;
+        case Phase::MODE:
+            if (in.empty()) {
+                return true;
+            }
+            phase = in[0] == 'S' ? Phase::SINK : Phase::ECHO;
+            in.erase(0, 1);
+            break;
+        case Phase::ECHO:
+            out += in;
+            in.clear();
+            return true;
+        case Phase::SINK:
+            sunk += in.size();
+            in.clear();
+            return true;
+        }
+    }
+}
+
+
+/// transproxify, run as a child process for the length of one benchmark.
+class Subject {
+private:
+    pid_t pid;
+
+public:
+    Subject(const std::string& path, const std::vector<std::string>& args) {
+        pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error("could not fork");
+        }
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDERR_FILENO);
+            std::vector<char*> argv;
+            argv.push_back((char*)path.c_str());
+            for (const std::string& arg : args) {
+                argv.push_back((char*)arg.c_str());
+            }
+            argv.push_back(nullptr);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+    }
+
+    Subject(const Subject&) = delete;
+    Subject& operator=(const Subject&) = delete;
+
+    ~Subject() {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+
+    bool alive() {
+        return waitpid(pid, nullptr, WNOHANG) == 0;
+    }
+
+    /// Wait for it to take TCP connections on port.
+    bool wait_for_tcp(int port) {
+        for (int i = 0; i < 100 && alive(); i++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in address = loopback(port);
+            bool up = connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+            close(fd);
+            if (up) {
+                return true;
+            }
+            usleep(50000);
+        }
+        return false;
+    }
+};
+
+
+/// Drives many tunnels at once from one thread: each connects, sends a
+/// ping, and waits for it back.
+class Probe;
+
+class LoadGenerator {
+public:
+    EventLoop loop;
+    int port;
+    /// Start another tunnel as each finishes, rather than holding it open.
+    bool recycle;
+    std::vector<uint64_t> latenciesUs;
+    size_t established = 0;
+    size_t failures = 0;
+
+    std::unordered_set<Probe*> probes;
+
+    LoadGenerator(int port, bool recycle):
+        port(port),
+        recycle(recycle)
+    {
+    }
+
+    ~LoadGenerator();
+
+    void open_tunnel();
+
+    void run_for(uint64_t durationUs) {
+        uint64_t end = now_us() + durationUs;
+        while (now_us() < end) {
+            loop.run_once(10);
+        }
+    }
+};
+
+class Probe : public EventHandler {
+private:
+    LoadGenerator& generator;
+    int fd;
+    uint64_t startUs;
+    bool connected;
+    size_t received;
+
+public:
+    Probe(LoadGenerator& generator):
+        generator(generator),
+        startUs(now_us()),
+        connected(false),
+        received(0)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("could not open probe socket");
+        }
+        struct sockaddr_in address = loopback(generator.port);
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            throw std::runtime_error("could not connect probe");
+        }
+        generator.loop.add(fd, EPOLLOUT, this);
+        generator.probes.insert(this);
+    }
+
+    ~Probe() override {
+        generator.loop.remove(fd);
+        close(fd);
+        generator.probes.erase(this);
+    }
+
+    void handle_event(int eventFd, uint32_t events) override {
+        (void)eventFd;
+        if (!connected) {
+            int error = 0;
+            socklen_t errorLength = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+            char ping[BENCH_PING_SIZE + 1];
+            ping[0] = 'E';
+            std::memset(ping + 1, 'p', BENCH_PING_SIZE);
+            if (error != 0 || (events & EPOLLERR) || send(fd, ping, sizeof(ping), MSG_NOSIGNAL) != sizeof(ping)) {
+                fail();
+                return;
+            }
+            connected = true;
+            generator.loop.modify(fd, EPOLLIN);
+            return;
+        }
+        char buffer[BENCH_PING_SIZE];
+        ssize_t r = recv(fd, buffer, sizeof(buffer), 0);
+        if (r <= 0) {
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            fail();
+            return;
+        }
+        if (received < BENCH_PING_SIZE) {
+            received += r;
+            if (received >= BENCH_PING_SIZE) {
+                generator.latenciesUs.push_back(now_us() - startUs);
+                generator.established++;
+                if (generator.recycle) {
+                    done();
+                }
+            }
+        }
+    }
+
+private:
+    void fail() {
+        if (received >= BENCH_PING_SIZE) {
+            generator.established--;
+        }
+        generator.failures++;
+        done();
+    }
+
+    void done() {
+        generator.loop.remove(fd);
+        generator.probes.erase(this);
+        generator.loop.retire(this);
+        if (generator.recycle) {
+            generator.open_tunnel();
+        }
+    }
+};
+
+LoadGenerator::~LoadGenerator() {
+    recycle = false;
+    while (!probes.empty()) {
+        delete *probes.begin();
+    }
+}
+
+void LoadGenerator::open_tunnel() {
+    try {
+        new Probe(*this);
+    } catch (const std::exception&) {
+        failures++;
+    }
+}
+
+
+struct Options {
+    std::string transproxify;
+    std::vector<std::string> engines{"fork", "epoll", "splice", "uring"};
+    std::vector<std::string> protocols{"http", "socks4", "socks5"};
+    int seconds = 5;
+    int connectConcurrency = 64;
+    int concurrentTunnels = 2000;
+    int threads = 2;
+    int streams = 4;
+    int megabytesPerStream = 256;
+    int udpSockets = 8;
+};
+
+/// Results, as a line of JSON.
+class Result {
+private:
+    std::ostringstream fields;
+
+public:
+    Result(const char* test, const std::string& engine, const std::string& protocol) {
+        fields << "{\"test\":\"" << test << "\",\"engine\":\"" << engine << "\",\"protocol\":\"" << protocol << "\"";
+    }
+
+    template <typename T>
+    Result& add(const char* name, T value) {
+        fields << ",\"" << name << "\":" << value;
+        return *this;
+    }
+
+    Result& add(const char* name, const char* value) {
+        fields << ",\"" << name << "\":\"" << value << "\"";
+        return *this;
+    }
+
+    void emit() {
+        std::cout << fields.str() << "}" << std::endl;
+    }
+};
+
+/// Each of parts' share of total, rounding up.
+static int share(int total, int parts) {
+    return (total + parts - 1) / parts;
+}
+
+static std::vector<std::string> engine_args(const std::string& engine) {
+    if (engine == "fork") {
+        return {"-e", "fork"};
+    } else if (engine == "epoll") {
+        return {"-e", "epoll"};
+    } else if (engine == "splice") {
+        return {"-e", "epoll", "-R", "splice"};
+    } else if (engine == "uring") {
+        return {"-e", "uring"};
+    } else if (engine == "uring-splice") {
+        return {"-e", "uring", "-R", "splice"};
+    }
+    throw std::runtime_error("unknown engine " + engine);
+}
+
+/// Tunnels set up and torn down as fast as they'll go.
+static void bench_connect(const Options& options, const std::string& engine, const std::string& protocol, int port) {
+    std::vector<std::unique_ptr<LoadGenerator>> generators;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; t++) {
+        generators.emplace_back(new LoadGenerator(port, true));
+    }
+    for (int t = 0; t < options.threads; t++) {
+        LoadGenerator* generator = generators[t].get();
+        threads.emplace_back([generator, &options] {
+                for (int i = share(options.connectConcurrency, options.threads); i > 0; i--) {
+                    generator->open_tunnel();
+                }
+                generator->run_for(uint64_t(options.seconds) * 1000000);
+            });
+    }
+    std::vector<uint64_t> latencies;
+    size_t failures = 0;
+    for (int t = 0; t < options.threads; t++) {
+        threads[t].join();
+        latencies.insert(latencies.end(), generators[t]->latenciesUs.begin(), generators[t]->latenciesUs.end());
+        failures += generators[t]->failures;
+    }
+    Result("connect", engine, protocol)
+        .add("connects_per_second", double(latencies.size()) / options.seconds)
+        .add("handshake_p50_ms", percentile(latencies, 0.50) / 1000)
+        .add("handshake_p99_ms", percentile(latencies, 0.99) / 1000)
+        .add("failures", failures)
+        .emit();
+}
+
+/// As many tunnels open at once as asked for, held for a second.
+static void bench_concurrent(const Options& options, const std::string& engine, const std::string& protocol, int port) {
+    LoadGenerator generator(port, false);
+    uint64_t start = now_us();
+    for (int i = 0; i < options.concurrentTunnels; i++) {
+        generator.open_tunnel();
+        if (i % 64 == 63) {
+            // Don't let the listen queue overflow.
+            generator.loop.run_once(0);
+        }
+    }
+    while (generator.established + generator.failures < size_t(options.concurrentTunnels) && now_us() - start < 30000000) {
+        generator.loop.run_once(10);
+    }
+    double seconds = (now_us() - start) / 1e6;
+    generator.run_for(1000000);
+    Result("concurrent", engine, protocol)
+        .add("tunnels", options.concurrentTunnels)
+        .add("established", generator.established)
+        .add("establish_seconds", seconds)
+        .add("failures", generator.failures)
+        .emit();
+}
+
+/// Bulk data through a few tunnels at once.
+static void bench_bulk(const Options& options, const std::string& engine, const std::string& protocol, int port) {
+    uint64_t bytesPerStream = uint64_t(options.megabytesPerStream) << 20;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    uint64_t start = now_us();
+    for (int s = 0; s < options.streams; s++) {
+        threads.emplace_back([port, bytesPerStream, &failures] {
+                int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                Cleaner fdCleaner([fd] {
+                        close(fd);
+                    });
+                struct sockaddr_in address = loopback(port);
+                if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || !send_all(fd, "S", 1)) {
+                    failures++;
+                    return;
+                }
+                std::vector<char> chunk(256 << 10, 'x');
+                for (uint64_t sent = 0; sent < bytesPerStream; ) {
+                    size_t len = std::min<uint64_t>(chunk.size(), bytesPerStream - sent);
+                    if (!send_all(fd, chunk.data(), len)) {
+                        failures++;
+                        return;
+                    }
+                    sent += len;
+                }
+                shutdown(fd, SHUT_WR);
+                uint64_t sunk = 0;
+                if (!recv_all(fd, (char*)&sunk, sizeof(sunk)) || sunk != bytesPerStream) {
+                    failures++;
+                }
+            });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = (now_us() - start) / 1e6;
+    Result("bulk", engine, protocol)
+        .add("streams", options.streams)
+        .add("bytes", bytesPerStream * options.streams)
+        .add("gbit_per_second", bytesPerStream * options.streams * 8 / seconds / 1e9)
+        .add("failures", failures.load())
+        .emit();
+}
+
+/// SOCKS5 UDP datagrams through transproxify as fast as they'll go,
+/// first towards the mock's relay, then back from it.
+static void bench_udp(const Options& options, const std::string& engine, int port, MockUpstream& mock) {
+    std::vector<int> fds;
+    Cleaner fdsCleaner([&fds] {
+            for (int fd : fds) {
+                close(fd);
+            }
+        });
+    struct sockaddr_in address = loopback(port);
+    std::vector<struct pollfd> polls;
+    for (int i = 0; i < options.udpSockets; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            throw std::runtime_error("could not open UDP socket");
+        }
+        fds.push_back(fd);
+        polls.push_back({fd, POLLIN, 0});
+    }
+    char payload[BENCH_UDP_PAYLOAD] = {};
+    uint64_t duration = uint64_t(options.seconds) * 1000000;
+
+    uint64_t sent = 0;
+    uint64_t before = mock.datagrams;
+    uint64_t start = now_us();
+    while (now_us() - start < duration) {
+        for (int fd : fds) {
+            for (int i = 0; i < 16; i++) {
+                if (send(fd, payload, sizeof(payload), 0) == sizeof(payload)) {
+                    sent++;
+                }
+            }
+        }
+    }
+    double seconds = (now_us() - start) / 1e6;
+    // Let the stragglers through.
+    usleep(200000);
+    uint64_t relayed = mock.datagrams - before;
+    Result("udp", engine, "socks5")
+        .add("direction", "upstream")
+        .add("sockets", options.udpSockets)
+        .add("sent", sent)
+        .add("relayed", relayed)
+        .add("pps", relayed / seconds)
+        .emit();
+
+    mock.flooding = true;
+    Cleaner floodingCleaner([&mock] {
+            mock.flooding = false;
+        });
+    uint64_t received = 0;
+    std::vector<uint64_t> lastHeard(fds.size(), 0);
+    start = now_us();
+    while (now_us() - start < duration) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            // Until the relay knows where to send, and in case that's lost.
+            if (now_us() - lastHeard[i] > 100000) {
+                send(fds[i], payload, sizeof(payload), 0);
+                lastHeard[i] = now_us();
+            }
+        }
+        if (poll(polls.data(), polls.size(), 10) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+            char buffer[65536];
+            while (recv(fds[i], buffer, sizeof(buffer), 0) > 0) {
+                received++;
+                lastHeard[i] = now_us();
+            }
+        }
+    }
+    seconds = (now_us() - start) / 1e6;
+    Result("udp", engine, "socks5")
+        .add("direction", "downstream")
+        .add("sockets", options.udpSockets)
+        .add("received", received)
+        .add("pps", received / seconds)
+        .emit();
+}
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+static int positive(const char* arg) {
+    int value = 0;
+    try {
+        value = std::stoi(arg);
+    } catch (const std::exception&) {
+    }
+    if (value < 1) {
+        throw std::runtime_error(std::string("bad number ") + arg);
+    }
+    return value;
+}
+
+static void print_usage() {
+    std::cerr << R"END_USAGE(Usage:
+    transproxify-bench [OPTIONS...] TRANSPROXIFY
+
+TRANSPROXIFY must be built with -DALLOW_DIRECT_CONNECTIONS (make bench
+does so). Results are printed to stdout as JSON, one object per line.
+
+Options:
+    -e ENGINES      Comma separated TCP engines: fork, epoll, splice, uring,
+                    uring-splice. Default is all but uring-splice.
+    -t PROTOCOLS    Comma separated proxy protocols: http, socks4, socks5.
+                    Default is all three.
+    -d SECONDS      Length of each timed run. Default is 5.
+    -n TUNNELS      Tunnels in flight during the connect run. Default is 64.
+    -c TUNNELS      Tunnels held open at once. Default is 2000, or as many
+                    as the file descriptor limit allows.
+    -j THREADS      Load generating threads for the connect run. Default
+                    is 2.
+    -s STREAMS      Tunnels used at once for the bulk run. Default is 4.
+    -b MEGABYTES    Sent through each bulk tunnel. Default is 256.
+    -u SOCKETS      Client sockets for the UDP run. Default is 8.
+)END_USAGE";
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    int c;
+    try {
+        while ((c = getopt(argc, argv, "e:t:d:n:c:j:s:b:u:")) != -1) {
+            switch (c) {
+            case 'e':
+                options.engines = split(optarg);
+                break;
+            case 't':
+                options.protocols = split(optarg);
+                break;
+            case 'd':
+                options.seconds = positive(optarg);
+                break;
+            case 'n':
+                options.connectConcurrency = positive(optarg);
+                break;
+            case 'c':
+                options.concurrentTunnels = positive(optarg);
+                break;
+            case 'j':
+                options.threads = positive(optarg);
+                break;
+            case 's':
+                options.streams = positive(optarg);
+                break;
+            case 'b':
+                options.megabytesPerStream = positive(optarg);
+                break;
+            case 'u':
+                options.udpSockets = positive(optarg);
+                break;
+            default:
+                print_usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        print_usage();
+        return 1;
+    }
+    if (argc - optind != 1) {
+        print_usage();
+        return 1;
+    }
+    options.transproxify = argv[optind];
+
+    // transproxify inherits this too. Each held tunnel costs two
+    // descriptors here and two there.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    int most = (int(std::min<rlim_t>(limit.rlim_cur, 1 << 20)) - 128) / 2;
+    if (options.concurrentTunnels > most) {
+        std::cerr << "Holding " << most << " tunnels at once, not " << options.concurrentTunnels
+                  << ", for lack of file descriptors" << std::endl;
+        options.concurrentTunnels = most;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        for (const std::string& protocol : options.protocols) {
+            MockUpstream mock(protocol);
+            for (const std::string& engine : options.engines) {
+                std::cerr << "TCP " << engine << " " << protocol << std::endl;
+                int port = free_port();
+                std::vector<std::string> args = engine_args(engine);
+                for (const char* arg : {"-v", "error", "-t"}) {
+                    args.push_back(arg);
+                }
+                args.push_back(protocol);
+                args.push_back("127.0.0.1");
+                args.push_back(std::to_string(mock.get_port()));
+                args.push_back(std::to_string(port));
+                Subject subject(options.transproxify, args);
+                if (!subject.wait_for_tcp(port)) {
+                    throw std::runtime_error("transproxify did not start");
+                }
+                bench_connect(options, engine, protocol, port);
+                bench_concurrent(options, engine, protocol, port);
+                bench_bulk(options, engine, protocol, port);
+            }
+        }
+
+        bool socks5 = std::find(options.protocols.begin(), options.protocols.end(), "socks5") != options.protocols.end();
+        if (socks5) {
+            std::cerr << "UDP socks5" << std::endl;
+            MockUpstream mock("socks5");
+            int port = free_port();
+            Subject subject(options.transproxify, {"-r", "udp", "-t", "socks5", "-v", "error",
+                                                   "127.0.0.1", std::to_string(mock.get_port()), std::to_string(port)});
+            usleep(500000);
+            if (subject.alive()) {
+                bench_udp(options, "epoll", port, mock);
+            } else {
+                std::cerr << "Skipped UDP: transproxify could not start (needs CAP_NET_ADMIN for TPROXY)" << std::endl;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,28 +1,40 @@
 // Copyright Ashley Newson 2018
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include <cstring>
-#include <regex>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
 #include <termios.h>
 
 #include "Util.hpp"
 #include "Cleaner.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "MetricsServer.hpp"
 #include "ProxySettings.hpp"
+#include "LiveSettings.hpp"
+#include "Handoff.hpp"
 #include "TcpServer.hpp"
 #include "UdpServer.hpp"
 
@@ -71,6 +83,12 @@ Synopsis:
             --match multiport --dports 80,443 \
             -j REDIRECT --to-port 10000
 
+    The listening port takes IPv6 as well as IPv4, so IPv6 traffic can be
+    redirected to it in the same way with ip6tables. Tunnels to IPv6 targets
+    ask the proxy for them by address (SOCKS4, which has no room for one,
+    gets it by name instead), and PROXY_HOST may be an IPv6 address or a
+    name resolving to one.
+
 Options:
     -r PROXIED_PROTOCOL
         Specify the transport layer protocol to redirect via the given proxy.
@@ -80,6 +98,145 @@ Options:
         Specify the upstream proxy's protocol. Default is http.
         Valid choices for TCP are: direct, http, socks4, socks5
         Valid choices for UDP are: direct, socks5
+    -e TCP_ENGINE
+        Specify how TCP tunnels are driven. Default is epoll.
+        Valid choices are:
+          epoll: all tunnels are multiplexed by a single process.
+          uring: like epoll, but connections are accepted and tunnels
+                 relayed through io_uring, batching the system calls of
+                 many tunnels into one. Needs Linux 5.19 or later, and
+                 falls back to epoll without it.
+          fork:  each tunnel gets its own process (the original behaviour).
+    -R RELAY_ENGINE
+        Specify how TCP tunnel data is moved. Default is copy.
+        Valid choices are:
+          copy:   read into and write from a userspace buffer.
+          splice: move data through a pipe with splice(2), so it never
+                  leaves the kernel. Uses two extra pipes per tunnel.
+    -w WORKERS
+        Number of worker threads. Default is 1. Each worker has its own
+        socket (using SO_REUSEPORT) and event loop. For TCP, which needs the
+        epoll or uring engine, the kernel spreads new connections across
+        them. For UDP, each worker is a shard with its own associations,
+        reply sockets and SOCKS5 sessions, and the kernel steers every
+        datagram of a flow (by a hash of its addresses and ports) to the
+        same shard, so shards never share anything.
+    -a
+        Pin each worker thread to its own CPU.
+    -i SECONDS
+        Drop UDP associations after this many seconds without traffic in
+        either direction. Default is 300.
+    -m ASSOCIATIONS
+        Most UDP associations to keep at once, split evenly between
+        workers. When a worker is full, one is dropped to make room: the
+        least recently active of those belonging to clients with at least
+        their fair share, so that a single client can't crowd out the
+        others. Default is 256.
+    -s SESSIONS
+        Number of idle SOCKS5 UDP ASSOCIATE sessions to keep ready, so that
+        new UDP associations needn't wait for a handshake with the proxy.
+        Sessions are shared by associations with different targets. Default
+        is 4. Each UDP worker keeps its own.
+    -l RATE[:BURST]
+        Let each client address open at most RATE new TCP tunnels or UDP
+        associations a second, or BURST (default RATE, at least 1) in one
+        go, over all workers. Anything more is refused straight away,
+        before any work upstream: connections are closed and the
+        datagrams dropped. Default is no limit.
+    -n TUNNELS
+        Most TCP tunnels open at once, over all workers (or processes, with
+        -e fork). New connections beyond that are closed straight away.
+        Default is no limit. (UDP associations are limited by -m.)
+    -O
+        Pipeline the SOCKS5 handshake: send the greeting, authentication and
+        CONNECT request in one go rather than waiting for each reply, saving
+        two round trips to the proxy. If the proxy fails the handshake
+        before answering the request, transproxify retries the usual way
+        and stops pipelining.
+    -F
+        Forward whatever the client has sent by the time the upstream
+        connection is made straight after the SOCKS5 CONNECT request,
+        without waiting for the proxy's reply.
+    -H
+        Ask the upstream proxy for the target by name rather than by
+        address, where the client's first bytes name it: the server name
+        (SNI) of a TLS ClientHello, or the Host header of an HTTP request.
+        This lets the proxy apply per-domain policy and use its own DNS.
+        The client's bytes are only peeked at, so the target still gets
+        them untouched. Clients which don't speak first are held up by
+        200ms before going ahead by address. HTTP proxies get a CONNECT
+        by hostname, SOCKS4 proxies a SOCKS4a request, and SOCKS5 proxies
+        a domain name address.
+    -c CONNECTIONS
+        Keep this many idle connections to the upstream proxy ready in each
+        worker, so that new tunnels needn't wait for a TCP handshake (nor,
+        for SOCKS5, greeting and authentication) with the proxy, but only
+        for the CONNECT request. Needs the epoll or uring engine. Default is
+        0 (no pool).
+    -C SECONDS
+        Drop pooled upstream connections after this many seconds idle,
+        before the proxy loses patience with them. Default is 30.
+    -x HOST:PORT[:WEIGHT]
+        Spread tunnels (and SOCKS5 UDP sessions) over another upstream
+        proxy as well as PROXY_HOST, with the same protocol and credentials.
+        An IPv6 HOST goes in brackets, as in [2001:db8::1]:1080.
+        May be given more than once. A proxy with twice the WEIGHT gets
+        about twice the share. Default weight is 1. If connecting to a
+        proxy or negotiating with it fails, the tunnel is retried through
+        another, and the failed proxy is avoided for a while, backing off
+        from 1 to 30 seconds. Each proxy is also checked every 5 seconds.
+    -B POLICY
+        How to choose between upstream proxies. Valid values are:
+          leastconn: the fewest tunnels for its weight (default).
+          latency:   the quickest to connect and negotiate with lately,
+                     allowing for its load and weight.
+    -o SIDE:OPTION[=VALUE]
+        Set a TCP socket option on client connections (SIDE client) or on
+        connections to the upstream proxy (SIDE upstream). May be given
+        more than once. Valid options are:
+          nodelay:             TCP_NODELAY, sending small writes at once.
+          quickack:            TCP_QUICKACK, not delaying the first ACKs.
+          rcvbuf=BYTES:        SO_RCVBUF.
+          sndbuf=BYTES:        SO_SNDBUF.
+          notsent_lowat=BYTES: TCP_NOTSENT_LOWAT, limiting how much unsent
+                               data the kernel will queue.
+          fastopen[=QUEUE]:    TCP Fast Open. For clients, accept it, with a
+                               queue length of QUEUE (default 256). Upstream,
+                               send the start of the handshake in the SYN
+                               (not for direct connections). Also needs
+                               the net.ipv4.tcp_fastopen sysctl.
+    -v LEVEL
+        How much to log. Valid choices are: error, warn, info, debug.
+        Default is info: tunnels opening and closing, and anything going
+        wrong. Messages for each datagram are only logged at debug.
+    -S N
+        Log only one in every N of each kind of per-datagram message, so
+        that debug logging can keep up with busy UDP traffic. Default is 1
+        (log them all).
+    -M ENDPOINT
+        Serve live counters and histograms (tunnels, bytes relayed,
+        handshake times, upstream failures, UDP associations and drops) in
+        the Prometheus text format over HTTP at ENDPOINT. ENDPOINT is PORT
+        (on 127.0.0.1), ADDRESS:PORT, or the path of a unix socket. Any
+        path other than / or /metrics is a 404.
+    -f FILE
+        Read options and arguments from FILE as well, separated by
+        whitespace as on the command line, with anything from a # to the
+        end of a line ignored. Options on the command line win over those
+        in FILE. On SIGHUP, FILE is read again, and what it says is used
+        for new tunnels and UDP associations (those already open carry on
+        as they were). -r, -e, -w, -a, -i, -m, -M, -U and LISTEN_PORT (and,
+        for UDP, -t) only change on restart. A password from -p is kept.
+        If FILE no longer makes sense, the settings are left as they were.
+    -U PATH
+        Hand off to a new instance without refusing or cutting off any
+        connection. On startup, ask whichever instance listens at the unix
+        socket PATH for its listening sockets (and its -M endpoint's), then
+        listen there for the next instance. An instance which has handed
+        off stops accepting, and exits once its tunnels and UDP
+        associations have all finished. Both instances must proxy the same
+        protocol, and if on the same LISTEN_PORT, with the same number of
+        workers; if not, the new instance doesn't start.
     -u USERNAME
         Specify the username for proxy authentication.
 
@@ -206,83 +363,514 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 }
 
 
-int main(int argc, char **argv) {
+/// Everything given as options and arguments, whether on the command line
+/// or in a settings file.
+struct Options {
     ProxySettings::ProxyProtocol proxyProtocol = ProxySettings::ProxyProtocol::HTTP;
     ProxySettings::ProxiedProtocol proxiedProtocol = ProxySettings::ProxiedProtocol::TCP;
+    ProxySettings::TcpEngine tcpEngine = ProxySettings::TcpEngine::EPOLL;
+    ProxySettings::RelayEngine relayEngine = ProxySettings::RelayEngine::COPY;
+    int workers = 1;
+    bool pinWorkers = false;
+    int udpTimeout = UDP_PROXY_TIMEOUT;
+    int udpProxyLimit = UDP_PROXY_LIMIT;
+    int udpSessionPool = SOCKS5_UDP_POOL_SIZE;
+    double admissionRate = 0;
+    double admissionBurst = 0;
+    int maxTunnels = 0;
+    bool socks5Pipelining = false;
+    bool earlyData = false;
+    bool peekTargetName = false;
+    int upstreamPool = 0;
+    int upstreamPoolIdle = UPSTREAM_POOL_IDLE;
+    SocketTuning clientSocket;
+    SocketTuning upstreamSocket;
+    std::vector<std::string> extraUpstreams;
+    UpstreamSet::Policy upstreamPolicy = UpstreamSet::Policy::LEAST_CONNECTIONS;
     std::string proxyHost;
     int proxyPort = 0;
     int listenPort = 0;
     std::string username;
     std::string password;
     bool promptPassword = false;
+    LogLevel logLevel = LogLevel::INFO;
+    int logSampleEvery = 1;
+    std::string metricsEndpoint;
+    std::string settingsFile;
+    std::string handoffPath;
+    bool showLicense = false;
+    std::vector<std::string> arguments;
+};
+
+/// The words of a settings file: options and arguments as they'd be given
+/// on the command line, separated by whitespace, with anything from a '#'
+/// to the end of a line ignored.
+std::vector<std::string> read_settings_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::invalid_argument("Could not read settings file " + path);
+    }
+    std::vector<std::string> words;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream lineWords(line.substr(0, line.find('#')));
+        std::string word;
+        while (lineWords >> word) {
+            words.push_back(word);
+        }
+    }
+    return words;
+}
+
+/// Parse words (without the program name) into options. Throws
+/// std::invalid_argument for anything bad.
+void parse_options(const std::vector<std::string>& words, bool inSettingsFile, Options& options) {
+    std::vector<std::string> copies(1, "transproxify");
+    copies.insert(copies.end(), words.begin(), words.end());
+    std::vector<char*> argv;
+    for (std::string& copy : copies) {
+        argv.push_back(&copy[0]);
+    }
+    argv.push_back(nullptr);
+    int argc = int(copies.size());
 
+    // Start afresh, as this may be a second go.
+    optind = 0;
     int c;
-    while ((c = getopt(argc, argv, "t:r:u:pP:L")) != -1) {
+    while ((c = getopt(argc, argv.data(), "f:U:t:r:e:R:w:ai:m:s:l:n:OFHc:C:x:B:o:v:S:M:u:pP:L")) != -1) {
         switch (c) {
+        case 'f':
+            if (inSettingsFile) {
+                throw std::invalid_argument("Settings files can't name other settings files");
+            }
+            options.settingsFile = optarg;
+            break;
+        case 'U':
+            options.handoffPath = optarg;
+            break;
         case 't':
             if (strcmp(optarg, "direct") == 0) {
-                proxyProtocol = ProxySettings::ProxyProtocol::DIRECT;
+                options.proxyProtocol = ProxySettings::ProxyProtocol::DIRECT;
             }
             else if (strcmp(optarg, "http") == 0) {
-                proxyProtocol = ProxySettings::ProxyProtocol::HTTP;
+                options.proxyProtocol = ProxySettings::ProxyProtocol::HTTP;
             }
             else if (strcmp(optarg, "socks4") == 0) {
-                proxyProtocol = ProxySettings::ProxyProtocol::SOCKS4;
+                options.proxyProtocol = ProxySettings::ProxyProtocol::SOCKS4;
             }
             else if (strcmp(optarg, "socks5") == 0) {
-                proxyProtocol = ProxySettings::ProxyProtocol::SOCKS5;
+                options.proxyProtocol = ProxySettings::ProxyProtocol::SOCKS5;
             }
             else {
-                std::cerr << "Unknown proxy protocol" << std::endl;
-                print_usage();
-                exit(1);
+                throw std::invalid_argument("Unknown proxy protocol");
             }
             break;
         case 'r':
             if (strcmp(optarg, "tcp") == 0) {
-                proxiedProtocol = ProxySettings::ProxiedProtocol::TCP;
+                options.proxiedProtocol = ProxySettings::ProxiedProtocol::TCP;
             }
             else if (strcmp(optarg, "udp") == 0) {
-                proxiedProtocol = ProxySettings::ProxiedProtocol::UDP;
+                options.proxiedProtocol = ProxySettings::ProxiedProtocol::UDP;
+            }
+            else {
+                throw std::invalid_argument("Unknown proxied protocol");
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                options.tcpEngine = ProxySettings::TcpEngine::EPOLL;
+            }
+            else if (strcmp(optarg, "uring") == 0) {
+                options.tcpEngine = ProxySettings::TcpEngine::URING;
+            }
+            else if (strcmp(optarg, "fork") == 0) {
+                options.tcpEngine = ProxySettings::TcpEngine::FORK;
             }
             else {
-                std::cerr << "Unknown proxied protocol" << std::endl;
-                print_usage();
-                exit(1);
+                throw std::invalid_argument("Unknown TCP engine");
             }
             break;
+        case 'R':
+            if (strcmp(optarg, "copy") == 0) {
+                options.relayEngine = ProxySettings::RelayEngine::COPY;
+            }
+            else if (strcmp(optarg, "splice") == 0) {
+                options.relayEngine = ProxySettings::RelayEngine::SPLICE;
+            }
+            else {
+                throw std::invalid_argument("Unknown relay engine");
+            }
+            break;
+        case 'w':
+            try {
+                options.workers = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.workers = 0;
+            }
+            if (options.workers < 1) {
+                throw std::invalid_argument("Bad worker count");
+            }
+            break;
+        case 'a':
+            options.pinWorkers = true;
+            break;
+        case 'i':
+            try {
+                options.udpTimeout = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.udpTimeout = 0;
+            }
+            if (options.udpTimeout < 1) {
+                throw std::invalid_argument("Bad UDP timeout");
+            }
+            break;
+        case 'm':
+            try {
+                options.udpProxyLimit = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.udpProxyLimit = 0;
+            }
+            if (options.udpProxyLimit < 1) {
+                throw std::invalid_argument("Bad UDP association limit");
+            }
+            break;
+        case 's':
+            try {
+                options.udpSessionPool = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.udpSessionPool = -1;
+            }
+            if (options.udpSessionPool < 0) {
+                throw std::invalid_argument("Bad SOCKS5 UDP session count");
+            }
+            break;
+        case 'l':
+            {
+                std::string limit(optarg);
+                size_t colon = limit.find(':');
+                try {
+                    options.admissionRate = std::stod(limit.substr(0, colon));
+                    options.admissionBurst = colon == std::string::npos ? std::max(1.0, options.admissionRate)
+                        : std::stod(limit.substr(colon + 1));
+                } catch (const std::exception&) {
+                    options.admissionRate = 0;
+                }
+                if (!(options.admissionRate > 0) || !(options.admissionBurst >= 1)) {
+                    throw std::invalid_argument("Bad client rate limit");
+                }
+            }
+            break;
+        case 'n':
+            try {
+                options.maxTunnels = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.maxTunnels = 0;
+            }
+            if (options.maxTunnels < 1) {
+                throw std::invalid_argument("Bad tunnel limit");
+            }
+            break;
+        case 'O':
+            options.socks5Pipelining = true;
+            break;
+        case 'F':
+            options.earlyData = true;
+            break;
+        case 'H':
+            options.peekTargetName = true;
+            break;
+        case 'c':
+            try {
+                options.upstreamPool = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.upstreamPool = -1;
+            }
+            if (options.upstreamPool < 0) {
+                throw std::invalid_argument("Bad upstream connection pool size");
+            }
+            break;
+        case 'C':
+            try {
+                options.upstreamPoolIdle = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.upstreamPoolIdle = 0;
+            }
+            if (options.upstreamPoolIdle < 1) {
+                throw std::invalid_argument("Bad upstream connection idle time");
+            }
+            break;
+        case 'x':
+            options.extraUpstreams.push_back(optarg);
+            break;
+        case 'B':
+            if (strcmp(optarg, "leastconn") == 0) {
+                options.upstreamPolicy = UpstreamSet::Policy::LEAST_CONNECTIONS;
+            } else if (strcmp(optarg, "latency") == 0) {
+                options.upstreamPolicy = UpstreamSet::Policy::LATENCY;
+            } else {
+                throw std::invalid_argument("Bad upstream selection policy");
+            }
+            break;
+        case 'o':
+            {
+                std::string side(optarg);
+                size_t colon = side.find(':');
+                std::string option = colon == std::string::npos ? "" : side.substr(colon + 1);
+                side = side.substr(0, colon);
+                try {
+                    if (side == "client") {
+                        options.clientSocket.set(option);
+                    } else if (side == "upstream") {
+                        options.upstreamSocket.set(option);
+                    } else {
+                        throw std::runtime_error("socket options need client: or upstream:");
+                    }
+                } catch (const std::exception& e) {
+                    throw std::invalid_argument(std::string("Bad socket option: ") + e.what());
+                }
+            }
+            break;
+        case 'v':
+            if (strcmp(optarg, "error") == 0) {
+                options.logLevel = LogLevel::ERROR;
+            } else if (strcmp(optarg, "warn") == 0) {
+                options.logLevel = LogLevel::WARN;
+            } else if (strcmp(optarg, "info") == 0) {
+                options.logLevel = LogLevel::INFO;
+            } else if (strcmp(optarg, "debug") == 0) {
+                options.logLevel = LogLevel::DEBUG;
+            } else {
+                throw std::invalid_argument("Bad log level");
+            }
+            break;
+        case 'S':
+            try {
+                options.logSampleEvery = std::stoi(optarg);
+            } catch (const std::exception&) {
+                options.logSampleEvery = 0;
+            }
+            if (options.logSampleEvery < 1) {
+                throw std::invalid_argument("Bad log sampling rate");
+            }
+            break;
+        case 'M':
+            options.metricsEndpoint = optarg;
+            break;
         case 'u':
-            username = optarg;
+            options.username = optarg;
             break;
         case 'p':
-            promptPassword = true;
+            options.promptPassword = true;
             break;
         case 'P':
-            password = optarg;
+            options.password = optarg;
             break;
         case 'L':
-            print_license();
-            exit(0);
+            options.showLicense = true;
+            break;
         default:
-            std::cerr << "Bad option" << std::endl;
-            print_usage();
-            exit(1);
+            throw std::invalid_argument("Bad option");
         }
     }
-    if (argc - optind != 3) {
-        print_usage();
-        exit(1);
+    for (int i = optind; i < argc; i++) {
+        options.arguments.push_back(argv[i]);
     }
+}
+
+/// Parse the command line (words, without the program name) and, if it
+/// names one, the settings file, whose options come first, so that the
+/// command line's win. Throws std::invalid_argument for anything bad.
+Options parse_all_options(const std::vector<std::string>& words) {
+    Options commandLine;
+    parse_options(words, false, commandLine);
+    if (commandLine.settingsFile.empty() || commandLine.showLicense) {
+        return commandLine;
+    }
+    Options options;
+    parse_options(read_settings_file(commandLine.settingsFile), true, options);
+    parse_options(words, false, options);
+    return options;
+}
+
+/// Take in PROXY_HOST, PROXY_PORT and LISTEN_PORT.
+void take_arguments(Options& options) {
+    if (options.arguments.size() != 3) {
+        throw std::invalid_argument("Need PROXY_HOST, PROXY_PORT and LISTEN_PORT");
+    }
+    options.proxyHost = options.arguments[0];
     try {
-        proxyHost = argv[optind];
-        proxyPort = std::stoi(argv[optind+1]);
-        listenPort = std::stoi(argv[optind+2]);
-    } catch (const std::invalid_argument&) {
+        options.proxyPort = std::stoi(options.arguments[1]);
+        options.listenPort = std::stoi(options.arguments[2]);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("Bad port");
+    }
+}
+
+/// Check that the options go together.
+void check_options(const Options& options) {
+    if (options.workers > 1 && options.proxiedProtocol == ProxySettings::ProxiedProtocol::TCP &&
+        options.tcpEngine == ProxySettings::TcpEngine::FORK) {
+        throw std::invalid_argument("Multiple workers need the epoll or uring engine");
+    }
+
+    if (options.upstreamPool > 0 && options.tcpEngine == ProxySettings::TcpEngine::FORK) {
+        throw std::invalid_argument("Upstream connection pooling needs the epoll or uring engine");
+    }
+    if (options.upstreamPool > 0 && options.proxyProtocol == ProxySettings::ProxyProtocol::DIRECT) {
+        throw std::invalid_argument("Upstream connection pooling needs an upstream proxy");
+    }
+
+    if (!options.extraUpstreams.empty() && options.proxyProtocol == ProxySettings::ProxyProtocol::DIRECT) {
+        throw std::invalid_argument("Multiple upstream proxies need an upstream proxy");
+    }
+
+    if (options.peekTargetName && options.proxyProtocol == ProxySettings::ProxyProtocol::DIRECT) {
+        throw std::invalid_argument("Connecting by name needs an upstream proxy");
+    }
+
+    if (options.upstreamSocket.fastOpen > 0 && options.proxyProtocol == ProxySettings::ProxyProtocol::DIRECT) {
+        // Servers which speak first would never get a SYN.
+        throw std::invalid_argument("Upstream Fast Open needs an upstream proxy");
+    }
+
+    if (!options.metricsEndpoint.empty()) {
+        try {
+            MetricsServer::check_endpoint(options.metricsEndpoint);
+        } catch (const std::runtime_error& e) {
+            throw std::invalid_argument(std::string("Bad -M: ") + e.what());
+        }
+    }
+}
+
+/// Settings for options, sharing admission (which is kept over reloads, so
+/// that clients' tokens and tunnels are still counted).
+ProxySettings::Shared make_settings(const Options& options, const std::shared_ptr<Admission>& admission) {
+    ProxySettings proxySettings(options.proxyProtocol, options.proxiedProtocol, options.proxyHost, options.proxyPort,
+                                options.username, options.password);
+    proxySettings.tcpEngine = options.tcpEngine;
+    proxySettings.relayEngine = options.relayEngine;
+    proxySettings.workers = options.workers;
+    proxySettings.pinWorkers = options.pinWorkers;
+    proxySettings.udpTimeout = options.udpTimeout;
+    proxySettings.udpProxyLimit = options.udpProxyLimit;
+    proxySettings.udpSessionPool = options.udpSessionPool;
+    proxySettings.socks5Pipelining = options.socks5Pipelining;
+    proxySettings.earlyData = options.earlyData;
+    proxySettings.peekTargetName = options.peekTargetName;
+    proxySettings.upstreamPool = options.upstreamPool;
+    proxySettings.upstreamPoolIdle = options.upstreamPoolIdle;
+    proxySettings.clientSocket = options.clientSocket;
+    proxySettings.upstreamSocket = options.upstreamSocket;
+    for (const std::string& upstream : options.extraUpstreams) {
+        // HOST:PORT or HOST:PORT:WEIGHT, with an IPv6 HOST in brackets
+        size_t close = upstream[0] == '[' ? upstream.find(']') : 0;
+        size_t first = close == std::string::npos ? close : upstream.find(':', close);
+        size_t second = first == std::string::npos ? first : upstream.find(':', first + 1);
+        int port = 0;
+        int weight = 1;
+        try {
+            port = std::stoi(upstream.substr(first + 1, second - first - 1));
+            if (second != std::string::npos) {
+                weight = std::stoi(upstream.substr(second + 1));
+            }
+        } catch (const std::exception&) {
+            port = 0;
+        }
+        if (first == std::string::npos || port < 1 || port > 65535 || weight < 1) {
+            throw std::invalid_argument("Bad upstream proxy " + upstream);
+        }
+        std::string host = close > 0 ? upstream.substr(1, close - 1) : upstream.substr(0, first);
+        proxySettings.add_upstream(host, port, weight);
+    }
+    proxySettings.admission = admission;
+    proxySettings.upstreams->set_policy(options.upstreamPolicy);
+    return std::make_shared<const ProxySettings>(std::move(proxySettings));
+}
+
+/// Put back any options which only take effect at startup, saying which.
+std::string keep_restart_only(const Options& was, Options& now) {
+    std::string changes;
+    auto keep = [&changes](auto& value, const auto& startup, const char* option) {
+        if (value != startup) {
+            value = startup;
+            changes += changes.empty() ? option : std::string(", ") + option;
+        }
+    };
+    keep(now.proxiedProtocol, was.proxiedProtocol, "-r");
+    if (was.proxiedProtocol == ProxySettings::ProxiedProtocol::UDP) {
+        // Shards are made for the one kind of association.
+        keep(now.proxyProtocol, was.proxyProtocol, "-t");
+    }
+    keep(now.tcpEngine, was.tcpEngine, "-e");
+    keep(now.workers, was.workers, "-w");
+    keep(now.pinWorkers, was.pinWorkers, "-a");
+    keep(now.udpTimeout, was.udpTimeout, "-i");
+    keep(now.udpProxyLimit, was.udpProxyLimit, "-m");
+    keep(now.metricsEndpoint, was.metricsEndpoint, "-M");
+    keep(now.handoffPath, was.handoffPath, "-U");
+    keep(now.listenPort, was.listenPort, "LISTEN_PORT");
+    return changes;
+}
+
+/// On SIGHUP (which must already be blocked in every thread), read the
+/// settings file again, and use what it now says for new tunnels and
+/// associations. Bad settings are logged and ignored.
+void reload_on_hangup(const std::vector<std::string>& words, const Options& initial, LiveSettings& live) {
+    std::thread([words, initial, &live] {
+            sigset_t hangup;
+            sigemptyset(&hangup);
+            sigaddset(&hangup, SIGHUP);
+            while (true) {
+                int signal;
+                if (sigwait(&hangup, &signal) != 0) {
+                    continue;
+                }
+                try {
+                    Options options = parse_all_options(words);
+                    take_arguments(options);
+                    std::string ignored = keep_restart_only(initial, options);
+                    check_options(options);
+                    if (initial.promptPassword) {
+                        // Asked for once, at startup.
+                        options.password = initial.password;
+                    }
+                    ProxySettings::Shared current = live.get();
+                    ProxySettings::Shared settings = make_settings(options, current->admission);
+                    settings->admission->set_rate(options.admissionRate, options.admissionBurst);
+                    settings->admission->set_max_tunnels(options.maxTunnels);
+                    settings->upstreams->start_health_checks();
+                    Log::set_level(options.logLevel);
+                    Log::set_sample_every(options.logSampleEvery);
+                    if (!ignored.empty()) {
+                        Log::message(LogLevel::WARN, "Ignoring changes to ", ignored, " until restart");
+                    }
+                    live.set(settings);
+                    Log::message(LogLevel::INFO, "Reloaded settings from ", options.settingsFile);
+                } catch (const std::exception& e) {
+                    Log::message(LogLevel::ERROR, "Reload failed, keeping the settings as they were: ", e.what());
+                }
+            }
+        }).detach();
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> words(argv + 1, argv + argc);
+    Options options;
+    try {
+        options = parse_all_options(words);
+        if (options.showLicense) {
+            print_license();
+            exit(0);
+        }
+        take_arguments(options);
+        check_options(options);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
         print_usage();
         exit(1);
     }
 
-    if (promptPassword) {
+    if (options.promptPassword) {
         struct termios tty;
         tcgetattr(STDIN_FILENO, &tty);
         tty.c_lflag &= ~ECHO;
@@ -290,7 +878,7 @@ int main(int argc, char **argv) {
         std::cerr << "Please enter your proxy's password:" << std::endl;
         char passwordCstr[256] = {};
         std::cin.getline(passwordCstr, 256);
-        password = passwordCstr;
+        options.password = passwordCstr;
         tty.c_lflag |= ECHO;
         tcsetattr(STDIN_FILENO, TCSANOW, &tty);
         if (std::cin.fail()) {
@@ -299,15 +887,78 @@ int main(int argc, char **argv) {
         }
     }
 
-    ProxySettings proxySettings(proxyProtocol, proxiedProtocol, proxyHost, proxyPort, username, password);
+    if (!options.settingsFile.empty()) {
+        // Before any threads start, so that they all leave it to the one
+        // waiting for it.
+        sigset_t hangup;
+        sigemptyset(&hangup);
+        sigaddset(&hangup, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &hangup, nullptr);
+    }
+
+    Log::set_level(options.logLevel);
+    Log::set_sample_every(options.logSampleEvery);
+    Log::start();
+    Metrics::init();
+
+    ProxySettings::Shared settings;
+    try {
+        settings = make_settings(options, std::make_shared<Admission>());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    settings->admission->set_rate(options.admissionRate, options.admissionBurst);
+    settings->admission->set_max_tunnels(options.maxTunnels);
+    LiveSettings live(settings);
+
+    // Only once the settings are known to be good, as the running
+    // instance drains as soon as it's asked.
+    size_t listeners = options.proxiedProtocol == ProxySettings::ProxiedProtocol::TCP ? TcpServer::listeners_needed(*settings)
+        : size_t(settings->workers);
+    Handoff handoff(options.handoffPath, options.proxiedProtocol, options.listenPort, listeners, options.metricsEndpoint);
+    try {
+        handoff.take_over();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+
+    std::unique_ptr<MetricsServer> metricsServer;
+    try {
+        if (handoff.metrics_listener() >= 0) {
+            metricsServer.reset(new MetricsServer(handoff.metrics_listener()));
+        } else if (!options.metricsEndpoint.empty()) {
+            metricsServer.reset(new MetricsServer(options.metricsEndpoint));
+        }
+    } catch (const std::exception& e) {
+        // Such as the endpoint being in use.
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    if (metricsServer) {
+        handoff.offer_metrics(metricsServer->fd());
+        metricsServer->start(handoff.stop_fd());
+    }
+
+    settings->upstreams->start_health_checks();
+    if (!options.settingsFile.empty()) {
+        reload_on_hangup(words, options, live);
+    }
 
-    switch (proxiedProtocol) {
-    case ProxySettings::ProxiedProtocol::TCP:
-        TcpServer(proxySettings, listenPort).run();
-        break;
-    case ProxySettings::ProxiedProtocol::UDP:
-        UdpServer(proxySettings, listenPort).run();
-        break;
+    try {
+        switch (options.proxiedProtocol) {
+        case ProxySettings::ProxiedProtocol::TCP:
+            TcpServer(live, handoff, options.listenPort).run();
+            break;
+        case ProxySettings::ProxiedProtocol::UDP:
+            UdpServer(live, handoff, options.listenPort).run();
+            break;
+        }
+    } catch (const std::exception& e) {
+        Log::message(LogLevel::ERROR, "Error: ", e.what());
+        Log::flush();
+        exit(1);
     }
 
     // Unreachable?